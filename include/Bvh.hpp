@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <glm/vec3.hpp>
+
+namespace ve
+{
+    struct BvhRay
+    {
+        glm::vec3 origin;
+        glm::vec3 dir;
+        float t_min = 0.0f;
+        float t_max = std::numeric_limits<float>::max();
+    };
+
+    struct BvhHit
+    {
+        float t = std::numeric_limits<float>::max();
+        // index of the triangle in the index buffer the bvh was built from (index / 3), -1 if nothing was hit
+        uint32_t primitive = uint32_t(-1);
+        // barycentric coordinates of the hit point with respect to the second and third vertex
+        float u = 0.0f;
+        float v = 0.0f;
+    };
+
+    // leaves have count > 0 and store their triangles from first on, inner nodes have their children at first and first + 1
+    // children are always stored after their parent, so iterating the nodes backwards visits all children before their parent
+    struct BvhNode
+    {
+        glm::vec3 min;
+        uint32_t first = 0;
+        glm::vec3 max;
+        uint32_t count = 0;
+    };
+
+    // cpu bounding volume hierarchy over a triangle mesh with the same hit semantics as the ray queries in the shaders (opaque, no face culling)
+    // built with a binned surface area heuristic; the subtrees below the first levels are built in parallel
+    class Bvh
+    {
+    public:
+        // triangles are given by index triples into positions; thread_count 0 uses all hardware threads
+        void build(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices, uint32_t thread_count = 0);
+        // for vertex types with a pos member, e.g. Vertex of the scene models or TunnelVertex
+        template<typename V>
+        void build(const std::vector<V>& vertices, const std::vector<uint32_t>& indices, uint32_t thread_count = 0)
+        {
+            build(get_positions(vertices), indices, thread_count);
+        }
+        // only updates the bounds for moved vertices with the same triangles, the tree is kept and its quality degrades the more the vertices moved
+        void refit(const std::vector<glm::vec3>& positions);
+        template<typename V>
+        void refit(const std::vector<V>& vertices)
+        {
+            refit(get_positions(vertices));
+        }
+        // closest hit
+        BvhHit intersect(const BvhRay& ray) const;
+        // any hit, e.g. for shadow rays
+        bool occluded(const BvhRay& ray) const;
+        // traverses the rays of a packet together with simd lanes, which is faster than single rays if the rays of a packet are coherent
+        void intersect_packet(const BvhRay* rays, uint32_t count, BvhHit* hits) const;
+        // occluded[i] is set to 1 if ray i hits something
+        void occluded_packet(const BvhRay* rays, uint32_t count, uint8_t* occluded) const;
+        const std::vector<BvhNode>& get_nodes() const;
+        uint32_t get_triangle_count() const;
+        // expected cost of a random ray relative to intersecting one triangle, traversal steps count as much as a triangle
+        float get_sah_cost() const;
+
+        template<typename V>
+        static std::vector<glm::vec3> get_positions(const std::vector<V>& vertices)
+        {
+            std::vector<glm::vec3> positions;
+            positions.reserve(vertices.size());
+            for (const V& v : vertices) positions.push_back(v.pos);
+            return positions;
+        }
+
+    private:
+        struct Triangle
+        {
+            glm::vec3 v0;
+            glm::vec3 e1;
+            glm::vec3 e2;
+        };
+
+        std::vector<BvhNode> nodes;
+        // triangles in the order of the leaves and their index in the index buffer
+        std::vector<Triangle> triangles;
+        std::vector<uint32_t> primitive_ids;
+        std::vector<uint32_t> indices;
+
+        void update_triangles(const std::vector<glm::vec3>& positions);
+        template<typename T, bool any_hit>
+        void traverse(const BvhRay* rays, uint32_t count, BvhHit* hits, uint8_t* occluded) const;
+    };
+} // namespace ve
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ve
+{
+    constexpr uint32_t noise_texture_dim = 2048;
+    constexpr uint32_t noise_texture_layer_count = 2;
+    constexpr const char* noise_texture_shader_binary = "../shader/bin/create_noise_textures.comp.spv";
+    constexpr const char* noise_texture_cache_dir = "../cache/";
+    // the lattice hash is an integer hash and bit exact on both sides; sin, length and fused multiply-adds in the smooth parts of the noise may still
+    // round differently on the gpu, which moves a texel of a gpu-written cache by a few steps of the 8 bit channels
+    constexpr float noise_texture_max_error = 8.0f / 255.0f;
+    constexpr float noise_texture_mean_error = 1.0f / 255.0f;
+
+    using NoiseTextureLayers = std::vector<std::vector<unsigned char>>;
+
+    // key of the on-disk cache; changes whenever the generating shader or the texture parameters change
+    uint64_t noise_texture_cache_key(uint32_t dim);
+    std::string noise_texture_cache_path(uint64_t key);
+    bool load_noise_texture_cache(uint64_t key, uint32_t dim, NoiseTextureLayers& layers);
+    void save_noise_texture_cache(uint64_t key, uint32_t dim, const NoiseTextureLayers& layers);
+
+    // cpu port of create_noise_textures.comp that produces the same rgba8 layers without a gpu
+    // only every row_step-th row is generated, the remaining rows are left zero
+    NoiseTextureLayers generate_noise_textures(uint32_t dim, uint32_t row_step = 1);
+
+    struct NoiseTextureError
+    {
+        float max = 0.0f;
+        float mean = 0.0f;
+    };
+
+    // compares two noise texture sets in the rows that are covered by row_step; errors are normalized to [0, 1]
+    NoiseTextureError compare_noise_textures(const NoiseTextureLayers& a, const NoiseTextureLayers& b, uint32_t dim, uint32_t row_step = 1);
+} // namespace ve
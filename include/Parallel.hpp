@@ -0,0 +1,26 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace ve
+{
+    // calls f(i) for every i in [0, count) distributed over thread_count threads (0 uses all hardware threads)
+    template<typename F>
+    void parallel_for(uint32_t count, F&& f, uint32_t thread_count = 0)
+    {
+        if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+        thread_count = std::min(thread_count, count);
+        std::atomic<uint32_t> next = 0;
+        auto worker = [&]() {
+            for (uint32_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) f(i);
+        };
+        std::vector<std::thread> threads(thread_count > 0 ? thread_count - 1 : 0);
+        for (auto& t : threads) t = std::thread(worker);
+        worker();
+        for (auto& t : threads) t.join();
+    }
+} // namespace ve
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ve
+{
+    // budgets that trade quality for performance; they are read at startup, so changing them does not need a rebuild
+    struct RuntimeConfig
+    {
+        uint32_t segment_count = 16; // how many segments are in the tunnel (must be power of two)
+        uint32_t samples_per_segment = 32; // how many sample rings one segment is made of
+        uint32_t vertices_per_sample = 360; // how many vertices are sampled in one sample ring
+        uint32_t fireflies_per_segment = 15;
+        uint32_t jet_particle_count = 20000;
+        uint32_t reservoir_count = 4;
+        // 1 stores only the distance to the center line and a packed normal per tunnel vertex, 0 stores the full vertex
+        uint32_t compact_tunnel_vertices = 0;
+        // initial firefly lighting: 0 evaluates all fireflies per pixel, 1 uses the irradiance cache for far tunnel pixels, 2 for all tunnel pixels
+        uint32_t irradiance_cache_mode = 1;
+        // 1 builds the acceleration structures of the scene models on the host with worker threads if the device supports acceleration structure host commands
+        uint32_t host_blas_builds = 0;
+    };
+
+    struct RuntimeConfigParameter
+    {
+        const char* name;
+        uint32_t RuntimeConfig::* value;
+    };
+
+    // name of every parameter in the config and sweep files
+    constexpr std::array<RuntimeConfigParameter, 9> runtime_config_parameters = {{
+        {"segment_count", &RuntimeConfig::segment_count},
+        {"samples_per_segment", &RuntimeConfig::samples_per_segment},
+        {"vertices_per_sample", &RuntimeConfig::vertices_per_sample},
+        {"fireflies_per_segment", &RuntimeConfig::fireflies_per_segment},
+        {"jet_particle_count", &RuntimeConfig::jet_particle_count},
+        {"reservoir_count", &RuntimeConfig::reservoir_count},
+        {"compact_tunnel_vertices", &RuntimeConfig::compact_tunnel_vertices},
+        {"irradiance_cache_mode", &RuntimeConfig::irradiance_cache_mode},
+        {"host_blas_builds", &RuntimeConfig::host_blas_builds}
+    }};
+
+    // values of the active config, only apply_runtime_config may change them
+    // all buffers and pipelines that depend on them have to be (re)created after a change
+    inline uint32_t segment_count = RuntimeConfig().segment_count;
+    inline uint32_t samples_per_segment = RuntimeConfig().samples_per_segment;
+    inline uint32_t vertices_per_sample = RuntimeConfig().vertices_per_sample;
+    inline uint32_t fireflies_per_segment = RuntimeConfig().fireflies_per_segment;
+    inline uint32_t jet_particle_count = RuntimeConfig().jet_particle_count;
+    inline uint32_t reservoir_count = RuntimeConfig().reservoir_count;
+    inline uint32_t compact_tunnel_vertices = RuntimeConfig().compact_tunnel_vertices;
+    inline uint32_t irradiance_cache_mode = RuntimeConfig().irradiance_cache_mode;
+    inline uint32_t host_blas_builds = RuntimeConfig().host_blas_builds;
+    // derived from the values above
+    inline uint32_t vertex_count = segment_count * samples_per_segment * vertices_per_sample;
+    inline uint32_t vertices_per_segment = samples_per_segment * vertices_per_sample;
+    // two triangles per vertex on a sample (3 indices per triangle); every sample of a segment except the last one has triangles
+    inline uint32_t indices_per_segment = (samples_per_segment - 1) * vertices_per_sample * 6;
+    inline uint32_t index_count = indices_per_segment * segment_count;
+    inline uint32_t firefly_count = fireflies_per_segment * segment_count;
+
+    // returns an empty string if config is valid and the reason otherwise
+    std::string check_runtime_config(const RuntimeConfig& config);
+    // parameters that are missing in the file keep the values of base
+    RuntimeConfig load_runtime_config(const std::string& path, const RuntimeConfig& base = RuntimeConfig());
+    void apply_runtime_config(const RuntimeConfig& config);
+    std::string to_string(const RuntimeConfig& config);
+
+    struct RuntimeConfigSweep
+    {
+        uint32_t warmup_frames = 100;
+        uint32_t frames = 1000;
+        std::string output = "sweep.csv";
+        std::vector<RuntimeConfig> configs;
+    };
+
+    // builds the grid of all value combinations listed in the "parameters" object of the file; invalid combinations are skipped
+    RuntimeConfigSweep load_runtime_config_sweep(const std::string& path, const RuntimeConfig& base);
+} // namespace ve
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+#if __has_include(<experimental/simd>)
+#include <experimental/simd>
+#define VE_SIMD_LANES
+#endif
+
+namespace ve
+{
+#if defined(VE_SIMD_LANES)
+    namespace stdx = std::experimental;
+    // widest float vector of the target, e.g. 8 lanes with AVX2
+    using FloatLanes = stdx::native_simd<float>;
+#else
+    // scalar fallback if the standard library does not ship the parallelism TS
+    using FloatLanes = float;
+#endif
+
+    // helpers that work on both FloatLanes and plain floats so that kernels only have to be written once
+    template<typename T>
+    constexpr uint32_t lane_count()
+    {
+        if constexpr (std::is_same_v<T, float>) return 1;
+        else return T::size();
+    }
+
+    // returns (start, start + 1, ..., start + lane_count - 1)
+    template<typename T>
+    inline T lane_iota(float start)
+    {
+        if constexpr (std::is_same_v<T, float>) return start;
+        else return T([start](auto i) { return start + float(i); });
+    }
+
+    // loads count consecutive floats, remaining lanes are zero
+    template<typename T>
+    inline T lane_load(const float* data, uint32_t count)
+    {
+        if constexpr (std::is_same_v<T, float>) return data[0];
+        else return T([data, count](auto i) { return i < count ? data[i] : 0.0f; });
+    }
+
+    template<typename T>
+    inline float lane_get(const T& v, uint32_t i)
+    {
+        if constexpr (std::is_same_v<T, float>) return v;
+        else return v[i];
+    }
+
+    template<typename T, typename M>
+    inline T lane_select(const M& mask, const T& a, const T& b)
+    {
+        if constexpr (std::is_same_v<T, float>)
+        {
+            return mask ? a : b;
+        }
+        else
+        {
+            T r = b;
+            where(mask, r) = a;
+            return r;
+        }
+    }
+
+    template<typename T>
+    inline T lane_floor(const T& v)
+    {
+        using std::floor;
+        return floor(v);
+    }
+
+    template<typename T>
+    inline T lane_fract(const T& v)
+    {
+        return v - lane_floor(v);
+    }
+
+    template<typename T>
+    inline T lane_sin(const T& v)
+    {
+        using std::sin;
+        return sin(v);
+    }
+
+    template<typename T>
+    inline T lane_cos(const T& v)
+    {
+        using std::cos;
+        return cos(v);
+    }
+
+    template<typename T>
+    inline T lane_sqrt(const T& v)
+    {
+        using std::sqrt;
+        return sqrt(v);
+    }
+
+    template<typename T>
+    inline T lane_abs(const T& v)
+    {
+        using std::fabs;
+        return fabs(v);
+    }
+
+    template<typename T>
+    inline T lane_min(const T& a, const T& b)
+    {
+        return lane_select(b < a, b, a);
+    }
+
+    template<typename T>
+    inline T lane_max(const T& a, const T& b)
+    {
+        return lane_select(a < b, b, a);
+    }
+
+    template<typename T>
+    inline T lane_clamp(const T& v, float lo, float hi)
+    {
+        return lane_min(lane_max(v, T(lo)), T(hi));
+    }
+
+    // reductions of the masks that comparisons of FloatLanes (or bools for plain floats) return
+    template<typename M>
+    inline bool lane_any(const M& mask)
+    {
+        if constexpr (std::is_same_v<M, bool>) return mask;
+        else return any_of(mask);
+    }
+
+    template<typename M>
+    inline bool lane_all(const M& mask)
+    {
+        if constexpr (std::is_same_v<M, bool>) return mask;
+        else return all_of(mask);
+    }
+
+    template<typename M>
+    inline bool lane_test(const M& mask, uint32_t i)
+    {
+        if constexpr (std::is_same_v<M, bool>) return mask;
+        else return mask[i];
+    }
+
+    template<typename T>
+    inline float lane_hmin(const T& v)
+    {
+        if constexpr (std::is_same_v<T, float>) return v;
+        else return hmin(v);
+    }
+} // namespace ve
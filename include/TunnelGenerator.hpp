@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <queue>
+#include <random>
+#include <vector>
+#include <glm/vec3.hpp>
+
+#include "vk/common.hpp"
+
+namespace ve
+{
+    // control points and id of one tunnel segment, i.e. the relevant part of NewSegmentPushConstants
+    struct TunnelSegmentPoints
+    {
+        glm::vec3 p0;
+        glm::vec3 p1;
+        glm::vec3 p2;
+        uint32_t segment_uid;
+    };
+
+    // produces the sequence of Bézier control points the tunnel is made of
+    class TunnelPath
+    {
+    public:
+        TunnelPath(float segment_scale, uint32_t seed = 0);
+        TunnelSegmentPoints first_segment() const;
+        // continues the curve of the given segment with a new segment
+        TunnelSegmentPoints next_segment(const TunnelSegmentPoints& segment);
+        glm::vec3 pop_bezier_point_queue(const glm::vec3& p0, const glm::vec3& p1);
+
+    private:
+        float segment_scale;
+        std::queue<glm::vec3> bezier_points_queue;
+        std::mt19937 rnd;
+        std::uniform_real_distribution<float> dis;
+
+        glm::vec3 random_cosine(const glm::vec3& normal, const float cosine_weight = 40.0f);
+    };
+
+    // center of a sample ring and the terms of the rotation of plane_vector around the ring's normal that do not depend on the angle
+    struct TunnelRingFrame
+    {
+        glm::vec3 center;
+        glm::vec3 plane_normal;
+        glm::vec3 plane_vector;
+        glm::vec3 kv;
+        glm::vec3 kkv;
+    };
+
+    // ring at curve parameter t of the segment, the first vertex of a ring lies in direction plane_vector
+    TunnelRingFrame get_tunnel_ring_frame(const TunnelSegmentPoints& segment, float t);
+    // length of the center line of the segment between its start and curve parameter t
+    float get_tunnel_arc_length(const TunnelSegmentPoints& segment, float t);
+    // curve parameter at which the center line reaches arc_fraction of the length of the segment
+    // ring i of a segment is at arc_fraction = i / (samples_per_segment - 1), so the rings are evenly spaced along the tunnel
+    float get_tunnel_ring_parameter(const TunnelSegmentPoints& segment, float arc_fraction);
+    // distance of the tunnel wall to the center line at arc_fraction along the segment and angle_fraction (angle / 360 degrees) around it
+    // at arc_fraction = ring / (samples_per_segment - 1) and angle_fraction = vertex / vertices_per_sample this is the radius of the tunnel vertex
+    float get_tunnel_wall_radius(uint32_t segment_uid, float arc_fraction, float angle_fraction);
+    // ambient occlusion in [0, 1] of the wall point with the given radius from the horizon of the displaced wall around it, same as get_tunnel_wall_occlusion in tunnel_query.glsl
+    float get_tunnel_wall_occlusion(uint32_t segment_uid, float arc_fraction, float angle_fraction, float radius, float segment_length);
+
+    // cpu reference of tunnel.comp; writes vertices in the exact layout of the tunnel vertex buffer
+    class TunnelGenerator
+    {
+    public:
+        TunnelGenerator(uint32_t samples_per_segment, uint32_t vertices_per_sample);
+        uint32_t get_vertices_per_segment() const;
+        // out needs space for get_vertices_per_segment() vertices
+        void generate_segment(const TunnelSegmentPoints& segment, TunnelVertex* out) const;
+        // generates all segments consecutively into out; work is distributed over thread_count threads (0 uses all hardware threads)
+        void generate_segments(const std::vector<TunnelSegmentPoints>& segments, std::vector<TunnelVertex>& out, uint32_t thread_count = 0) const;
+        // full density triangulation of a segment whose vertices start at first_vertex, same as level 0 of the tunnel index pattern
+        void append_segment_indices(std::vector<uint32_t>& indices, uint32_t first_vertex) const;
+        // conversion of the vertices of one segment between TunnelVertex and CompactTunnelVertex, mirrors tunnel.comp and unpack_compact_tunnel_vertex in common.glsl
+        void compact_segment(const TunnelSegmentPoints& segment, const TunnelVertex* in, CompactTunnelVertex* out) const;
+        void expand_segment(const TunnelSegmentPoints& segment, const CompactTunnelVertex* in, TunnelVertex* out) const;
+
+    private:
+        uint32_t samples_per_segment;
+        uint32_t vertices_per_sample;
+        // rotation angle of every vertex in a sample ring
+        std::vector<float> ring_cos;
+        std::vector<float> ring_sin;
+
+        TunnelRingFrame get_ring_frame(const TunnelSegmentPoints& segment, uint32_t sample_circle_id) const;
+        glm::vec3 get_ring_direction(const TunnelRingFrame& frame, uint32_t vertex_id) const;
+        void generate_ring(const TunnelSegmentPoints& segment, uint32_t sample_circle_id, TunnelVertex* out) const;
+        void compute_ring_normals(uint32_t sample_circle_id, TunnelVertex* out) const;
+    };
+
+    struct TunnelSegmentError
+    {
+        float max_position = 0.0f;
+        float max_normal = 0.0f;
+        float max_ao = 0.0f;
+        uint32_t vertices_out_of_tolerance = 0;
+    };
+
+    // same encoding as pack_octahedral_normal and unpack_octahedral_normal in common.glsl
+    uint32_t pack_octahedral_normal(glm::vec3 n);
+    glm::vec3 unpack_octahedral_normal(uint32_t packed_normal);
+    // same as pack_compact_tunnel_normal_ao and unpack_compact_tunnel_ao in common.glsl
+    uint32_t pack_compact_tunnel_normal_ao(const glm::vec3& normal, float ao);
+    float unpack_compact_tunnel_ao(uint32_t normal_ao);
+
+    // compares two sets of tunnel vertices; a vertex is out of tolerance if its position or normal differ by more than the given values
+    TunnelSegmentError compare_tunnel_vertices(const TunnelVertex* a, const TunnelVertex* b, uint32_t count, float position_tolerance, float normal_tolerance);
+} // namespace ve
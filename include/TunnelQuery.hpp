@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/vec3.hpp>
+
+#include "TunnelGenerator.hpp"
+
+namespace ve
+{
+    // position relative to the center line of the tunnel and the wall around it; tunnel_query.glsl answers the same queries in the shaders
+    struct TunnelQueryResult
+    {
+        uint32_t segment_uid = 0;
+        // curve parameter of the closest point on the center line
+        float t = 0.0f;
+        // fraction of the length of the segment up to the closest point, ring i of the segment is at i / (samples_per_segment - 1)
+        float arc_fraction = 0.0f;
+        // angle around the center line in [0, 1), vertex j of a ring is at j / vertices_per_sample
+        float angle_fraction = 0.0f;
+        glm::vec3 center = glm::vec3(0.0f);
+        float center_distance = 0.0f;
+        float wall_radius = 0.0f;
+        // distance to the wall in the plane of the ring, positive inside the tunnel
+        float wall_distance = 0.0f;
+    };
+
+    // curve parameter in [0, 1] of the point on the quadratic Bézier curve that is closest to pos
+    float get_closest_bezier_parameter(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& pos);
+    TunnelQueryResult query_tunnel_segment(const TunnelSegmentPoints& segment, const glm::vec3& pos);
+    // result for the segment whose center line is closest to pos; segments must not be empty
+    TunnelQueryResult query_tunnel(const std::vector<TunnelSegmentPoints>& segments, const glm::vec3& pos);
+} // namespace ve
@@ -23,5 +23,21 @@ namespace ve
         float frametime = 0.0f;
         std::vector<FixVector<float>> devicetiming_values;
         std::vector<float> devicetimings;
+        // moving average of how often the top level acceleration structure is built or refit
+        float tlas_builds_per_frame = 0.0f;
+        float tlas_refits_per_frame = 0.0f;
+        // index 0: fixed density, index 1: adaptive tessellation
+        std::array<float, 2> tessellation_frametimes = {0.0f, 0.0f};
+        std::array<float, 2> tessellation_blas_timings = {0.0f, 0.0f};
+        // index 0: one acceleration structure for the whole tunnel, index 1: one per segment slot
+        std::array<float, 2> blas_ring_timings = {0.0f, 0.0f};
+        // indexed by collision mode
+        std::array<float, 3> collision_timings = {0.0f, 0.0f, 0.0f};
+        // indexed by irradiance cache mode
+        std::array<float, 3> irradiance_cache_frametimes = {0.0f, 0.0f, 0.0f};
+        std::array<float, 3> irradiance_cache_lighting_timings = {0.0f, 0.0f, 0.0f};
+        // index 0: segments generated on demand, index 1: prefetched segments
+        std::array<FixVector<float>, 2> prefetch_frametime_values;
+        std::array<uint32_t, 2> prefetch_frametime_counts = {0, 0};
 	};
 } // namespace ve
@@ -37,6 +37,8 @@ namespace ve
         Pipeline lighting_pipeline_0;
         Pipeline lighting_pipeline_1;
         DescriptorSetHandler lighting_dsh;
+        // duration of the last load_scene in ms
+        double load_time = 0.0;
 
         void draw_frame(GameState& gs);
         vk::Extent2D recreate_swapchain();
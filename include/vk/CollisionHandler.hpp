@@ -1,5 +1,7 @@
 #pragma once
 
+#include <optional>
+
 #include "VulkanMainContext.hpp"
 #include "Storage.hpp"
 #include "common.hpp"
@@ -17,8 +19,13 @@ namespace ve
         void reload_shaders(const RenderPass& render_pass);
         void self_destruct(bool full = true);
         void draw(vk::CommandBuffer& cb, GameState& gs, const glm::mat4& mvp);
-        void compute(GameState& gs, DeviceTimer& timer);
+        // player_m is the model matrix of the player in this frame, the collision rays sweep the bounding box from the one of the last call to it
+        void compute(GameState& gs, DeviceTimer& timer, const glm::mat4& player_m);
         int32_t get_shader_return_value(uint32_t frame_idx);
+        // triangles that the broad phase of the last submission of the frame left for the narrow phase
+        uint32_t get_candidate_triangle_count(uint32_t frame_idx);
+        // closest hit of the collision rays of the last submission of the frame
+        CollisionRayHit get_closest_ray_hit(uint32_t frame_idx);
         void reset_shader_return_values(uint32_t frame_idx);
     private:
         struct BoundingBox
@@ -35,9 +42,17 @@ namespace ve
         BoundingBox bb;
         uint32_t bb_buffer;
         std::vector<uint32_t> return_buffers;
+        std::vector<uint32_t> candidate_buffers;
+        std::vector<uint32_t> ray_hit_buffers;
+        std::optional<glm::mat4> prev_player_m;
         uint32_t vertex_buffer;
         DescriptorSetHandler compute_dsh;
+        // tests all triangles of the player's segments
         Pipeline compute_pipeline;
+        Pipeline broad_phase_pipeline;
+        // only tests the candidates of the broad phase
+        Pipeline narrow_phase_pipeline;
+        Pipeline ray_pipeline;
         Pipeline render_pipeline;
 
         void construct_pipelines(const RenderPass& render_pass);
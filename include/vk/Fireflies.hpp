@@ -7,6 +7,11 @@
 
 namespace ve
 {
+    // every segment has an irradiance cache of the fireflies around it with irradiance_cache_rings x irradiance_cache_angles cells
+    // the cells are placed like the vertices of a tunnel segment with that many sample rings and vertices per ring
+    constexpr uint32_t irradiance_cache_rings = 8;
+    constexpr uint32_t irradiance_cache_angles = 16;
+
     class Fireflies
     {
     public:
@@ -17,8 +22,12 @@ namespace ve
         void reload_shaders(const RenderPass& render_pass);
         void draw(vk::CommandBuffer& cb, GameState& gs);
         void move_step(vk::CommandBuffer& cb, const GameState& gs, DeviceTimer& timer, FireflyMovePushConstants& fmpc);
+        // has to be recorded after all fireflies of the frame were moved and spawned
+        void update_irradiance_cache(vk::CommandBuffer& cb, const GameState& gs, DeviceTimer& timer, FireflyMovePushConstants& fmpc);
 
         std::vector<uint32_t> vertex_buffers;
+        // one per frame in flight like the vertex buffers, the lighting pass of a frame reads the cache of the same frame
+        std::vector<uint32_t> irradiance_cache_buffers;
 
     private:
         const VulkanMainContext& vmc;
@@ -31,6 +40,7 @@ namespace ve
         Pipeline render_pipeline;
         Pipeline move_compute_pipeline;
         Pipeline tunnel_collision_compute_pipeline;
+        Pipeline irradiance_cache_compute_pipeline;
         
         void construct_pipelines(const RenderPass& render_pass);
     };
@@ -11,6 +11,7 @@ namespace ve
     {
         Graphics,
         Compute,
+        AsyncCompute,
         Transfer,
         Present
     };
@@ -21,8 +22,11 @@ namespace ve
         LogicalDevice(const PhysicalDevice& p_device, const QueueFamilyIndices& queue_family_indices, std::unordered_map<QueueIndex, vk::Queue>& queues);
         void self_destruct();
         const vk::Device& get() const;
+        // acceleration structures can be built on the host with deferred operations
+        bool supports_acceleration_structure_host_commands() const;
 
     private:
         vk::Device device;
+        bool acceleration_structure_host_commands = false;
     };
 } // namespace ve
@@ -12,15 +12,23 @@ namespace ve
         vk::AccelerationStructureKHR handle;
         uint64_t deviceAddress = 0;
         uint32_t buffer;
-        uint32_t scratch_buffer;;
+        // scratch memory needed by a build or an update, it is taken from the scratch arena of the frame
+        vk::DeviceSize scratch_size = 0;
         bool is_built = false;
+        // built with eAllowUpdate, so it can be refit as long as the geometries keep their primitive counts
+        bool allow_update = false;
+        // built with eAllowCompaction, it is copied into a right-sized buffer once its compacted size was queried and must not be built again
+        bool compact = false;
+        uint32_t compaction_query = uint32_t(-1);
+        // built once and referenced by the top level acceleration structures of both frames, the entry of the second frame only marks it
+        bool shared = false;
     };
 
     struct TopLevelAccelerationStructure {
         vk::AccelerationStructureKHR handle;
         uint64_t deviceAddress = 0;
         uint32_t buffer;
-        uint32_t scratch_buffer;
+        vk::DeviceSize scratch_size = 0;
         bool is_built = false;
     };
 
@@ -31,20 +39,97 @@ namespace ve
         const std::vector<uint32_t> index_counts;
         vk::DeviceSize vertex_stride;
         uint32_t blas_idx;
+        const std::vector<uint32_t> first_vertices;
+        vk::IndexType index_type;
+        bool refit;
     };
 
+    // what create_tlas has to do for a frame; added instances need a full build, changed transforms, masks and bottom level acceleration structures only a refit
+    enum class TLASUpdate
+    {
+        None = 0,
+        Refit = 1,
+        Build = 2
+    };
+
+    // every compacted bottom level acceleration structure needs one query for its compacted size
+    constexpr uint32_t max_compaction_queries = 256;
+
+    // refits let the top level acceleration structure degrade, so it is built again after this many refits in a row
+    constexpr uint32_t max_tlas_refits = 64;
+
     class PathTracer
     {
     public:
         PathTracer(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage);
         void self_destruct();
-        uint32_t add_blas(vk::CommandBuffer& cb, uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, vk::DeviceSize vertex_stride);
+        // first_vertices is added to the indices of the corresponding geometry, empty if all geometries index the vertex buffer from the start
+        // index_offsets count in indices of index_type
+        // allow_update has to be set for acceleration structures that are refit later, compact for static ones that are never built again
+        // static ones are shared by the frames in flight, all others have a copy per frame so that one frame can build it while the other one still traces it
+        // name is only used to report the memory reclaimed by the compaction
+        uint32_t add_blas(vk::CommandBuffer& cb, uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, vk::DeviceSize vertex_stride, const std::vector<uint32_t>& first_vertices = {}, vk::IndexType index_type = vk::IndexType::eUint32, bool allow_update = false, bool compact = false, const std::string& name = "");
+        // same as add_blas, but the build is only recorded by build_blas_batch together with the other acceleration structures added to the batch
+        // the acceleration structure is created right away, so instances can already be added for it
+        uint32_t add_blas_to_batch(uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, vk::DeviceSize vertex_stride, const std::vector<uint32_t>& first_vertices = {}, vk::IndexType index_type = vk::IndexType::eUint32, bool allow_update = false, bool compact = false, const std::string& name = "");
+        // records the builds of the batch with a single build command and a single barrier
+        void build_blas_batch(vk::CommandBuffer& cb);
+        // acceleration structure host commands and deferred host operations are supported
+        bool supports_host_builds() const;
+        // builds a static acceleration structure on the host, vertices and indices are read from host memory and have to stay valid until build_host_blas_batch returned
+        // it is compacted and shared by the frames in flight like the ones added with compact
+        uint32_t add_host_blas_to_batch(const void* vertices, uint32_t vertex_count, vk::DeviceSize vertex_stride, const uint32_t* indices, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, const std::string& name = "");
+        // builds the host batch with one deferred operation that up to thread_count threads join (0 uses all hardware threads)
+        // the compacted copies into device local memory are recorded into cb
+        void build_host_blas_batch(vk::CommandBuffer& cb, uint32_t thread_count = 0);
         uint32_t add_instance(uint32_t blas_idx, const glm::mat4& M, uint32_t custom_index);
         void update_instance(uint32_t instance_idx, const glm::mat4& M);
-        void create_tlas(vk::CommandBuffer& cb, uint32_t idx);
-        void update_blas(uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, uint32_t blas_idx, uint32_t frame_idx, vk::DeviceSize vertex_stride);
+        // ray queries only hit instances whose mask shares a bit with their cull mask, 0 hides the instance
+        void set_instance_mask(uint32_t instance_idx, uint8_t mask);
+        bool has_dirty_blas(uint32_t frame_idx) const;
+        bool has_dirty_blas(uint32_t frame_idx, bool refit) const;
+        // builds the bottom level acceleration structures of the given frame that were marked by update_blas
+        void build_dirty_blas(vk::CommandBuffer& cb, uint32_t frame_idx);
+        // only builds the marked acceleration structures that are refit (or only the ones that are rebuilt) to be able to time them separately
+        void build_dirty_blas(vk::CommandBuffer& cb, uint32_t frame_idx, bool refit);
+        // destroys the acceleration structures and scratch buffers that the previous submission of the frame used, call before recording the frame's builds
+        void release_retired(uint32_t frame_idx);
+        // copies the acceleration structures of the frame whose compacted size is available into right-sized buffers without waiting for the queries
+        // the replaced ones are destroyed by release_retired when the frame is recorded the next time as the previous submission of the frame may still use them
+        void compact_blas(vk::CommandBuffer& cb, uint32_t frame_idx);
+        // acceleration structure memory released by compact_blas so far
+        uint64_t get_compaction_saved_bytes() const;
+        // reuses the acceleration structure of the last frame with the same index if nothing changed since, returns what was done
+        TLASUpdate create_tlas(vk::CommandBuffer& cb, uint32_t idx);
+        // what the next create_tlas of the frame does if no further bottom level acceleration structures are built before
+        TLASUpdate get_tlas_update(uint32_t frame_idx) const;
+        // memory of all acceleration structures and of the scratch arenas
+        vk::DeviceSize get_acceleration_structure_bytes() const;
+        vk::DeviceSize get_scratch_bytes() const;
+        // scratch memory if every acceleration structure that can still be built kept its own scratch buffer
+        vk::DeviceSize get_dedicated_scratch_bytes() const;
+        // refit updates the acceleration structure in place instead of rebuilding it; it needs allow_update and the same geometries and primitive counts as the last build
+        // refitting is much faster, but the quality degrades the more the vertices moved since the last full build
+        void update_blas(uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, uint32_t blas_idx, uint32_t frame_idx, vk::DeviceSize vertex_stride, const std::vector<uint32_t>& first_vertices = {}, vk::IndexType index_type = vk::IndexType::eUint32, bool refit = false);
 
     private:
+        // everything needed to record the build of a bottom level acceleration structure, info points into geometries
+        struct BLASBuild {
+            std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+            std::vector<vk::AccelerationStructureBuildRangeInfoKHR> ranges;
+            vk::AccelerationStructureBuildGeometryInfoKHR info;
+            uint32_t frame_idx;
+            uint32_t blas_idx;
+        };
+
+        // one scratch buffer per frame in flight that is shared by all builds of the frame, it grows to the largest amount needed by a single build command
+        struct ScratchArena {
+            uint32_t buffer = uint32_t(-1);
+            vk::DeviceSize size = 0;
+            // start of the buffer aligned to minAccelerationStructureScratchOffsetAlignment
+            vk::DeviceAddress address = 0;
+        };
+
         const VulkanMainContext& vmc;
         VulkanCommandContext& vcc;
         Storage& storage;
@@ -54,7 +139,41 @@ namespace ve
         std::array<std::vector<vk::AccelerationStructureInstanceKHR>, 2> instances;
         std::array<TopLevelAccelerationStructure, 2> topLevelAS;
         std::array<uint32_t, 2> instances_buffer;
+        std::array<TLASUpdate, 2> tlas_updates = {TLASUpdate::Build, TLASUpdate::Build};
+        std::array<uint32_t, 2> tlas_refit_counts = {0, 0};
+        vk::QueryPool compaction_query_pool;
+        uint32_t compaction_query_count = 0;
+        std::array<std::vector<BottomLevelAccelerationStructure>, 2> retired_blas;
+        std::vector<std::string> blas_names;
+        uint64_t compaction_saved_bytes = 0;
+        std::vector<BLASBuild> blas_batch;
+        std::vector<BLASBuild> host_blas_batch;
+        std::array<ScratchArena, 2> scratch_arenas;
+        std::array<std::vector<uint32_t>, 2> retired_scratch_buffers;
+        vk::DeviceSize scratch_alignment = 1;
+        vk::DeviceSize dedicated_scratch_bytes = 0;
+
+        // marks the top level acceleration structures of both frames
+        void mark_tlas(TLASUpdate update);
+        void destroy_blas(BottomLevelAccelerationStructure& blas);
+        bool owns_blas(uint32_t frame_idx, const BottomLevelAccelerationStructure& blas) const;
+        // acceleration structure that the instances of the frame reference
+        const BottomLevelAccelerationStructure& get_blas(uint32_t frame_idx, uint32_t blas_idx) const;
 
-        void create_blas(vk::CommandBuffer& cb, uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, vk::DeviceSize vertex_stride, BottomLevelAccelerationStructure& blas);
+        // appends one opaque triangle geometry per index range and returns their primitive counts
+        std::vector<uint32_t> add_geometries(BLASBuild& build, vk::DeviceOrHostAddressConstKHR vertices, uint32_t vertex_count, vk::DeviceSize vertex_stride, vk::DeviceOrHostAddressConstKHR indices, vk::IndexType index_type, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, const std::vector<uint32_t>& first_vertices) const;
+        // creates the acceleration structure with its own buffer, device_local is false for builds on the host
+        void create_blas(BottomLevelAccelerationStructure& blas, vk::DeviceSize size, bool device_local);
+        // records the compacting copy of a built acceleration structure, points the instances to it and retires the old one
+        void replace_with_compacted(vk::CommandBuffer& cb, uint32_t frame_idx, uint32_t blas_idx, vk::DeviceSize compacted_size);
+        // adds the acceleration structure for both frames and appends their builds to builds
+        uint32_t push_blas(const BLASBuildInfo& b, bool allow_update, bool compact, const std::string& name, std::vector<BLASBuild>& builds);
+        // creates the acceleration structure and its scratch buffer if it does not exist yet
+        BLASBuild prepare_blas_build(const BLASBuildInfo& b, uint32_t frame_idx);
+        // the builds take their scratch memory from the arena with the given index
+        void record_blas_builds(vk::CommandBuffer& cb, std::vector<BLASBuild>& builds, uint32_t arena_idx);
+        // grows the arena if needed and returns its aligned start
+        vk::DeviceAddress reserve_scratch(uint32_t arena_idx, vk::DeviceSize size);
+        vk::DeviceSize align_scratch(vk::DeviceSize size) const;
     };
 } // namespace ve
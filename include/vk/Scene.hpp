@@ -24,14 +24,20 @@ namespace ve
         void scale(const std::string& model, const glm::vec3& scale);
         void rotate(const std::string& model, float degree, const glm::vec3& axis);
         DescriptorSetHandler& get_dsh(ShaderFlavor flavor);
+        // work on the graphics queue that has to happen before the render pass
+        void prepare_draw(vk::CommandBuffer& cb, GameState& gs);
         void draw(vk::CommandBuffer& cb, GameState& gs, DeviceTimer& timer);
         void update_game_state(vk::CommandBuffer& cb, GameState& gs, DeviceTimer& timer);
         uint32_t get_light_count();
 
         bool loaded = false;
+        // duration of the acceleration structure builds of the models in the last load in ms and whether they ran on the host
+        double blas_build_time = 0.0;
+        bool built_blas_on_host = false;
 
     private:
         struct ModelInfo {
+            std::string name;
             std::vector<uint32_t> mesh_index_offsets;
             std::vector<uint32_t> mesh_index_count;
             uint32_t index_buffer_idx;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <chrono>
 
 #include "vk/common.hpp"
@@ -45,8 +46,15 @@ namespace ve
             FIREFLY_MOVE_STEP = 4,
             COMPUTE_TUNNEL_ADVANCE = 5,
             COMPUTE_PLAYER_TUNNEL_COLLISION = 6,
+            COMPUTE_BLAS_BUILD = 7,
+            COMPUTE_TUNNEL_SEGMENT = 8,
+            COMPUTE_IRRADIANCE_CACHE = 9,
+            RENDERING_LIGHTING = 10,
+            COMPUTE_BLAS_REFIT = 11,
+            COMPUTE_TLAS_BUILD = 12,
             TIMER_COUNT
         };
+        static constexpr std::array<const char*, TIMER_COUNT> timer_names = {"RENDERING_ALL", "RENDERING_APP", "RENDERING_UI", "RENDERING_TUNNEL", "FIREFLY_MOVE_STEP", "COMPUTE_TUNNEL_ADVANCE", "COMPUTE_PLAYER_TUNNEL_COLLISION", "COMPUTE_BLAS_BUILD", "COMPUTE_TUNNEL_SEGMENT", "COMPUTE_IRRADIANCE_CACHE", "RENDERING_LIGHTING", "COMPUTE_BLAS_REFIT", "COMPUTE_TLAS_BUILD"};
 
         DeviceTimer(const VulkanMainContext& vmc);
         void self_destruct();
@@ -4,6 +4,7 @@
 #include <cmath>
 
 #include "FixVector.hpp"
+#include "NoiseTextures.hpp"
 #include "vk/Timer.hpp"
 #include "vk/Model.hpp"
 #include "vk/Pipeline.hpp"
@@ -20,10 +21,17 @@ namespace ve
         void create_buffers();
         void construct(const RenderPass& render_pass);
         void reload_shaders(const RenderPass& render_pass);
+        // writes the draw commands of the segments that are inside the view frustum; has to be recorded outside of the render pass before draw
+        void cull(vk::CommandBuffer& cb, GameState& gs);
         void draw(vk::CommandBuffer& cb, GameState& gs, const glm::vec3& p1, const glm::vec3& p2);
 
         uint32_t vertex_buffer;
-        uint32_t index_buffer;
+        // positions for the acceleration structure build; the same as vertex_buffer if the vertices are not compact
+        uint32_t blas_vertex_buffer;
+        vk::DeviceSize blas_vertex_stride;
+        uint32_t segment_uid_buffer;
+        // indices of one segment for every tessellation level, only used to build the acceleration structure
+        uint32_t index_pattern_buffer;
 
     private:
         const VulkanMainContext& vmc;
@@ -31,17 +39,23 @@ namespace ve
         Storage& storage;
         DescriptorSetHandler skybox_dsh;
         DescriptorSetHandler render_dsh;
+        DescriptorSetHandler cull_dsh;
         uint32_t skybox_vertex_buffer;
         ModelRenderData mrd;
         std::vector<uint32_t> model_render_data_buffers;
+        // one set of draw commands and statistics per frame in flight
+        std::vector<uint32_t> draw_command_buffers;
+        std::vector<uint32_t> cull_stats_buffers;
         uint32_t noise_textures;
         uint32_t skybox_texture;
         Pipeline skybox_render_pipeline;
         Pipeline pipeline;
         Pipeline mesh_view_pipeline;
+        Pipeline cull_pipeline;
 
         void construct_pipelines(const RenderPass& render_pass);
         void create_noise_textures();
+        NoiseTextureLayers compute_noise_textures();
     };
 } // namespace ve
 
@@ -1,10 +1,13 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
 #include <glm/vec3.hpp>
 #include <boost/align/aligned_allocator.hpp>
 
+#include "RuntimeConfig.hpp"
+#include "TunnelGenerator.hpp"
+#include "TunnelQuery.hpp"
 #include "vk/Tunnel.hpp"
 #include "vk/Fireflies.hpp"
 #include "vk/PathTracer.hpp"
@@ -12,20 +15,68 @@
 namespace ve
 {
     constexpr float segment_scale = 20.0f;
-    constexpr uint32_t segment_count = 16; // how many segments are in the tunnel (must be power of two)
-    static_assert((segment_count & (segment_count - 1)) == 0);
-    constexpr uint32_t samples_per_segment = 32; // how many sample rings one segment is made of
-    constexpr uint32_t vertices_per_sample = 360; // how many vertices are sampled in one sample ring
-    constexpr uint32_t vertex_count = segment_count * samples_per_segment * vertices_per_sample;
-    // two triangles per vertex on a sample (3 indices per triangle); every sample of a segment except the last one has triangles
-    constexpr uint32_t indices_per_segment = (samples_per_segment - 1) * vertices_per_sample * 6;
-    constexpr uint32_t index_count = indices_per_segment * segment_count;
-    constexpr uint32_t fireflies_per_segment = 15;
-    constexpr uint32_t firefly_count = fireflies_per_segment * segment_count;
-    constexpr uint32_t jet_particle_count = 20000;
-    constexpr uint32_t reservoir_count = 4;
+    // how many segments are generated ahead of time on the async compute queue
+    constexpr uint32_t prefetch_segment_count = 4;
     // player is always in the same segment as the tunnel moves with the player
     constexpr uint32_t player_segment_position = 1;
+    // tessellation level l only uses every 2^l-th sample ring and every 2^l-th vertex of a ring
+    // the first and last ring of a segment always keep all vertices, so neighboring segments fit together regardless of their level
+    // check_runtime_config makes sure that vertices_per_sample and samples_per_segment allow all levels
+    constexpr uint32_t tunnel_lod_count = 4;
+    // a segment uses level l if its distance (in segments) to the player's segment is larger than tunnel_lod_distances[l - 1]
+    constexpr std::array<uint32_t, tunnel_lod_count - 1> tunnel_lod_distances = {2, 5, 9};
+    // tunnel.comp generates a segment in tiles of tunnel_tile_vertices vertices of tunnel_tile_rings rings per workgroup
+    constexpr uint32_t tunnel_tile_vertices = 32;
+    constexpr uint32_t tunnel_tile_rings = 8;
+
+    // the vertices of segment uid u are stored in slot u % get_segment_slot_count() of the tunnel vertex buffer
+    // the ring has frames_in_flight - 1 more slots than segments, so a new segment never replaces one that a previous frame in flight still renders
+    // get_tunnel_segment_slot_count in common.glsl has to return the same
+    static_assert(frames_in_flight == 2, "get_tunnel_segment_slot_count in common.glsl expects 2 frames in flight");
+    inline uint32_t get_segment_slot_count()
+    {
+        return segment_count + frames_in_flight - 1;
+    }
+
+    // size of one vertex in the tunnel vertex buffer
+    inline uint32_t get_tunnel_vertex_byte_size()
+    {
+        return compact_tunnel_vertices ? sizeof(CompactTunnelVertex) : sizeof(TunnelVertex);
+    }
+
+    constexpr uint32_t get_lod_step(uint32_t lod)
+    {
+        return 1u << lod;
+    }
+
+    inline uint32_t get_lod_indices_per_segment(uint32_t lod)
+    {
+        const uint32_t spans = (samples_per_segment - 1 + get_lod_step(lod) - 1) / get_lod_step(lod);
+        // the two spans at the segment borders connect a full ring with a coarse one, all other spans connect two coarse rings
+        return (2 * vertices_per_sample + (spans - 1) * 2 * vertices_per_sample / get_lod_step(lod)) * 3;
+    }
+
+    // the index patterns of all levels are stored consecutively in the index pattern buffer, level 0 is the full density pattern
+    inline uint32_t get_lod_index_offset(uint32_t lod)
+    {
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < lod; ++i) offset += get_lod_indices_per_segment(i);
+        return offset;
+    }
+
+    // get_segment_lod in tunnel_cull.comp has to return the same levels
+    constexpr uint32_t get_segment_lod(uint32_t segment_idx)
+    {
+        const uint32_t distance = segment_idx > player_segment_position ? segment_idx - player_segment_position : player_segment_position - segment_idx;
+        uint32_t lod = 0;
+        while (lod < tunnel_lod_distances.size() && distance > tunnel_lod_distances[lod]) lod++;
+        return lod;
+    }
+
+    // a slot's acceleration structure is refit with a new segment of the same tessellation level until it was refit this often
+    constexpr uint32_t max_tunnel_blas_refits = 8;
+    // or until the bounds of the new segment are this much larger than the ones of the segment of the last full build
+    constexpr float max_tunnel_blas_refit_area_ratio = 1.25f;
 
     class TunnelObjects
     {
@@ -35,12 +86,21 @@ namespace ve
         void create_buffers(PathTracer& path_tracer);
         void construct(const RenderPass& render_pass);
         void reload_shaders(const RenderPass& render_pass);
+        // has to be recorded before the render pass that contains draw
+        void cull(vk::CommandBuffer& cb, GameState& gs);
         void draw(vk::CommandBuffer& cb, GameState& gs);
         // move tunnel one segment forward if player enters the n-th segment
         void advance(GameState& gs, DeviceTimer& timer, PathTracer& path_tracer);
         bool is_pos_past_segment(glm::vec3 pos, uint32_t idx, bool use_global_id);
         glm::vec3 get_player_reset_position();
         glm::vec3 get_player_reset_normal();
+        // reads back the currently rendered segments and compares them to the cpu reference
+        void validate_segments_on_cpu(const GameState& gs);
+        // point on the center line of the tunnel; progress is measured in segments starting at the player's segment
+        glm::vec3 get_tunnel_path_position(float progress);
+        glm::vec3 get_tunnel_path_direction(float progress);
+        // closest point on the center line of the rendered segments and distance to the wall, answered on the cpu
+        TunnelQueryResult query_tunnel(const glm::vec3& pos);
 
     private:
         const VulkanMainContext& vmc;
@@ -50,20 +110,42 @@ namespace ve
         Tunnel tunnel;
         DescriptorSetHandler compute_dsh;
         std::vector<glm::vec3, boost::alignment::aligned_allocator<glm::vec3, 16>> tunnel_bezier_points;
+        // index 0 is the acceleration structure of the whole tunnel, index 1 + slot the one of a single segment slot
         std::vector<uint32_t> blas_indices;
         std::vector<uint32_t> instance_indices;
-        std::queue<glm::vec3> tunnel_bezier_points_queue;
+        // tessellation level each slot's acceleration structure was last built with, uint32_t(-1) if it has to be rebuilt
+        std::vector<uint32_t> slot_blas_lods;
+        // refits since the last full build of a slot's acceleration structure and get_segment_bounds_area of the segment it was built for
+        std::vector<uint32_t> slot_blas_refit_counts;
+        std::vector<float> slot_blas_build_areas;
         uint32_t tunnel_bezier_points_buffer;
         NewSegmentPushConstants cpc;
         Pipeline compute_pipeline;
-        Pipeline compute_normals_pipeline;
-        std::mt19937 rnd;
-        std::uniform_real_distribution<float> dis;
+        TunnelPath path;
+        TunnelGenerator generator;
+        bool blas_adaptive_tessellation = false;
+        bool blas_ring = true;
+        // prefetched segments form a ring in the prefetch vertex buffer, one slot per segment
+        uint32_t prefetch_vertex_buffer;
+        std::array<NewSegmentPushConstants, prefetch_segment_count> prefetched_segments;
+        // a slot may only be refilled once the frame that copied it out of the prefetch buffer has finished
+        std::array<uint32_t, prefetch_segment_count> prefetch_slot_release_frames;
+        uint32_t prefetch_first_slot = 0;
+        uint32_t prefetch_count = 0;
+        uint32_t prefetch_ready_count = 0;
+        vk::Fence prefetch_fence;
 
-        glm::vec3 random_cosine(const glm::vec3& normal, const float cosine_weight = 40.0f);
         void construct_pipelines();
-        void compute_new_segment(vk::CommandBuffer& cb, uint32_t current_frame);
-        glm::vec3 pop_tunnel_bezier_point_queue();
+        void compute_new_segment(vk::CommandBuffer& cb, uint32_t descriptor_set_idx, uint32_t slot, uint32_t flags);
+        void insert_prefetched_segment(vk::CommandBuffer& cb, uint32_t current_frame, uint32_t prefetch_slot);
+        void prefetch_segments(uint32_t total_frames);
+        void wait_for_prefetch();
+        void get_segment_index_ranges(uint32_t first_segment_slot, bool adaptive_tessellation, std::vector<uint32_t>& index_offsets, std::vector<uint32_t>& index_counts, std::vector<uint32_t>& first_vertices);
+        // marks the acceleration structures of the slots that got a new segment or tessellation level and shows only the rendered slots
+        // new_segment_slot is uint32_t(-1) if no segment was added
+        void update_slot_blas(GameState& gs, PathTracer& path_tracer, bool rebuild_all, uint32_t new_segment_slot);
+        float get_segment_bounds_area(uint32_t segment_uid);
         glm::vec3& get_tunnel_bezier_point(uint32_t segment_id, uint32_t bezier_point_idx, bool use_global_id);
+        std::vector<TunnelSegmentPoints> get_rendered_segments();
     };
 } // namespace ve
@@ -14,10 +14,13 @@ namespace ve
         void add_graphics_buffers(uint32_t count);
         void add_compute_buffers(uint32_t count);
         void add_transfer_buffers(uint32_t count);
+        void add_async_compute_buffers(uint32_t count);
         vk::CommandBuffer& begin(vk::CommandBuffer& cb);
         void submit_graphics(const vk::CommandBuffer& cb, bool wait_idle) const;
         void submit_compute(const vk::CommandBuffer& cb, bool wait_idle) const;
         void submit_transfer(const vk::CommandBuffer& cb, bool wait_idle) const;
+        // submits to the async compute queue without waiting; fence is signaled when cb finished
+        void submit_async_compute(const vk::CommandBuffer& cb, const vk::Fence& fence) const;
         void self_destruct();
 
         const VulkanMainContext& vmc;
@@ -25,6 +28,7 @@ namespace ve
         std::vector<vk::CommandBuffer> graphics_cb;
         std::vector<vk::CommandBuffer> compute_cb;
         std::vector<vk::CommandBuffer> transfer_cb;
+        std::vector<vk::CommandBuffer> async_compute_cb;
 
     private:
         void submit(const vk::CommandBuffer& cb, const vk::Queue& queue, bool wait_idle) const;
@@ -22,7 +22,11 @@ namespace ve
         const vk::Queue& get_graphics_queue() const;
         const vk::Queue& get_transfer_queue() const;
         const vk::Queue& get_compute_queue() const;
+        // second queue of the compute family; same as the compute queue if the family only has one queue
+        const vk::Queue& get_async_compute_queue() const;
         const vk::Queue& get_present_queue() const;
+        // bytes of device and host memory that vma currently allocated from vulkan
+        uint64_t get_allocated_bytes() const;
 
     private:
         std::unordered_map<QueueIndex, vk::Queue> queues;
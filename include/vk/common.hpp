@@ -1,9 +1,11 @@
 #pragma once
 
+#include <array>
 #include <optional>
 #include <glm/mat4x4.hpp>
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 #define VULKAN_HPP_DISPATCH_LOADER_DYNAMIC 1
 #include <vulkan/vulkan.hpp>
 
@@ -36,32 +38,59 @@ namespace ve
 
     struct PushConstants {
         uint32_t mesh_render_data_idx;
-        uint32_t first_segment_indices_idx;
+        uint32_t first_segment_slot;
         float time;
         uint32_t tex_view;
     };
 
     struct LightingPassPushConstants {
-        uint32_t first_segment_indices_idx;
+        uint32_t first_segment_slot;
         float time;
         uint32_t normal_view;
         uint32_t color_view;
         uint32_t segment_uid_view;
+        uint32_t irradiance_cache_mode;
+        uint32_t irradiance_cache_error_view;
+        float irradiance_cache_distance;
+        alignas(16) glm::vec3 player_pos;
     };
 
+    // modes of the firefly irradiance cache, must match the defines in common.glsl
+    constexpr uint32_t irradiance_cache_mode_off = 0; // every pixel evaluates the fireflies with ReSTIR
+    constexpr uint32_t irradiance_cache_mode_far = 1; // tunnel wall pixels farther than irradiance_cache_distance from the player use the cache
+    constexpr uint32_t irradiance_cache_mode_all = 2; // all tunnel wall pixels use the cache
+
+    // custom indices of the tunnel instances in the top level acceleration structure, must match the defines in common.glsl
+    constexpr uint32_t tunnel_instance_custom_index = 666; // one acceleration structure for all rendered segments, the geometry index is the rendered segment
+    constexpr uint32_t tunnel_slot_instance_custom_index = 1024; // one acceleration structure per segment slot, the slot is added to the custom index
+
+    // instance masks and collision rays, must match the defines in common.glsl
+    constexpr uint8_t player_instance_mask = 0x80; // only the player's instance has this bit, the collision rays skip it and all other rays still hit the ship
+    constexpr uint32_t collision_ray_count = 28; // two rays per corner and face center of the player's bounding box
+
+    // how the player's collision with the tunnel is detected
+    constexpr uint32_t collision_mode_all_triangles = 0; // bounding box against every triangle of the player's two segments
+    constexpr uint32_t collision_mode_broad_phase = 1; // bounding box against the triangles the broad phase selected
+    constexpr uint32_t collision_mode_ray_queries = 2; // rays from the bounding box against the top level acceleration structure
+
     struct NewSegmentPushConstants {
         alignas(16) glm::vec3 p0;
         alignas(16) glm::vec3 p1;
         alignas(16) glm::vec3 p2;
-        uint32_t indices_start_idx;
         uint32_t segment_uid;
+        uint32_t vertex_start_idx;
+        uint32_t flags;
     };
 
+    // flags of NewSegmentPushConstants, must match the defines in common.glsl
+    constexpr uint32_t segment_flag_generate_geometry = 1; // write the vertices of the segment starting at vertex_start_idx
+    constexpr uint32_t segment_flag_insert = 2; // store the bézier points of the segment and spawn its fireflies
+
     struct FireflyMovePushConstants {
         float time;
         float time_diff;
         uint32_t segment_uid;
-        uint32_t first_segment_indices_idx;
+        uint32_t first_segment_slot;
     };
 
     struct JetParticleMovePushConstants {
@@ -74,6 +103,41 @@ namespace ve
         glm::mat4 mvp;
     };
 
+    struct TunnelCullPushConstants {
+        // planes of the view frustum with normals pointing inwards
+        std::array<glm::vec4, 6> frustum_planes;
+        uint32_t first_segment_slot;
+        uint32_t adaptive_tessellation;
+        uint32_t frustum_culling;
+    };
+
+    // written by tunnel_cull.comp; draw_count is the draw count of the indirect tunnel draw
+    struct TunnelCullStats {
+        uint32_t draw_count;
+        uint32_t culled_triangle_count;
+        uint32_t drawn_triangle_count;
+    };
+
+    // written by the broad phase of the player tunnel collision, dispatch is the indirect dispatch of the narrow phase
+    struct PlayerCollisionCandidates {
+        vk::DispatchIndirectCommand dispatch;
+        uint32_t triangle_count;
+        // per segment around the player: first span between two sample rings, span count, first cell between two vertices of a ring and cell count
+        // the cells wrap around the ring
+        std::array<glm::uvec4, 2> ranges;
+    };
+
+    // t is negative if the collision ray hit nothing
+    struct CollisionRayHit {
+        glm::vec3 normal;
+        float t;
+    };
+
+    struct CollisionRayPushConstants {
+        glm::mat4 prev_m;
+        uint32_t first_segment_slot;
+    };
+
     struct GameState {
         std::vector<const char*> scene_names;
         std::vector<float> devicetimings;
@@ -89,7 +153,31 @@ namespace ve
         int32_t current_scene = 0;
         uint32_t current_frame = 0;
         uint32_t total_frames = 0;
-        uint32_t first_segment_indices_idx = 0;
+        // slot of the oldest rendered segment in the ring of tunnel segment slots
+        uint32_t first_segment_slot = 0;
+        uint32_t tunnel_triangle_count = 0;
+        uint32_t tunnel_culled_triangle_count = 0;
+        // tunnel triangles tested against the player's bounding box, 0 with collision rays
+        uint32_t collision_triangle_count = 0;
+        // closest hit of the collision rays, t is negative if none of them hit
+        CollisionRayHit collision_ray_hit{glm::vec3(0.0f), -1.0f};
+        // what happened to the top level acceleration structure in this frame: 0 reused, 1 refit, 2 built (TLASUpdate)
+        uint32_t tlas_update = 0;
+        // memory released by compacting the acceleration structures of the scene models
+        uint64_t blas_compaction_saved_bytes = 0;
+        // scratch memory of the shared arenas and what separate scratch buffers per acceleration structure would need
+        uint64_t scratch_arena_bytes = 0;
+        uint64_t dedicated_scratch_bytes = 0;
+        // result of the analytic tunnel query at the player's position
+        float player_wall_distance = 0.0f;
+        float player_center_distance = 0.0f;
+        // progress of the scripted camera in segments, relative to the player's segment
+        float scripted_camera_progress = 0.0f;
+        // one of the irradiance_cache_mode constants
+        int32_t irradiance_cache_mode = irradiance_cache_mode_far;
+        float irradiance_cache_distance = 60.0f;
+        // one of the collision_mode constants
+        int32_t collision_mode = collision_mode_broad_phase;
         bool load_scene = false;
         bool show_ui = true;
         bool mesh_view = false;
@@ -100,7 +188,17 @@ namespace ve
         bool show_player_bb = false;
         bool show_player = true;
         bool collision_detection_active = true;
+        bool adaptive_tessellation = true;
+        bool tunnel_frustum_culling = true;
         bool save_screenshot = false;
+        bool validate_tunnel = false;
+        bool tunnel_prefetch = true;
+        // one acceleration structure per segment slot instead of one for the whole tunnel
+        bool tunnel_blas_ring = true;
+        // refit the acceleration structure of a segment slot with a new segment instead of building it again
+        bool tunnel_blas_refit = true;
+        bool scripted_camera = false;
+        bool irradiance_cache_error_view = false;
     };
 
     struct Material {
@@ -266,43 +364,18 @@ namespace ve
     struct TunnelVertex {
         glm::vec3 pos;
         glm::vec2 normal;
-        glm::vec2 tex;
+        // texture coordinates packed like packUnorm2x16 in glsl
+        uint32_t tex;
+        // ambient occlusion baked when the segment is generated
+        float ao;
         uint32_t segment_uid;
+    };
 
-        static std::vector<vk::VertexInputBindingDescription> get_binding_descriptions()
-        {
-            vk::VertexInputBindingDescription binding_description{};
-            binding_description.binding = 0;
-            binding_description.stride = sizeof(TunnelVertex);
-            binding_description.inputRate = vk::VertexInputRate::eVertex;
-            return {binding_description};
-        }
-
-        static std::vector<vk::VertexInputAttributeDescription> get_attribute_descriptions()
-        {
-            std::vector<vk::VertexInputAttributeDescription> attribute_descriptions(4);
-            attribute_descriptions[0].binding = 0;
-            attribute_descriptions[0].location = 0;
-            attribute_descriptions[0].format = vk::Format::eR32G32B32Sfloat;
-            attribute_descriptions[0].offset = offsetof(TunnelVertex, pos);
-
-            attribute_descriptions[1].binding = 0;
-            attribute_descriptions[1].location = 1;
-            attribute_descriptions[1].format = vk::Format::eR32G32Sfloat;
-            attribute_descriptions[1].offset = offsetof(TunnelVertex, normal);
-
-            attribute_descriptions[2].binding = 0;
-            attribute_descriptions[2].location = 2;
-            attribute_descriptions[2].format = vk::Format::eR32G32Sfloat;
-            attribute_descriptions[2].offset = offsetof(TunnelVertex, tex);
-
-            attribute_descriptions[3].binding = 0;
-            attribute_descriptions[3].location = 3;
-            attribute_descriptions[3].format = vk::Format::eR32Sfloat;
-            attribute_descriptions[3].offset = offsetof(TunnelVertex, segment_uid);
-
-            return attribute_descriptions;
-        }
+    // alternative to TunnelVertex that only stores the distance to the center line of the tunnel, the octahedron encoded normal and the ambient occlusion
+    // the shaders reconstruct everything else from the Bézier points of the segment and the ring and angle of the vertex
+    struct CompactTunnelVertex {
+        float radius;
+        uint32_t normal_ao;
     };
 
     struct DebugVertex {
@@ -1,33 +1,56 @@
 #define PI 3.1415926535897932384626433832
+#define FIREFLY_INTENSITY 100.0
 
 struct PushConstants {
     uint mesh_render_data_idx;
-    uint first_segment_indices_idx;
+    uint first_segment_slot;
     float time;
     bool tex_view;
 };
 
 struct LightingPassPushConstants {
-    uint first_segment_indices_idx;
+    uint first_segment_slot;
     float time;
     bool normal_view;
     bool color_view;
     bool segment_uid_view;
+    uint irradiance_cache_mode;
+    bool irradiance_cache_error_view;
+    float irradiance_cache_distance;
+    vec3 player_pos;
 };
 
+// modes of the firefly irradiance cache, must match the constants in common.hpp
+#define IRRADIANCE_CACHE_MODE_OFF 0u
+#define IRRADIANCE_CACHE_MODE_FAR 1u
+#define IRRADIANCE_CACHE_MODE_ALL 2u
+
+// custom indices of the tunnel instances, must match the constants in common.hpp
+#define TUNNEL_INSTANCE_CUSTOM_INDEX 666
+#define TUNNEL_SLOT_INSTANCE_CUSTOM_INDEX 1024
+
+// only the player's instance has this bit in its mask, so rays with the collision cull mask pass through the ship; must match the constants in common.hpp
+#define PLAYER_INSTANCE_MASK 0x80u
+#define COLLISION_RAY_CULL_MASK 0x7Fu
+#define COLLISION_RAY_COUNT 28u
+
 struct NewSegmentPushConstants {
     vec3 p0;
     vec3 p1;
     vec3 p2;
-    uint indices_start_idx;
     uint segment_uid;
+    uint vertex_start_idx;
+    uint flags;
 };
 
+#define SEGMENT_FLAG_GENERATE_GEOMETRY 1u
+#define SEGMENT_FLAG_INSERT 2u
+
 struct FireflyMovePushConstants {
     float time;
     float time_diff;
     uint segment_uid;
-    uint first_segment_indices_idx;
+    uint first_segment_slot;
 };
 
 struct JetParticleMovePushConstants {
@@ -40,6 +63,52 @@ struct DebugPushConstants {
     mat4 mvp;
 };
 
+struct TunnelCullPushConstants {
+    vec4 frustum_planes[6];
+    uint first_segment_slot;
+    bool adaptive_tessellation;
+    bool frustum_culling;
+};
+
+// same layout as VkDrawIndirectCommand
+struct DrawIndirectCommand {
+    uint vertex_count;
+    uint instance_count;
+    uint first_vertex;
+    uint first_instance;
+};
+
+// same layout as VkDispatchIndirectCommand
+struct DispatchIndirectCommand {
+    uint x;
+    uint y;
+    uint z;
+};
+
+struct PlayerCollisionCandidates {
+    DispatchIndirectCommand dispatch;
+    uint triangle_count;
+    // per segment: first span, span count, first cell, cell count
+    uvec4 ranges[2];
+};
+
+// t is negative if the collision ray hit nothing
+struct CollisionRayHit {
+    vec3 normal;
+    float t;
+};
+
+struct CollisionRayPushConstants {
+    mat4 prev_m;
+    uint first_segment_slot;
+};
+
+struct TunnelCullStats {
+    uint draw_count;
+    uint culled_triangle_count;
+    uint drawn_triangle_count;
+};
+
 struct MeshRenderData {
     int model_render_data_idx;
     int mat_idx;
@@ -250,31 +319,38 @@ AlignedJetParticleVertex pack_jet_particle_vertex(JetParticleVertex v)
 
 struct AlignedTunnelVertex {
     vec4 pos_normal_x;
-    vec4 normal_y_tex_xy_segment_uid;
+    float normal_y;
+    // texture coordinates as packUnorm2x16 to make room for the ambient occlusion
+    uint tex;
+    float ao;
+    // the sign is the sign of the normal's z component
+    float segment_uid;
 };
 
 vec3 get_tunnel_vertex_pos(in AlignedTunnelVertex v) { return v.pos_normal_x.xyz; }
 void set_tunnel_vertex_pos(inout AlignedTunnelVertex v, in vec3 pos) { v.pos_normal_x.xyz = pos; }
 
-vec3 get_tunnel_vertex_normal(in AlignedTunnelVertex v) { return vec3(v.pos_normal_x.w, v.normal_y_tex_xy_segment_uid.x, sign(v.normal_y_tex_xy_segment_uid.w) * sqrt(1.0 - v.pos_normal_x.w * v.pos_normal_x.w - v.normal_y_tex_xy_segment_uid.x * v.normal_y_tex_xy_segment_uid.x)); }
+vec3 get_tunnel_vertex_normal(in AlignedTunnelVertex v) { return vec3(v.pos_normal_x.w, v.normal_y, sign(v.segment_uid) * sqrt(1.0 - v.pos_normal_x.w * v.pos_normal_x.w - v.normal_y * v.normal_y)); }
 void set_tunnel_vertex_normal(inout AlignedTunnelVertex v, in vec3 normal) {
     v.pos_normal_x.w = normal.x;
-    v.normal_y_tex_xy_segment_uid.x = normal.y;
-    if (sign(normal.z) != sign(v.normal_y_tex_xy_segment_uid.w)) v.normal_y_tex_xy_segment_uid.w *= -1;
+    v.normal_y = normal.y;
+    if (sign(normal.z) != sign(v.segment_uid)) v.segment_uid *= -1;
 }
 
-vec2 get_tunnel_vertex_tex(in AlignedTunnelVertex v) { return v.normal_y_tex_xy_segment_uid.yz; }
-void set_tunnel_vertex_tex(inout AlignedTunnelVertex v, in vec2 tex) { v.normal_y_tex_xy_segment_uid.yz = tex; }
+vec2 get_tunnel_vertex_tex(in AlignedTunnelVertex v) { return unpackUnorm2x16(v.tex); }
+void set_tunnel_vertex_tex(inout AlignedTunnelVertex v, in vec2 tex) { v.tex = packUnorm2x16(tex); }
 
-uint get_tunnel_vertex_segment_uid(in AlignedTunnelVertex v) { return uint(abs(v.normal_y_tex_xy_segment_uid.w) + 0.1); }
+uint get_tunnel_vertex_segment_uid(in AlignedTunnelVertex v) { return uint(abs(v.segment_uid) + 0.1); }
 void set_tunnel_vertex_segment_uid(inout AlignedTunnelVertex v, in uint segment_uid, in vec3 normal) {
-    v.normal_y_tex_xy_segment_uid.w = (sign(normal.z) < 0.0) ? -float(segment_uid) : float(segment_uid);
+    v.segment_uid = (sign(normal.z) < 0.0) ? -float(segment_uid) : float(segment_uid);
 }
 
 struct TunnelVertex {
     vec3 pos;
     vec3 normal;
     vec2 tex;
+    // ambient occlusion baked when the segment is generated, 1 is unoccluded
+    float ao;
     uint segment_uid;
 };
 
@@ -283,10 +359,11 @@ TunnelVertex unpack_tunnel_vertex(AlignedTunnelVertex v)
     TunnelVertex vert;
     vert.pos = v.pos_normal_x.xyz;
     vert.normal.x = v.pos_normal_x.w;
-    vert.normal.y = v.normal_y_tex_xy_segment_uid.x;
-    vert.normal.z = sign(v.normal_y_tex_xy_segment_uid.w) * sqrt(1.0 - vert.normal.x * vert.normal.x - vert.normal.y * vert.normal.y);
-    vert.tex = v.normal_y_tex_xy_segment_uid.yz;
-    vert.segment_uid = uint(abs(v.normal_y_tex_xy_segment_uid.w) + 0.1);
+    vert.normal.y = v.normal_y;
+    vert.normal.z = sign(v.segment_uid) * sqrt(1.0 - vert.normal.x * vert.normal.x - vert.normal.y * vert.normal.y);
+    vert.tex = unpackUnorm2x16(v.tex);
+    vert.ao = v.ao;
+    vert.segment_uid = uint(abs(v.segment_uid) + 0.1);
     return vert;
 }
 
@@ -295,8 +372,226 @@ AlignedTunnelVertex pack_tunnel_vertex(TunnelVertex v)
     AlignedTunnelVertex vert;
     vert.pos_normal_x.xyz= v.pos;
     vert.pos_normal_x.w = v.normal.x;
-    vert.normal_y_tex_xy_segment_uid.x = v.normal.y;
-    vert.normal_y_tex_xy_segment_uid.yz = v.tex;
-    vert.normal_y_tex_xy_segment_uid.w = (sign(v.normal.z) < 0.0) ? -float(v.segment_uid) : float(v.segment_uid);
+    vert.normal_y = v.normal.y;
+    vert.tex = packUnorm2x16(v.tex);
+    vert.ao = v.ao;
+    vert.segment_uid = (sign(v.normal.z) < 0.0) ? -float(v.segment_uid) : float(v.segment_uid);
+    return vert;
+}
+
+// octahedron encoding of a unit vector in two 12 bit values, the upper 8 bits are left for the ambient occlusion of compact tunnel vertices
+uint pack_octahedral_normal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    const vec2 wrapped = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    const uvec2 e = uvec2(round(clamp(n.z >= 0.0 ? n.xy : wrapped, -1.0, 1.0) * 2047.0) + 2047.0);
+    return e.x | (e.y << 12);
+}
+
+vec3 unpack_octahedral_normal(uint packed_normal)
+{
+    const vec2 e = vec2(uvec2(packed_normal, packed_normal >> 12) & 0xFFFu) / 2047.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    const float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+uint pack_compact_tunnel_normal_ao(vec3 normal, float ao)
+{
+    return pack_octahedral_normal(normal) | (uint(round(clamp(ao, 0.0, 1.0) * 255.0)) << 24);
+}
+
+float unpack_compact_tunnel_ao(uint normal_ao)
+{
+    return float(normal_ao >> 24) / 255.0;
+}
+
+// alternative to AlignedTunnelVertex that only stores the distance to the center line of the tunnel and the normal
+// position, texture coordinates and segment uid are reconstructed from the Bézier points of the segment and the ring and angle of the vertex
+struct CompactTunnelVertex {
+    float radius;
+    // octahedral normal and ambient occlusion, see pack_compact_tunnel_normal_ao
+    uint normal_ao;
+};
+
+// rotate v around k by angle degrees
+vec3 rotate(vec3 v, vec3 k, float angle)
+{
+    float cos_theta = cos(radians(angle));
+    float sin_theta = sin(radians(angle));
+    vec3 rotated = (v * cos_theta) + (cross(k, v) * sin_theta) + (k * dot(k, v)) * (1 - cos_theta);
+    return rotated;
+}
+
+// length of the center line of the segment between its start and curve parameter t
+float get_tunnel_arc_length(vec3 p0, vec3 p1, vec3 p2, float t)
+{
+    // the speed 2 * |a + x * b| is the square root of a quadratic, which 5 point gauss-legendre quadrature integrates almost exactly
+    const float nodes[5] = float[5](-0.9061798459, -0.5384693101, 0.0, 0.5384693101, 0.9061798459);
+    const float weights[5] = float[5](0.2369268851, 0.4786286705, 0.5688888889, 0.4786286705, 0.2369268851);
+    const vec3 a = p1 - p0;
+    const vec3 b = p0 - 2.0 * p1 + p2;
+    float arc_length = 0.0;
+    for (uint i = 0; i < 5; ++i) arc_length += weights[i] * length(a + (t * 0.5 * (nodes[i] + 1.0)) * b);
+    return arc_length * t;
+}
+
+// curve parameter of a sample ring, the rings are evenly spaced by arc length
+float get_tunnel_ring_parameter(vec3 p0, vec3 p1, vec3 p2, uint sample_circle_id, uint samples_per_segment)
+{
+    // newton iterations on the arc length starting at the uniform parameter; the ends of the segment stay exactly at 0 and 1
+    const float arc_fraction = float(sample_circle_id) / float(samples_per_segment - 1);
+    const vec3 a = p1 - p0;
+    const vec3 b = p0 - 2.0 * p1 + p2;
+    const float target = arc_fraction * get_tunnel_arc_length(p0, p1, p2, 1.0);
+    float t = arc_fraction;
+    for (uint i = 0; i < 3; ++i) t = clamp(t - (get_tunnel_arc_length(p0, p1, p2, t) - target) / (2.0 * length(a + t * b)), 0.0, 1.0);
+    return t;
+}
+
+// center of the sample ring at curve parameter t
+vec3 get_tunnel_ring_center_at(vec3 p0, vec3 p1, vec3 p2, float t)
+{
+    return pow(1 - t, 2) * p0 + (2 - 2 * t) * t * p1 + pow(t, 2) * p2;
+}
+
+// center of a sample ring of the segment given by the Bézier points
+vec3 get_tunnel_ring_center(vec3 p0, vec3 p1, vec3 p2, uint sample_circle_id, uint samples_per_segment)
+{
+    return get_tunnel_ring_center_at(p0, p1, p2, get_tunnel_ring_parameter(p0, p1, p2, sample_circle_id, samples_per_segment));
+}
+
+// normal of the plane of the ring at curve parameter t and the (not normalized) direction of the first vertex of the ring
+void get_tunnel_ring_frame(vec3 p0, vec3 p1, vec3 p2, float t, out vec3 plane_normal, out vec3 plane_vector)
+{
+    // normal of the ring plane is given by derivative
+    plane_normal = normalize((2 - 2 * t) * (p1 - p0) + 2 * t * (p2 - p1));
+    // calculate vector that lies in the plane of the circle
+    const vec3 first_dir = normalize(p1 - p0);
+    const vec3 cross_vector = abs(dot(first_dir, vec3(1.0, 0.0, 0.0))) >= 0.999999 ? cross(first_dir, normalize(vec3(0.99, 0.0, 0.01))) : cross(first_dir, vec3(1.0, 0.0, 0.0));
+    plane_vector = cross(plane_normal, cross_vector);
+}
+
+// unit vector from the center of the sample ring at curve parameter t to the vertex with the given angle index
+vec3 get_tunnel_ring_direction_at(vec3 p0, vec3 p1, vec3 p2, float t, uint vertex_id, uint vertices_per_sample)
+{
+    vec3 plane_normal;
+    vec3 plane_vector;
+    get_tunnel_ring_frame(p0, p1, p2, t, plane_normal, plane_vector);
+    return normalize(rotate(plane_vector, plane_normal, (360.0 / vertices_per_sample) * vertex_id));
+}
+
+// unit vector from the center of a sample ring to the vertex with the given angle index
+vec3 get_tunnel_ring_direction(vec3 p0, vec3 p1, vec3 p2, uint sample_circle_id, uint vertex_id, uint samples_per_segment, uint vertices_per_sample)
+{
+    return get_tunnel_ring_direction_at(p0, p1, p2, get_tunnel_ring_parameter(p0, p1, p2, sample_circle_id, samples_per_segment), vertex_id, vertices_per_sample);
+}
+
+// position of a vertex given its distance to the center line
+vec3 get_tunnel_vertex_position(vec3 p0, vec3 p1, vec3 p2, uint sample_circle_id, uint vertex_id, uint samples_per_segment, uint vertices_per_sample, float radius)
+{
+    const float t = get_tunnel_ring_parameter(p0, p1, p2, sample_circle_id, samples_per_segment);
+    return get_tunnel_ring_center_at(p0, p1, p2, t) + get_tunnel_ring_direction_at(p0, p1, p2, t, vertex_id, vertices_per_sample) * radius;
+}
+
+vec2 get_tunnel_ring_tex(uint segment_uid, uint sample_circle_id, uint vertex_id, uint samples_per_segment, uint vertices_per_sample)
+{
+    return vec2(abs((segment_uid % 2) - float(sample_circle_id) / float(samples_per_segment - 1)), abs((float(vertex_id) / float(vertices_per_sample)) * 2.0 - 1.0));
+}
+
+// idx is the index of the vertex in its segment
+TunnelVertex unpack_compact_tunnel_vertex(CompactTunnelVertex v, vec3 p0, vec3 p1, vec3 p2, uint segment_uid, uint idx, uint samples_per_segment, uint vertices_per_sample)
+{
+    const uint sample_circle_id = idx / vertices_per_sample;
+    const uint vertex_id = idx % vertices_per_sample;
+    TunnelVertex vert;
+    vert.pos = get_tunnel_vertex_position(p0, p1, p2, sample_circle_id, vertex_id, samples_per_segment, vertices_per_sample, v.radius);
+    vert.normal = unpack_octahedral_normal(v.normal_ao);
+    vert.tex = get_tunnel_ring_tex(segment_uid, sample_circle_id, vertex_id, samples_per_segment, vertices_per_sample);
+    vert.ao = unpack_compact_tunnel_ao(v.normal_ao);
+    vert.segment_uid = segment_uid;
     return vert;
 }
+
+// the irradiance cache of a segment has the same index as its fireflies, i.e. uid % segment count; cells are stored ring by ring
+uint get_irradiance_cache_idx(uint segment_uid, uint ring, uint angle, uint segment_count, uint rings, uint angles)
+{
+    return ((segment_uid % segment_count) * rings + ring) * angles + angle;
+}
+
+// the vertices of a segment are stored in slot uid % slot count of a ring of segment slots, get_segment_slot_count in TunnelObjects.hpp has to match
+// the ring has one slot more than there are segments (frames in flight - 1), so a new segment never replaces one that the previous frame still renders
+uint get_tunnel_segment_slot_count(uint segment_count)
+{
+    return segment_count + 1;
+}
+
+// slot of the segment at position segment_idx in the rendered tunnel
+uint get_tunnel_segment_slot(uint first_segment_slot, uint segment_idx, uint segment_count)
+{
+    return (first_segment_slot + segment_idx) % get_tunnel_segment_slot_count(segment_count);
+}
+
+// the bézier points of the last segments form a ring as well, neighboring segments share their end point
+uint get_tunnel_bezier_point_idx(uint segment_uid, uint point_idx, uint segment_count)
+{
+    return (segment_uid * 2 + point_idx) % (segment_count * 2 + 3);
+}
+
+// the tunnel has no index buffer, indices are computed from the position of a corner in the level region instead
+// this is the same triangulation that append_segment_indices writes for the acceleration structure
+// tessellation level l only uses every 2^l-th sample ring and every 2^l-th vertex of a ring, the first and last ring of a segment keep all vertices
+uint get_tunnel_lod_indices_per_segment(uint lod, uint samples_per_segment, uint vertices_per_sample)
+{
+    const uint step = 1u << lod;
+    const uint spans = (samples_per_segment - 1 + step - 1) / step;
+    return (2 * vertices_per_sample + (spans - 1) * 2 * vertices_per_sample / step) * 3;
+}
+
+// idx is the position of the corner in the region of level lod, i.e. segment slot * indices per segment + corner in segment
+// the slot comes from get_tunnel_segment_slot, the corners of one segment are always contiguous as the ring only wraps between segments
+uint get_tunnel_vertex_idx(uint idx, uint lod, uint samples_per_segment, uint vertices_per_sample)
+{
+    const uint step = 1u << lod;
+    const uint indices_per_segment = get_tunnel_lod_indices_per_segment(lod, samples_per_segment, vertices_per_sample);
+    const uint slot = idx / indices_per_segment;
+    uint triangle = (idx % indices_per_segment) / 3;
+    const uint corner = idx % 3;
+    // the span at the segment start has vertices_per_sample + vertices_per_sample / step triangles, inner spans have 2 * vertices_per_sample / step
+    const uint spans = (samples_per_segment - 1 + step - 1) / step;
+    const uint first_span_triangles = vertices_per_sample + vertices_per_sample / step;
+    const uint inner_span_triangles = 2 * vertices_per_sample / step;
+    uint span = 0;
+    if (triangle >= first_span_triangles)
+    {
+        triangle -= first_span_triangles;
+        span = min(1 + triangle / inner_span_triangles, spans - 1);
+        triangle -= (span - 1) * inner_span_triangles;
+    }
+    const uint ring_a = span * step;
+    const uint ring_b = min(ring_a + step, samples_per_segment - 1);
+    const uint step_a = ring_a == 0 ? 1 : step;
+    const uint step_b = ring_b == samples_per_segment - 1 ? 1 : step;
+    // every cell is a fan over the edges of ring a followed by a fan over the edges of ring b
+    const uint fan_a = step / step_a;
+    const uint cell_triangles = fan_a + step / step_b;
+    const uint j = (triangle / cell_triangles) * step;
+    const uint k = triangle % cell_triangles;
+    uint ring;
+    uint vertex;
+    if (k < fan_a)
+    {
+        const uint v = j + k * step_a;
+        ring = corner == 2 ? ring_b : ring_a;
+        vertex = corner == 0 ? v : (corner == 1 ? v + step_a : j);
+    }
+    else
+    {
+        const uint v = j + (k - fan_a) * step_b;
+        ring = corner == 0 ? ring_a : ring_b;
+        vertex = corner == 0 ? j + step : (corner == 1 ? v + step_b : v);
+    }
+    return (slot * samples_per_segment + ring) * vertices_per_sample + vertex % vertices_per_sample;
+}
@@ -45,10 +45,6 @@ layout(binding = 5) buffer FireflyBuffer {
 
 layout(binding = 6) uniform sampler2DArray noise_tex_sampler; // noise textures
 
-layout(binding = 10) buffer TunnelIndicesBuffer {
-    uint tunnel_indices[];
-};
-
 layout(binding = 11) buffer TunnelVerticesBuffer {
     AlignedTunnelVertex tunnel_vertices[];
 };
@@ -4,8 +4,7 @@
 #extension GL_EXT_ray_tracing : enable
 #extension GL_EXT_ray_query : enable
 #include "common.glsl"
-
-#define FIREFLY_INTENSITY 100.0
+#include "tunnel_query.glsl"
 
 layout(constant_id = 0) const uint NUM_LIGHTS = 1;
 layout(constant_id = 1) const uint SEGMENT_COUNT = 1;
@@ -14,6 +13,10 @@ layout(constant_id = 3) const uint RESERVOIR_COUNT = 1;
 layout(constant_id = 4) const uint RESOLUTION_X = 1;
 layout(constant_id = 5) const uint RESOLUTION_Y = 1;
 layout(constant_id = 6) const uint FIRST_PASS = 1;
+layout(constant_id = 7) const uint SAMPLES_PER_SEGMENT = 1;
+layout(constant_id = 8) const uint VERTICES_PER_SAMPLE = 1;
+layout(constant_id = 9) const uint IRRADIANCE_CACHE_RINGS = 2;
+layout(constant_id = 10) const uint IRRADIANCE_CACHE_ANGLES = 1;
 const uint PIXEL_COUNT = RESOLUTION_X * RESOLUTION_Y;
 
 layout(location = 0) in vec2 frag_tex;
@@ -44,8 +47,12 @@ layout(binding = 5) buffer FireflyBuffer {
 
 layout(binding = 6) uniform sampler2DArray noise_tex_sampler; // noise textures
 
-layout(binding = 10) buffer TunnelIndicesBuffer {
-    uint tunnel_indices[];
+layout(binding = 7) readonly buffer TunnelBezierPointsBuffer {
+    vec3 tunnel_bezier_points[];
+};
+
+layout(binding = 9) readonly buffer IrradianceCacheBuffer {
+    vec4 irradiance_cache[];
 };
 
 layout(binding = 11) buffer TunnelVerticesBuffer {
@@ -99,6 +106,10 @@ void write_reservoir(in Reservoir r, in vec2 xy, in uint idx)
 
 uint rng_state;
 
+// pixels that use the irradiance cache skip the fireflies in the reservoirs and add the cached irradiance instead
+bool use_irradiance_cache = false;
+vec3 cached_irradiance = vec3(0.0);
+
 uint PCGHashState()
 {
     rng_state = rng_state * 747796405u + 2891336453u;
@@ -246,6 +257,41 @@ vec4 calculate_firefly_light_contribution(in vec3 pos, in vec3 normal, in vec4 a
     return albedo * max(dot(normal, L), 0.0) * (vec4(get_firefly_vertex_color(firefly_vertices[i]), 1.0) * FIREFLY_INTENSITY) / pow(distance(firefly_pos, pos), 2);
 }
 
+// irradiance of the fireflies at a point on the tunnel wall, interpolated between the cells of the segment's cache
+// returns false if pos is not on the wall of the segment, e.g. on the ship
+bool sample_irradiance_cache(in vec3 pos, in uint segment_uid, out vec3 irradiance)
+{
+    const vec3 p0 = tunnel_bezier_points[get_tunnel_bezier_point_idx(segment_uid, 0, SEGMENT_COUNT)];
+    const vec3 p1 = tunnel_bezier_points[get_tunnel_bezier_point_idx(segment_uid, 1, SEGMENT_COUNT)];
+    const vec3 p2 = tunnel_bezier_points[get_tunnel_bezier_point_idx(segment_uid, 2, SEGMENT_COUNT)];
+    const TunnelQuery query = query_tunnel_segment(p0, p1, p2, segment_uid, pos);
+    // the coarse tessellation levels deviate a bit from the analytic wall
+    if (abs(query.wall_distance) > 2.0) return false;
+    const vec2 cell = vec2(query.arc_fraction * float(IRRADIANCE_CACHE_RINGS - 1), query.angle_fraction * float(IRRADIANCE_CACHE_ANGLES));
+    const uint ring = min(uint(cell.x), IRRADIANCE_CACHE_RINGS - 2);
+    const uint angle = uint(cell.y) % IRRADIANCE_CACHE_ANGLES;
+    const uint next_angle = (angle + 1) % IRRADIANCE_CACHE_ANGLES;
+    const vec2 f = vec2(cell.x - float(ring), fract(cell.y));
+    const vec3 e00 = irradiance_cache[get_irradiance_cache_idx(segment_uid, ring, angle, SEGMENT_COUNT, IRRADIANCE_CACHE_RINGS, IRRADIANCE_CACHE_ANGLES)].rgb;
+    const vec3 e01 = irradiance_cache[get_irradiance_cache_idx(segment_uid, ring, next_angle, SEGMENT_COUNT, IRRADIANCE_CACHE_RINGS, IRRADIANCE_CACHE_ANGLES)].rgb;
+    const vec3 e10 = irradiance_cache[get_irradiance_cache_idx(segment_uid, ring + 1, angle, SEGMENT_COUNT, IRRADIANCE_CACHE_RINGS, IRRADIANCE_CACHE_ANGLES)].rgb;
+    const vec3 e11 = irradiance_cache[get_irradiance_cache_idx(segment_uid, ring + 1, next_angle, SEGMENT_COUNT, IRRADIANCE_CACHE_RINGS, IRRADIANCE_CACHE_ANGLES)].rgb;
+    irradiance = mix(mix(e00, e01, f.y), mix(e10, e11, f.y), f.x);
+    return true;
+}
+
+// relative error of the cache against the unshadowed fireflies of the same segments, green is exact and red is off by 100% or more
+vec4 get_irradiance_cache_error(in vec3 pos, in vec3 normal, in uint segment_uid)
+{
+    vec3 irradiance;
+    if (!sample_irradiance_cache(pos, segment_uid, irradiance)) return vec4(0.0, 0.0, 0.0, 1.0);
+    vec3 reference = vec3(0.0);
+    const uint first_firefly = (max(segment_uid, 1u) - 1) % SEGMENT_COUNT * FIREFLIES_PER_SEGMENT;
+    for (uint i = 0; i < 3 * FIREFLIES_PER_SEGMENT; ++i) reference += calculate_firefly_light_contribution(pos, normal, vec4(1.0), (first_firefly + i) % (SEGMENT_COUNT * FIREFLIES_PER_SEGMENT)).rgb;
+    const float error = length(irradiance - reference) / max(length(reference), 0.001);
+    return vec4(mix(vec3(0.0, 1.0, 0.0), vec3(1.0, 0.0, 0.0), clamp(error, 0.0, 1.0)), 1.0);
+}
+
 vec4 calculate_light_contribution_with_visibility_check(in vec3 pos, in vec3 normal, in vec4 albedo, in uint i)
 {
     if (i >= NUM_LIGHTS) return calculate_firefly_light_contribution_with_visibility_check(pos, normal, albedo, i - NUM_LIGHTS);
@@ -268,6 +314,12 @@ void fill_reservoirs(in vec3 pos, in vec3 normal, in vec4 albedo, in uint segmen
     uint start_idx = (max(0, (segment_uid - 1)) % SEGMENT_COUNT) * FIREFLIES_PER_SEGMENT;
     uint end_idx = uint(min(start_idx + 3 * FIREFLIES_PER_SEGMENT, FIREFLIES_PER_SEGMENT * SEGMENT_COUNT));
     uint remaining_fireflies = 3 * FIREFLIES_PER_SEGMENT - (end_idx - start_idx);
+    // the fireflies come from the irradiance cache, only the spotlights are left for the reservoirs
+    if (use_irradiance_cache)
+    {
+        start_idx = end_idx;
+        remaining_fireflies = 0;
+    }
 #if 0
     for (uint i = 0; i < 256; ++i)
     {
@@ -307,6 +359,8 @@ void fill_reservoirs(in vec3 pos, in vec3 normal, in vec4 albedo, in uint segmen
 void combine_reservoirs(Reservoir r, uint i, in vec3 pos, in vec3 normal, in vec4 albedo)
 {
     if (!(r.w > 0.001)) return;
+    // fireflies of neighboring pixels would be counted twice
+    if (use_irradiance_cache && r.y >= NUM_LIGHTS) return;
     r.M = min(local_reservoirs[i].M * 5, r.M);
     update_reservoir(local_reservoirs[i], r.y, length(calculate_light_contribution(pos, normal, albedo, r.y).rgb) * r.W * r.M, r.M);
     float sample_weight = length(calculate_light_contribution(pos, normal, albedo, local_reservoirs[i].y).rgb);
@@ -398,6 +452,7 @@ vec4 calculate_color(vec3 position, vec3 normal, vec4 color, int segment_uid)
     vec4 out_color = vec4(0.0);
     for (uint i = 0; i < RESERVOIR_COUNT; ++i) out_color += calculate_light_contribution_with_visibility_check(pos, normal, color, local_reservoirs[i].y) * local_reservoirs[i].W;
     out_color /= RESERVOIR_COUNT;
+    if (use_irradiance_cache) out_color.rgb += color.rgb * cached_irradiance;
     out_color += get_blooming_value();
 #else
     vec4 out_color = calculate_phong(pos, normal, color, segment_uid);
@@ -414,12 +469,16 @@ vec4 calculate_color(vec3 position, vec3 normal, vec4 color, int segment_uid)
         if (evaluate_ray(p, dir, t, instance_id, geometry_idx, primitive_idx, bary))
         {
             pos = pos + t * dir;
-            if (instance_id == 666)
+            if (instance_id >= TUNNEL_INSTANCE_CUSTOM_INDEX)
             {
-                TunnelVertex v0 = unpack_tunnel_vertex(tunnel_vertices[tunnel_indices[pc.first_segment_indices_idx + primitive_idx * 3]]);
-                TunnelVertex v1 = unpack_tunnel_vertex(tunnel_vertices[tunnel_indices[pc.first_segment_indices_idx + primitive_idx * 3 + 1]]);
-                TunnelVertex v2 = unpack_tunnel_vertex(tunnel_vertices[tunnel_indices[pc.first_segment_indices_idx + primitive_idx * 3 + 2]]);
+                // either every segment is one geometry of the tunnel acceleration structure or every slot has its own instance
+                const uint slot = instance_id >= TUNNEL_SLOT_INSTANCE_CUSTOM_INDEX ? instance_id - TUNNEL_SLOT_INSTANCE_CUSTOM_INDEX : get_tunnel_segment_slot(pc.first_segment_slot, geometry_idx, SEGMENT_COUNT);
+                const uint first_idx = slot * get_tunnel_lod_indices_per_segment(0, SAMPLES_PER_SEGMENT, VERTICES_PER_SAMPLE) + primitive_idx * 3;
+                TunnelVertex v0 = unpack_tunnel_vertex(tunnel_vertices[get_tunnel_vertex_idx(first_idx, 0, SAMPLES_PER_SEGMENT, VERTICES_PER_SAMPLE)]);
+                TunnelVertex v1 = unpack_tunnel_vertex(tunnel_vertices[get_tunnel_vertex_idx(first_idx + 1, 0, SAMPLES_PER_SEGMENT, VERTICES_PER_SAMPLE)]);
+                TunnelVertex v2 = unpack_tunnel_vertex(tunnel_vertices[get_tunnel_vertex_idx(first_idx + 2, 0, SAMPLES_PER_SEGMENT, VERTICES_PER_SAMPLE)]);
                 color = vec4(0.63, 0.32, 0.18, 1.0) * texture(noise_tex_sampler, vec3(v0.tex, 1));
+                color.rgb *= v0.ao;
                 normal = normalize(v0.normal + texture(noise_tex_sampler, vec3(v0.tex, 0)).rgb - 0.5);
             }
             else
@@ -474,6 +533,15 @@ void main()
         out_color = frag_color;
         return;
     }
+    if (pc.irradiance_cache_error_view)
+    {
+        out_color = frag_segment_uid < 0 ? vec4(0.0, 0.0, 0.0, 1.0) : get_irradiance_cache_error(frag_pos, frag_normal, uint(frag_segment_uid));
+        return;
+    }
+    if (frag_segment_uid >= 0 && (pc.irradiance_cache_mode == IRRADIANCE_CACHE_MODE_ALL || (pc.irradiance_cache_mode == IRRADIANCE_CACHE_MODE_FAR && distance(frag_pos, pc.player_pos) > pc.irradiance_cache_distance)))
+    {
+        use_irradiance_cache = sample_irradiance_cache(frag_pos, uint(frag_segment_uid), cached_irradiance);
+    }
     if (frag_segment_uid < 0)
     {
         out_color = frag_color;
@@ -13,6 +13,7 @@ layout(location = 2) in vec2 frag_tex;
 layout(location = 3) flat in int frag_segment_uid;
 layout(location = 4) in vec4 prev_cs_frag_pos;
 layout(location = 5) in vec4 cs_frag_pos;
+layout(location = 6) in float frag_ao;
 
 layout(location = 0) out vec4 out_position;
 layout(location = 1) out vec4 out_normal;
@@ -44,10 +45,6 @@ layout(binding = 5) buffer FireflyBuffer {
 
 layout(binding = 6) uniform sampler2DArray noise_tex_sampler; // noise textures
 
-layout(binding = 10) buffer TunnelIndicesBuffer {
-    uint tunnel_indices[];
-};
-
 layout(binding = 11) buffer TunnelVerticesBuffer {
     AlignedTunnelVertex tunnel_vertices[];
 };
@@ -75,6 +72,8 @@ void main()
     {
         // add noise from noise texture to color
         vec4 color = vec4(0.63, 0.32, 0.18, 1.0) * texture(noise_tex_sampler, vec3(frag_tex, 1));
+        // occlusion of the wall by its own bumps, baked into the vertices when the segment is generated
+        color.rgb *= frag_ao;
 
         out_position = vec4(frag_pos, 1.0);
         out_normal = vec4(normal, 1.0);
@@ -4,11 +4,10 @@
 #include "common.glsl"
 
 layout(constant_id = 0) const uint NUM_MVPS = 1;
-
-layout(location = 0) in vec3 pos;
-layout(location = 1) in vec2 normal;
-layout(location = 2) in vec2 tex;
-layout(location = 3) in float segment_uid;
+layout(constant_id = 1) const uint SAMPLES_PER_SEGMENT = 1;
+layout(constant_id = 2) const uint VERTICES_PER_SAMPLE = 1;
+layout(constant_id = 3) const uint SEGMENT_COUNT = 1;
+layout(constant_id = 4) const uint COMPACT_TUNNEL_VERTICES = 0;
 
 layout(location = 0) out vec3 frag_pos;
 layout(location = 1) out vec3 frag_normal;
@@ -16,21 +15,52 @@ layout(location = 2) out vec2 frag_tex;
 layout(location = 3) flat out int frag_segment_uid;
 layout(location = 4) out vec4 prev_cs_frag_pos;
 layout(location = 5) out vec4 cs_frag_pos;
+layout(location = 6) out float frag_ao;
 
 layout(binding = 0) uniform ModelRenderDataBuffer {
     ModelRenderData mrd;
 };
 
+layout(binding = 7) readonly buffer TunnelBezierPointsBuffer {
+    vec3 tunnel_bezier_points[];
+};
+
+layout(binding = 8) readonly buffer TunnelSegmentUidBuffer {
+    uint tunnel_segment_uids[];
+};
+
+// COMPACT_TUNNEL_VERTICES decides which of the two views of the vertex buffer is used
+layout(binding = 11) readonly buffer TunnelVerticesBuffer {
+    AlignedTunnelVertex tunnel_vertices[];
+};
+
+layout(binding = 11) readonly buffer CompactTunnelVerticesBuffer {
+    CompactTunnelVertex compact_tunnel_vertices[];
+};
+
 layout(push_constant) uniform PushConstant {
     PushConstants pc;
 };
 
+TunnelVertex load_tunnel_vertex(uint idx)
+{
+    if (COMPACT_TUNNEL_VERTICES == 0) return unpack_tunnel_vertex(tunnel_vertices[idx]);
+    const uint segment_uid = tunnel_segment_uids[idx / (SAMPLES_PER_SEGMENT * VERTICES_PER_SAMPLE)];
+    const vec3 p0 = tunnel_bezier_points[get_tunnel_bezier_point_idx(segment_uid, 0, SEGMENT_COUNT)];
+    const vec3 p1 = tunnel_bezier_points[get_tunnel_bezier_point_idx(segment_uid, 1, SEGMENT_COUNT)];
+    const vec3 p2 = tunnel_bezier_points[get_tunnel_bezier_point_idx(segment_uid, 2, SEGMENT_COUNT)];
+    return unpack_compact_tunnel_vertex(compact_tunnel_vertices[idx], p0, p1, p2, segment_uid, idx % (SAMPLES_PER_SEGMENT * VERTICES_PER_SAMPLE), SAMPLES_PER_SEGMENT, VERTICES_PER_SAMPLE);
+}
+
 void main() {
-    prev_cs_frag_pos = mrd.prev_mvp * vec4(pos, 1.0);
-    cs_frag_pos = mrd.mvp * vec4(pos, 1.0);
-    gl_Position = mrd.mvp * vec4(pos, 1.0);
-    frag_pos = pos;
-    frag_normal = vec3(normal, sign(segment_uid) * sqrt(1.0 - normal.x * normal.x - normal.y * normal.y));
-    frag_tex = tex;
-    frag_segment_uid = int(abs(segment_uid) + 0.1);
+    // vertices are pulled from the vertex buffer; gl_VertexIndex is the position in the region of the tessellation level that is passed as instance index
+    const TunnelVertex v = load_tunnel_vertex(get_tunnel_vertex_idx(uint(gl_VertexIndex), uint(gl_InstanceIndex), SAMPLES_PER_SEGMENT, VERTICES_PER_SAMPLE));
+    prev_cs_frag_pos = mrd.prev_mvp * vec4(v.pos, 1.0);
+    cs_frag_pos = mrd.mvp * vec4(v.pos, 1.0);
+    gl_Position = mrd.mvp * vec4(v.pos, 1.0);
+    frag_pos = v.pos;
+    frag_normal = v.normal;
+    frag_tex = v.tex;
+    frag_segment_uid = int(v.segment_uid);
+    frag_ao = v.ao;
 }
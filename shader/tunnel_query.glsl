@@ -0,0 +1,206 @@
+// queries against the center line and the wall of the tunnel, same as TunnelQuery.hpp and get_tunnel_wall_radius in TunnelGenerator.hpp on the cpu
+// needs common.glsl
+
+// from "The Book of Shaders": Cellular Noise
+// Permutation polynomial: (34x^2 + x) mod 289
+vec3 permute(vec3 x) {
+    return mod((34.0 * x + 1.0) * x, 289.0);
+}
+
+// Cellular noise, returning F1 and F2 in a vec2.
+// Standard 3x3 search window for good F1 and F2 values
+float cellular(vec2 P) {
+    #define K 0.142857142857 // 1/7
+    #define Ko 0.428571428571 // 3/7
+    #define jitter 1.0 // Less gives more regular pattern
+    vec2 Pi = mod(floor(P), 289.0);
+     vec2 Pf = fract(P);
+    vec3 oi = vec3(-1.0, 0.0, 1.0);
+    vec3 of = vec3(-0.5, 0.5, 1.5);
+    vec3 px = permute(Pi.x + oi);
+    vec3 p = permute(px.x + Pi.y + oi); // p11, p12, p13
+    vec3 ox = fract(p*K) - Ko;
+    vec3 oy = mod(floor(p*K),7.0)*K - Ko;
+    vec3 dx = Pf.x + 0.5 + jitter*ox;
+    vec3 dy = Pf.y - of + jitter*oy;
+    vec3 d1 = dx * dx + dy * dy; // d11, d12 and d13, squared
+    p = permute(px.y + Pi.y + oi); // p21, p22, p23
+    ox = fract(p*K) - Ko;
+    oy = mod(floor(p*K),7.0)*K - Ko;
+    dx = Pf.x - 0.5 + jitter*ox;
+    dy = Pf.y - of + jitter*oy;
+    vec3 d2 = dx * dx + dy * dy; // d21, d22 and d23, squared
+    p = permute(px.z + Pi.y + oi); // p31, p32, p33
+    ox = fract(p*K) - Ko;
+    oy = mod(floor(p*K),7.0)*K - Ko;
+    dx = Pf.x - 1.5 + jitter*ox;
+    dy = Pf.y - of + jitter*oy;
+    vec3 d3 = dx * dx + dy * dy; // d31, d32 and d33, squared
+    // Sort out the two smallest distances (F1, F2)
+    vec3 d1a = min(d1, d2);
+    d2 = max(d1, d2); // Swap to keep candidates for F2
+    d2 = min(d2, d3); // neither F1 nor F2 are now in d3
+    d1 = min(d1a, d2); // F1 is now in d1
+    d2 = max(d1a, d2); // Swap to keep candidates for F2
+    d1.xy = (d1.x < d1.y) ? d1.xy : d1.yx; // Swap if smaller
+    d1.xz = (d1.x < d1.z) ? d1.xz : d1.zx; // F1 is in d1.x
+    d1.yz = min(d1.yz, d2.yz); // F2 is now not in d2.yz
+    d1.y = min(d1.y, d1.z); // nor in  d1.z
+    d1.y = min(d1.y, d2.x); // F2 is in d1.y, we're done.
+    vec2 F = sqrt(d1.xy);
+    return 0.1+(F.y-F.x);
+}
+#undef K
+#undef Ko
+#undef jitter
+
+// distance of the tunnel wall to the center line at arc_fraction along the segment and angle_fraction (angle / 360 degrees) around it
+// at arc_fraction = ring / (samples_per_segment - 1) and angle_fraction = vertex / vertices_per_sample this is the radius of the tunnel vertex
+float get_tunnel_wall_radius(uint segment_uid, float arc_fraction, float angle_fraction)
+{
+    const vec2 tex = vec2(abs((segment_uid % 2) - arc_fraction), abs(angle_fraction * 2.0 - 1.0));
+    const float height = cellular(vec2(tex.s * 2.0 + segment_uid, tex.t * 3.0)) * (-pow(arc_fraction * 2.0 - 1.0, 2) + 1.0);
+    return 20.0 - height * 12.0;
+}
+
+// ambient occlusion of the wall at a point with the given radius from the horizon of the wall around it, same as get_tunnel_wall_occlusion on the cpu
+// only the displacement of the wall occludes; the smooth tube would darken the whole tunnel evenly, so it is left out
+const uint TUNNEL_AO_DIRECTIONS = 8;
+const uint TUNNEL_AO_STEPS = 2;
+const float TUNNEL_AO_RADIUS = 4.0;
+
+float get_tunnel_wall_occlusion(uint segment_uid, float arc_fraction, float angle_fraction, float radius, float segment_length)
+{
+    float occlusion = 0.0;
+    for (uint i = 0; i < TUNNEL_AO_DIRECTIONS; ++i)
+    {
+        const float direction_angle = 2.0 * PI * (float(i) + 0.5) / float(TUNNEL_AO_DIRECTIONS);
+        const vec2 direction = vec2(cos(direction_angle), sin(direction_angle));
+        float max_horizon = 0.0;
+        for (uint j = 1; j <= TUNNEL_AO_STEPS; ++j)
+        {
+            const float step_distance = TUNNEL_AO_RADIUS * float(j) / float(TUNNEL_AO_STEPS);
+            // the displacement fades out towards the ends of a segment, so clamping stays close to the neighboring segment
+            const float neighbor_arc_fraction = clamp(arc_fraction + direction.x * step_distance / segment_length, 0.0, 1.0);
+            const float neighbor_angle_fraction = fract(angle_fraction + direction.y * step_distance / (2.0 * PI * radius));
+            // how far the wall at the neighbor reaches towards the center line beyond the point
+            const float height = radius - get_tunnel_wall_radius(segment_uid, neighbor_arc_fraction, neighbor_angle_fraction);
+            // sine of the horizon angle, which is the cosine weighted occlusion of this direction
+            max_horizon = max(max_horizon, height / sqrt(height * height + step_distance * step_distance));
+        }
+        occlusion += max_horizon;
+    }
+    return 1.0 - occlusion / float(TUNNEL_AO_DIRECTIONS);
+}
+
+// real roots of a * t^3 + b * t^2 + c * t + d; degenerates to the quadratic and linear case if the leading coefficients are negligible
+uint solve_cubic(float a, float b, float c, float d, out vec3 roots)
+{
+    roots = vec3(0.0);
+    const float scale = max(max(abs(b), abs(c)), abs(d));
+    if (abs(a) <= 1e-6 * scale)
+    {
+        if (abs(b) <= 1e-6 * scale)
+        {
+            if (c == 0.0) return 0u;
+            roots.x = -d / c;
+            return 1u;
+        }
+        const float discriminant = c * c - 4.0 * b * d;
+        if (discriminant < 0.0) return 0u;
+        roots.xy = (-c + vec2(1.0, -1.0) * sqrt(discriminant)) / (2.0 * b);
+        return 2u;
+    }
+    // depressed cubic x^3 + p * x + q with t = x - b / 3
+    b /= a;
+    c /= a;
+    d /= a;
+    const float offset = b / 3.0;
+    const float p = c - b * offset;
+    const float q = 2.0 * offset * offset * offset - offset * c + d;
+    const float discriminant = q * q / 4.0 + p * p * p / 27.0;
+    if (discriminant >= 0.0)
+    {
+        // one real root (Cardano), glsl's pow is undefined for negative bases
+        const vec2 w = -q / 2.0 + vec2(1.0, -1.0) * sqrt(discriminant);
+        roots.x = sign(w.x) * pow(abs(w.x), 1.0 / 3.0) + sign(w.y) * pow(abs(w.y), 1.0 / 3.0) - offset;
+        return 1u;
+    }
+    // three real roots (trigonometric solution), p < 0 here
+    const float r = sqrt(-p / 3.0);
+    const float phi = acos(clamp(-q / (2.0 * r * r * r), -1.0, 1.0));
+    roots = 2.0 * r * cos((phi - vec3(0.0, 2.0, 4.0) * PI) / 3.0) - offset;
+    return 3u;
+}
+
+// curve parameter in [0, 1] of the point on the quadratic bézier curve that is closest to pos
+float get_closest_bezier_parameter(vec3 p0, vec3 p1, vec3 p2, vec3 pos)
+{
+    // curve is p0 + 2 * t * a + t^2 * b; the derivative of the squared distance to pos is a cubic in t
+    const vec3 a = p1 - p0;
+    const vec3 b = p0 - 2.0 * p1 + p2;
+    const vec3 m = p0 - pos;
+    vec3 roots;
+    const uint root_count = solve_cubic(dot(b, b), 3.0 * dot(a, b), 2.0 * dot(a, a) + dot(m, b), dot(m, a), roots);
+    // the minimum is either at a root inside the segment or at one of its ends
+    float best_t = 0.0;
+    float best_distance = dot(m, m);
+    if (dot(p2 - pos, p2 - pos) < best_distance)
+    {
+        best_t = 1.0;
+        best_distance = dot(p2 - pos, p2 - pos);
+    }
+    for (uint i = 0; i < root_count; ++i)
+    {
+        float t = clamp(roots[i], 0.0, 1.0);
+        // the closed form loses precision for nearly straight segments, two newton steps on the derivative fix that
+        for (uint j = 0; j < 2; ++j)
+        {
+            const vec3 tangent = 2.0 * a + 2.0 * t * b;
+            const vec3 offset = m + 2.0 * t * a + t * t * b;
+            const float slope = dot(tangent, tangent) + 2.0 * dot(offset, b);
+            if (slope > 0.0) t = clamp(t - dot(offset, tangent) / slope, 0.0, 1.0);
+        }
+        const vec3 offset = m + 2.0 * t * a + t * t * b;
+        if (dot(offset, offset) < best_distance)
+        {
+            best_t = t;
+            best_distance = dot(offset, offset);
+        }
+    }
+    return best_t;
+}
+
+struct TunnelQuery {
+    // curve parameter of the closest point on the center line
+    float t;
+    // fraction of the length of the segment up to the closest point, ring i of the segment is at i / (samples_per_segment - 1)
+    float arc_fraction;
+    // angle around the center line in [0, 1), vertex j of a ring is at j / vertices_per_sample
+    float angle_fraction;
+    vec3 center;
+    float center_distance;
+    float wall_radius;
+    // distance to the wall in the plane of the ring, positive inside the tunnel
+    float wall_distance;
+};
+
+TunnelQuery query_tunnel_segment(vec3 p0, vec3 p1, vec3 p2, uint segment_uid, vec3 pos)
+{
+    TunnelQuery query;
+    query.t = get_closest_bezier_parameter(p0, p1, p2, pos);
+    query.arc_fraction = get_tunnel_arc_length(p0, p1, p2, query.t) / get_tunnel_arc_length(p0, p1, p2, 1.0);
+    query.center = get_tunnel_ring_center_at(p0, p1, p2, query.t);
+    query.center_distance = distance(pos, query.center);
+    vec3 plane_normal;
+    vec3 plane_vector;
+    get_tunnel_ring_frame(p0, p1, p2, query.t, plane_normal, plane_vector);
+    // pos lies in the ring plane unless the closest point is an end of the segment, so project it to get the radial part
+    vec3 radial = pos - query.center;
+    radial -= plane_normal * dot(radial, plane_normal);
+    // rotating plane_vector by the angle around plane_normal gives cos * plane_vector + sin * cross(plane_normal, plane_vector)
+    query.angle_fraction = fract(atan(dot(radial, normalize(cross(plane_normal, plane_vector))), dot(radial, normalize(plane_vector))) / (2.0 * PI));
+    query.wall_radius = get_tunnel_wall_radius(segment_uid, query.arc_fraction, query.angle_fraction);
+    query.wall_distance = query.wall_radius - length(radial);
+    return query;
+}
@@ -0,0 +1,441 @@
+#include "Bvh.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numeric>
+#include <thread>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+
+#include "Parallel.hpp"
+#include "Simd.hpp"
+#include "ve_log.hpp"
+
+namespace ve
+{
+    namespace
+    {
+        constexpr uint32_t bin_count = 16;
+        constexpr uint32_t max_leaf_size = 4;
+        // cost of a traversal step relative to a triangle test
+        constexpr float traversal_cost = 1.0f;
+        // limits the traversal stack, nodes at this depth become leaves regardless of their size
+        constexpr uint32_t max_depth = 64;
+        // subtrees with fewer triangles are not worth a task of their own
+        constexpr uint32_t min_task_size = 1024;
+
+        struct Aabb
+        {
+            glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+            glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+
+            void grow(const glm::vec3& p)
+            {
+                min = glm::min(min, p);
+                max = glm::max(max, p);
+            }
+
+            void grow(const Aabb& b)
+            {
+                min = glm::min(min, b.min);
+                max = glm::max(max, b.max);
+            }
+
+            float area() const
+            {
+                const glm::vec3 e = max - min;
+                if (e.x < 0.0f) return 0.0f;
+                return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+            }
+        };
+
+        float get_area(const BvhNode& node)
+        {
+            return Aabb{node.min, node.max}.area();
+        }
+
+        // subtree that is built by a worker thread, its root was already allocated by the top levels
+        struct BuildTask
+        {
+            uint32_t node;
+            uint32_t first;
+            uint32_t count;
+            uint32_t depth;
+        };
+
+        struct BuildInput
+        {
+            const std::vector<Aabb>& bounds;
+            const std::vector<glm::vec3>& centroids;
+            // triangles are reordered in place, the triangles of a node are always consecutive
+            std::vector<uint32_t>& ids;
+        };
+
+        // nodes with at most task_size triangles are not built, but added to tasks if tasks is given
+        void build_node(const BuildInput& in, std::vector<BvhNode>& nodes, uint32_t node_idx, uint32_t first, uint32_t count, uint32_t depth, uint32_t task_size, std::vector<BuildTask>* tasks)
+        {
+            Aabb node_bounds;
+            Aabb centroid_bounds;
+            for (uint32_t i = first; i < first + count; ++i)
+            {
+                node_bounds.grow(in.bounds[in.ids[i]]);
+                centroid_bounds.grow(in.centroids[in.ids[i]]);
+            }
+            nodes[node_idx].min = node_bounds.min;
+            nodes[node_idx].max = node_bounds.max;
+            if (tasks && count <= task_size)
+            {
+                tasks->push_back(BuildTask{node_idx, first, count, depth});
+                return;
+            }
+            auto make_leaf = [&]() {
+                nodes[node_idx].first = first;
+                nodes[node_idx].count = count;
+            };
+            if (count <= 1 || depth + 1 >= max_depth)
+            {
+                make_leaf();
+                return;
+            }
+
+            // the triangles are sorted into bins by their centroid, the split planes between the bins are evaluated with the surface area heuristic
+            glm::vec3 bin_scale;
+            for (uint32_t axis = 0; axis < 3; ++axis) bin_scale[axis] = float(bin_count) / (centroid_bounds.max[axis] - centroid_bounds.min[axis]);
+            auto get_bin = [&](uint32_t id, uint32_t axis) {
+                return std::min(uint32_t((in.centroids[id][axis] - centroid_bounds.min[axis]) * bin_scale[axis]), bin_count - 1);
+            };
+            float best_cost = std::numeric_limits<float>::max();
+            uint32_t best_axis = 0;
+            uint32_t best_split = 0;
+            for (uint32_t axis = 0; axis < 3; ++axis)
+            {
+                if (centroid_bounds.max[axis] <= centroid_bounds.min[axis]) continue;
+                std::array<Aabb, bin_count> bin_bounds;
+                std::array<uint32_t, bin_count> bin_counts{};
+                for (uint32_t i = first; i < first + count; ++i)
+                {
+                    const uint32_t bin = get_bin(in.ids[i], axis);
+                    bin_counts[bin]++;
+                    bin_bounds[bin].grow(in.bounds[in.ids[i]]);
+                }
+                // costs of the right sides first, so that every split plane is evaluated in one pass from the left
+                std::array<float, bin_count - 1> right_costs;
+                Aabb right;
+                uint32_t right_count = 0;
+                for (uint32_t bin = bin_count - 1; bin > 0; --bin)
+                {
+                    right.grow(bin_bounds[bin]);
+                    right_count += bin_counts[bin];
+                    right_costs[bin - 1] = right.area() * float(right_count);
+                }
+                Aabb left;
+                uint32_t left_count = 0;
+                for (uint32_t bin = 0; bin < bin_count - 1; ++bin)
+                {
+                    left.grow(bin_bounds[bin]);
+                    left_count += bin_counts[bin];
+                    if (left_count == 0 || left_count == count) continue;
+                    const float cost = left.area() * float(left_count) + right_costs[bin];
+                    if (cost < best_cost)
+                    {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = bin;
+                    }
+                }
+            }
+
+            uint32_t left_count = count / 2;
+            if (best_cost < std::numeric_limits<float>::max())
+            {
+                // both costs are relative to the cost of one triangle test
+                const float split_cost = traversal_cost + best_cost / std::max(node_bounds.area(), std::numeric_limits<float>::min());
+                if (count <= max_leaf_size && split_cost >= float(count))
+                {
+                    make_leaf();
+                    return;
+                }
+                auto mid = std::partition(in.ids.begin() + first, in.ids.begin() + first + count, [&](uint32_t id) { return get_bin(id, best_axis) <= best_split; });
+                left_count = uint32_t(mid - (in.ids.begin() + first));
+            }
+            else if (count <= max_leaf_size)
+            {
+                // all centroids are at the same position, so the triangles cannot be separated
+                make_leaf();
+                return;
+            }
+
+            const uint32_t child = nodes.size();
+            nodes.resize(nodes.size() + 2);
+            nodes[node_idx].first = child;
+            nodes[node_idx].count = 0;
+            build_node(in, nodes, child, first, left_count, depth + 1, task_size, tasks);
+            build_node(in, nodes, child + 1, first + left_count, count - left_count, depth + 1, task_size, tasks);
+        }
+
+        template<typename T>
+        struct LaneVec3
+        {
+            T x;
+            T y;
+            T z;
+        };
+
+        // entry is the distance at which the rays enter the box
+        template<typename T>
+        inline auto intersect_box(const BvhNode& node, const LaneVec3<T>& origin, const LaneVec3<T>& inv_dir, const T& t_min, const T& t_max, T& entry)
+        {
+            const T tx0 = (node.min.x - origin.x) * inv_dir.x;
+            const T tx1 = (node.max.x - origin.x) * inv_dir.x;
+            const T ty0 = (node.min.y - origin.y) * inv_dir.y;
+            const T ty1 = (node.max.y - origin.y) * inv_dir.y;
+            const T tz0 = (node.min.z - origin.z) * inv_dir.z;
+            const T tz1 = (node.max.z - origin.z) * inv_dir.z;
+            entry = lane_max(lane_max(lane_min(tx0, tx1), lane_min(ty0, ty1)), lane_max(lane_min(tz0, tz1), t_min));
+            const T exit = lane_min(lane_min(lane_max(tx0, tx1), lane_max(ty0, ty1)), lane_min(lane_max(tz0, tz1), t_max));
+            return entry <= exit;
+        }
+    } // namespace
+
+    void Bvh::build(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices, uint32_t thread_count)
+    {
+        VE_ASSERT(indices.size() % 3 == 0, "Bvh needs three indices per triangle!");
+        this->indices = indices;
+        const uint32_t triangle_count = indices.size() / 3;
+        nodes.clear();
+        primitive_ids.resize(triangle_count);
+        std::iota(primitive_ids.begin(), primitive_ids.end(), 0);
+        if (triangle_count == 0)
+        {
+            triangles.clear();
+            return;
+        }
+        std::vector<Aabb> bounds(triangle_count);
+        std::vector<glm::vec3> centroids(triangle_count);
+        for (uint32_t i = 0; i < triangle_count; ++i)
+        {
+            for (uint32_t j = 0; j < 3; ++j) bounds[i].grow(positions[indices[i * 3 + j]]);
+            centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+        }
+
+        // the first levels are built serially until the subtrees are small enough to give every thread a few of them
+        if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+        const BuildInput in{bounds, centroids, primitive_ids};
+        std::vector<BuildTask> tasks;
+        const uint32_t task_size = std::max(triangle_count / (thread_count * 4), min_task_size);
+        nodes.reserve(triangle_count * 2);
+        nodes.resize(1);
+        build_node(in, nodes, 0, 0, triangle_count, 0, task_size, thread_count > 1 ? &tasks : nullptr);
+        std::vector<std::vector<BvhNode>> subtrees(tasks.size());
+        parallel_for(tasks.size(), [&](uint32_t i) {
+            subtrees[i].reserve(tasks[i].count * 2);
+            subtrees[i].resize(1);
+            build_node(in, subtrees[i], 0, tasks[i].first, tasks[i].count, tasks[i].depth, 0, nullptr);
+        }, thread_count);
+        // the root of a subtree replaces the node of its task, all other nodes are appended; leaves already refer to the shared triangle order
+        for (uint32_t i = 0; i < tasks.size(); ++i)
+        {
+            const uint32_t offset = nodes.size() - 1;
+            for (uint32_t j = 0; j < subtrees[i].size(); ++j)
+            {
+                BvhNode node = subtrees[i][j];
+                if (node.count == 0) node.first += offset;
+                if (j == 0) nodes[tasks[i].node] = node;
+                else nodes.push_back(node);
+            }
+        }
+        update_triangles(positions);
+    }
+
+    void Bvh::update_triangles(const std::vector<glm::vec3>& positions)
+    {
+        triangles.resize(primitive_ids.size());
+        for (uint32_t i = 0; i < primitive_ids.size(); ++i)
+        {
+            const glm::vec3& v0 = positions[indices[primitive_ids[i] * 3]];
+            triangles[i] = Triangle{v0, positions[indices[primitive_ids[i] * 3 + 1]] - v0, positions[indices[primitive_ids[i] * 3 + 2]] - v0};
+        }
+    }
+
+    void Bvh::refit(const std::vector<glm::vec3>& positions)
+    {
+        update_triangles(positions);
+        for (uint32_t i = nodes.size(); i-- > 0;)
+        {
+            BvhNode& node = nodes[i];
+            Aabb bounds;
+            if (node.count > 0)
+            {
+                for (uint32_t j = node.first; j < node.first + node.count; ++j)
+                {
+                    bounds.grow(triangles[j].v0);
+                    bounds.grow(triangles[j].v0 + triangles[j].e1);
+                    bounds.grow(triangles[j].v0 + triangles[j].e2);
+                }
+            }
+            else
+            {
+                bounds.grow(Aabb{nodes[node.first].min, nodes[node.first].max});
+                bounds.grow(Aabb{nodes[node.first + 1].min, nodes[node.first + 1].max});
+            }
+            node.min = bounds.min;
+            node.max = bounds.max;
+        }
+    }
+
+    template<typename T, bool any_hit>
+    void Bvh::traverse(const BvhRay* rays, uint32_t count, BvhHit* hits, uint8_t* occluded) const
+    {
+        constexpr uint32_t lanes = lane_count<T>();
+        for (uint32_t first_ray = 0; first_ray < count; first_ray += lanes)
+        {
+            const uint32_t ray_count = std::min(lanes, count - first_ray);
+            // rays in structure of arrays layout, unused lanes get an empty interval so they never hit anything
+            std::array<float, lanes> ox, oy, oz, dx, dy, dz, t_mins, t_maxs;
+            std::array<uint32_t, lanes> primitives;
+            for (uint32_t l = 0; l < lanes; ++l)
+            {
+                const BvhRay& ray = rays[first_ray + std::min(l, ray_count - 1)];
+                ox[l] = ray.origin.x;
+                oy[l] = ray.origin.y;
+                oz[l] = ray.origin.z;
+                dx[l] = ray.dir.x;
+                dy[l] = ray.dir.y;
+                dz[l] = ray.dir.z;
+                t_mins[l] = l < ray_count ? ray.t_min : 1.0f;
+                t_maxs[l] = l < ray_count ? ray.t_max : 0.0f;
+                primitives[l] = uint32_t(-1);
+            }
+            const LaneVec3<T> origin{lane_load<T>(ox.data(), lanes), lane_load<T>(oy.data(), lanes), lane_load<T>(oz.data(), lanes)};
+            const LaneVec3<T> dir{lane_load<T>(dx.data(), lanes), lane_load<T>(dy.data(), lanes), lane_load<T>(dz.data(), lanes)};
+            const LaneVec3<T> inv_dir{T(1.0f) / dir.x, T(1.0f) / dir.y, T(1.0f) / dir.z};
+            const T t_min = lane_load<T>(t_mins.data(), lanes);
+            // shrinks to the closest hit so far; for any hit queries it is set below t_min once a ray hit something, which excludes the ray from the traversal
+            T t_max = lane_load<T>(t_maxs.data(), lanes);
+            T u(0.0f);
+            T v(0.0f);
+
+            std::array<uint32_t, max_depth + 1> stack;
+            uint32_t stack_size = 0;
+            if (!nodes.empty()) stack[stack_size++] = 0;
+            while (stack_size > 0)
+            {
+                uint32_t node_idx = stack[--stack_size];
+                // the node is tested again as the rays may have found closer hits since it was pushed
+                T entry;
+                if (!lane_any(intersect_box(nodes[node_idx], origin, inv_dir, t_min, t_max, entry))) continue;
+                while (true)
+                {
+                    const BvhNode& node = nodes[node_idx];
+                    if (node.count > 0)
+                    {
+                        for (uint32_t i = node.first; i < node.first + node.count; ++i)
+                        {
+                            // Möller-Trumbore without face culling
+                            const Triangle& tri = triangles[i];
+                            const T px = dir.y * tri.e2.z - dir.z * tri.e2.y;
+                            const T py = dir.z * tri.e2.x - dir.x * tri.e2.z;
+                            const T pz = dir.x * tri.e2.y - dir.y * tri.e2.x;
+                            const T det = tri.e1.x * px + tri.e1.y * py + tri.e1.z * pz;
+                            const T inv_det = T(1.0f) / det;
+                            const T sx = origin.x - tri.v0.x;
+                            const T sy = origin.y - tri.v0.y;
+                            const T sz = origin.z - tri.v0.z;
+                            const T hit_u = (sx * px + sy * py + sz * pz) * inv_det;
+                            const T qx = sy * tri.e1.z - sz * tri.e1.y;
+                            const T qy = sz * tri.e1.x - sx * tri.e1.z;
+                            const T qz = sx * tri.e1.y - sy * tri.e1.x;
+                            const T hit_v = (dir.x * qx + dir.y * qy + dir.z * qz) * inv_det;
+                            const T t = (tri.e2.x * qx + tri.e2.y * qy + tri.e2.z * qz) * inv_det;
+                            const auto hit = (det != 0.0f) && (hit_u >= 0.0f) && (hit_v >= 0.0f) && (hit_u + hit_v <= 1.0f) && (t > t_min) && (t < t_max);
+                            if (!lane_any(hit)) continue;
+                            for (uint32_t l = 0; l < ray_count; ++l)
+                            {
+                                if (lane_test(hit, l)) primitives[l] = primitive_ids[i];
+                            }
+                            if constexpr (any_hit)
+                            {
+                                t_max = lane_select(hit, T(-std::numeric_limits<float>::max()), t_max);
+                            }
+                            else
+                            {
+                                t_max = lane_select(hit, t, t_max);
+                                u = lane_select(hit, hit_u, u);
+                                v = lane_select(hit, hit_v, v);
+                            }
+                        }
+                        break;
+                    }
+                    // continue with the closer child and visit the other one later
+                    T entry_a, entry_b;
+                    const auto hit_a = intersect_box(nodes[node.first], origin, inv_dir, t_min, t_max, entry_a);
+                    const auto hit_b = intersect_box(nodes[node.first + 1], origin, inv_dir, t_min, t_max, entry_b);
+                    const bool any_a = lane_any(hit_a);
+                    const bool any_b = lane_any(hit_b);
+                    if (any_a && any_b)
+                    {
+                        const bool a_first = lane_hmin(lane_select(hit_a, entry_a, T(std::numeric_limits<float>::max()))) <= lane_hmin(lane_select(hit_b, entry_b, T(std::numeric_limits<float>::max())));
+                        stack[stack_size++] = a_first ? node.first + 1 : node.first;
+                        node_idx = a_first ? node.first : node.first + 1;
+                    }
+                    else if (any_a) node_idx = node.first;
+                    else if (any_b) node_idx = node.first + 1;
+                    else break;
+                }
+                if constexpr (any_hit)
+                {
+                    if (lane_all(t_max < t_min)) break;
+                }
+            }
+
+            for (uint32_t l = 0; l < ray_count; ++l)
+            {
+                if constexpr (any_hit) occluded[first_ray + l] = primitives[l] != uint32_t(-1);
+                else hits[first_ray + l] = primitives[l] == uint32_t(-1) ? BvhHit() : BvhHit{lane_get(t_max, l), primitives[l], lane_get(u, l), lane_get(v, l)};
+            }
+        }
+    }
+
+    BvhHit Bvh::intersect(const BvhRay& ray) const
+    {
+        BvhHit hit;
+        traverse<float, false>(&ray, 1, &hit, nullptr);
+        return hit;
+    }
+
+    bool Bvh::occluded(const BvhRay& ray) const
+    {
+        uint8_t result = 0;
+        traverse<float, true>(&ray, 1, nullptr, &result);
+        return result;
+    }
+
+    void Bvh::intersect_packet(const BvhRay* rays, uint32_t count, BvhHit* hits) const
+    {
+        traverse<FloatLanes, false>(rays, count, hits, nullptr);
+    }
+
+    void Bvh::occluded_packet(const BvhRay* rays, uint32_t count, uint8_t* occluded) const
+    {
+        traverse<FloatLanes, true>(rays, count, nullptr, occluded);
+    }
+
+    const std::vector<BvhNode>& Bvh::get_nodes() const
+    {
+        return nodes;
+    }
+
+    uint32_t Bvh::get_triangle_count() const
+    {
+        return triangles.size();
+    }
+
+    float Bvh::get_sah_cost() const
+    {
+        if (nodes.empty()) return 0.0f;
+        float cost = 0.0f;
+        for (const BvhNode& node : nodes) cost += get_area(node) * (node.count > 0 ? float(node.count) : traversal_cost);
+        return cost / std::max(get_area(nodes[0]), std::numeric_limits<float>::min());
+    }
+} // namespace ve
@@ -0,0 +1,359 @@
+#include "NoiseTextures.hpp"
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#include "Parallel.hpp"
+#include "Simd.hpp"
+#include "ve_log.hpp"
+
+namespace ve
+{
+    namespace
+    {
+        constexpr uint32_t cache_magic = 0x4e455645; // "EVEN"
+        constexpr uint32_t cache_version = 2;
+        constexpr int octaves = 4;
+
+        struct CacheHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t dim;
+            uint32_t layer_count;
+            uint64_t key;
+        };
+
+        // FNV-1a
+        uint64_t hash_bytes(const unsigned char* data, std::size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+        {
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                hash ^= data[i];
+                hash *= 0x100000001b3ull;
+            }
+            return hash;
+        }
+
+        template<typename T>
+        struct Lanes2
+        {
+            T x, y;
+        };
+
+        // pcg2d from "Hash Functions for GPU Rendering" (Jarzynski and Olano), integer arithmetic gives the same bits as on the gpu
+        std::array<uint32_t, 2> pcg2d(uint32_t x, uint32_t y)
+        {
+            x = x * 1664525u + 1013904223u;
+            y = y * 1664525u + 1013904223u;
+            x += y * 1664525u;
+            y += x * 1664525u;
+            x ^= x >> 16;
+            y ^= y >> 16;
+            x += y * 1664525u;
+            y += x * 1664525u;
+            x ^= x >> 16;
+            y ^= y >> 16;
+            return {x, y};
+        }
+
+        // the upper 24 bits are exactly representable as float, so the result in [0, 1) is the same as on the gpu
+        float unit_float(uint32_t h)
+        {
+            return float(h >> 8) * (1.0f / 16777216.0f);
+        }
+
+        // the following functions mirror the ones in create_noise_textures.comp and operate on FloatLanes pixels at once
+
+        // hash of integer lattice points, x and y hold whole numbers
+        template<typename T>
+        Lanes2<T> hash2(const T& x, const T& y)
+        {
+            Lanes2<T> h{T(0.0f), T(0.0f)};
+            for (uint32_t i = 0; i < lane_count<T>(); ++i)
+            {
+                const std::array<uint32_t, 2> bits = pcg2d(uint32_t(int32_t(lane_get(x, i))), uint32_t(int32_t(lane_get(y, i))));
+                if constexpr (std::is_same_v<T, float>)
+                {
+                    h = {unit_float(bits[0]), unit_float(bits[1])};
+                }
+                else
+                {
+                    h.x[i] = unit_float(bits[0]);
+                    h.y[i] = unit_float(bits[1]);
+                }
+            }
+            return h;
+        }
+
+        template<typename T>
+        T random(const T& x, const T& y)
+        {
+            return -1.0f + 2.0f * hash2(x, y).x;
+        }
+
+        template<typename T>
+        Lanes2<T> random2(const T& x, const T& y)
+        {
+            return hash2(x, y);
+        }
+
+        template<typename T>
+        T noise(const T& x, const T& y)
+        {
+            const T ix = lane_floor(x);
+            const T iy = lane_floor(y);
+            const T fx = x - ix;
+            const T fy = y - iy;
+
+            const T a = random(ix, iy);
+            const T b = random(ix + 1.0f, iy);
+            const T c = random(ix, iy + 1.0f);
+            const T d = random(ix + 1.0f, iy + 1.0f);
+
+            const T ux = fx * fx * (3.0f - 2.0f * fx);
+            const T uy = fy * fy * (3.0f - 2.0f * fy);
+            return ((a + (b - a) * ux + (c - a) * uy * (1.0f - ux) + (d - b) * ux * uy) + 0.5f) / 1.5f;
+        }
+
+        template<typename T>
+        T fbm(T x, T y)
+        {
+            T value(0.0f);
+            float amplitude = 0.5f;
+            for (int i = 0; i < octaves; ++i)
+            {
+                value += amplitude * noise(x, y);
+                x *= 2.0f;
+                y *= 2.0f;
+                amplitude *= 0.5f;
+            }
+            return value;
+        }
+
+        template<typename T>
+        T mod289(const T& x)
+        {
+            return x - lane_floor(x * (1.0f / 289.0f)) * 289.0f;
+        }
+
+        template<typename T>
+        T permute(const T& x)
+        {
+            return mod289((x * 34.0f + 1.0f) * x);
+        }
+
+        template<typename T>
+        T snoise_corner(const T& p, const T& x, const T& y)
+        {
+            constexpr float cw = 0.024390243902439f;
+            T m = lane_max(0.5f - (x * x + y * y), T(0.0f));
+            m = m * m;
+            m = m * m;
+            const T gx = 2.0f * lane_fract(p * cw) - 1.0f;
+            const T h = lane_abs(gx) - 0.5f;
+            const T a0 = gx - lane_floor(gx + 0.5f);
+            m *= 1.79284291400159f - 0.85373472095314f * (a0 * a0 + h * h);
+            return m * (a0 * x + h * y);
+        }
+
+        template<typename T>
+        T snoise(const T& vx, const T& vy)
+        {
+            constexpr float cx = 0.211324865405187f;
+            constexpr float cy = 0.366025403784439f;
+            constexpr float cz = -0.577350269189626f;
+
+            const T s = (vx + vy) * cy;
+            T ix = lane_floor(vx + s);
+            T iy = lane_floor(vy + s);
+            const T t = (ix + iy) * cx;
+            const T x0x = vx - ix + t;
+            const T x0y = vy - iy + t;
+
+            const T i1x = lane_select(x0x > x0y, T(1.0f), T(0.0f));
+            const T i1y = 1.0f - i1x;
+            const T x1x = x0x + cx - i1x;
+            const T x1y = x0y + cx - i1y;
+            const T x2x = x0x + cz;
+            const T x2y = x0y + cz;
+
+            ix = mod289(ix);
+            iy = mod289(iy);
+            const T p0 = permute(permute(iy) + ix);
+            const T p1 = permute(permute(iy + i1y) + ix + i1x);
+            const T p2 = permute(permute(iy + 1.0f) + ix + 1.0f);
+
+            return 130.0f * (snoise_corner(p0, x0x, x0y) + snoise_corner(p1, x1x, x1y) + snoise_corner(p2, x2x, x2y));
+        }
+
+        template<typename T>
+        T turbulence(T x, T y)
+        {
+            T value(0.0f);
+            float amplitude = 0.5f;
+            for (int i = 0; i < octaves; ++i)
+            {
+                value += amplitude * lane_abs(snoise(x, y));
+                x *= 2.0f;
+                y *= 2.0f;
+                amplitude *= 0.5f;
+            }
+            return value;
+        }
+
+        template<typename T>
+        T cellular(const T& x, const T& y)
+        {
+            const T ix = lane_floor(x);
+            const T iy = lane_floor(y);
+            const T fx = x - ix;
+            const T fy = y - iy;
+            T m_dist(10.0f);
+            for (int j = -1; j <= 1; ++j)
+            {
+                for (int i = -1; i <= 1; ++i)
+                {
+                    Lanes2<T> point = random2(ix + float(i), iy + float(j));
+                    point.x = 0.5f + 0.5f * lane_sin(6.2831f * point.x);
+                    point.y = 0.5f + 0.5f * lane_sin(6.2831f * point.y);
+                    const T dx = float(i) + point.x - fx;
+                    const T dy = float(j) + point.y - fy;
+                    m_dist = lane_min(m_dist, lane_sqrt(dx * dx + dy * dy));
+                }
+            }
+            return m_dist;
+        }
+
+        // same conversion as imageStore to a rgba8 unorm image
+        template<typename T>
+        void store_unorm8(const T& v, unsigned char* dst, uint32_t stride, uint32_t count)
+        {
+            const T scaled = lane_floor(lane_clamp(v, 0.0f, 1.0f) * 255.0f + 0.5f);
+            for (uint32_t i = 0; i < count; ++i) dst[i * stride] = static_cast<unsigned char>(lane_get(scaled, i));
+        }
+
+        void generate_row(uint32_t y, uint32_t dim, NoiseTextureLayers& layers)
+        {
+            constexpr uint32_t lanes = lane_count<FloatLanes>();
+            constexpr float offsets[3] = {0.1f, 0.23f, 0.69f};
+            const float inv_dim = 1.0f / float(dim);
+            const FloatLanes tex_y(float(y) * inv_dim);
+            for (uint32_t x = 0; x < dim; x += lanes)
+            {
+                const uint32_t count = std::min(lanes, dim - x);
+                const FloatLanes tex_x = lane_iota<FloatLanes>(float(x)) * inv_dim;
+                unsigned char* normal_texel = layers[0].data() + (y * dim + x) * 4;
+                unsigned char* color_texel = layers[1].data() + (y * dim + x) * 4;
+                // mix worley noise and brownian noise to get a stone texture
+                for (uint32_t c = 0; c < 3; ++c)
+                {
+                    FloatLanes displacement = turbulence(tex_x * 80.0f + offsets[c], tex_y * 80.0f + offsets[c]);
+                    displacement *= 1.0f - cellular(tex_x * 320.0f + offsets[c], tex_y * 320.0f + offsets[c]);
+                    store_unorm8(displacement, normal_texel + c, 4, count);
+                }
+                const FloatLanes color = fbm(tex_x * 10.0f, tex_y * 10.0f);
+                for (uint32_t c = 0; c < 3; ++c) store_unorm8(color, color_texel + c, 4, count);
+                for (uint32_t i = 0; i < count; ++i)
+                {
+                    normal_texel[i * 4 + 3] = 255;
+                    color_texel[i * 4 + 3] = 255;
+                }
+            }
+        }
+    } // namespace
+
+    uint64_t noise_texture_cache_key(uint32_t dim)
+    {
+        std::ifstream spirv(noise_texture_shader_binary, std::ios::binary);
+        VE_ASSERT(spirv.is_open(), "Failed to open \"{}\"!", noise_texture_shader_binary);
+        std::vector<unsigned char> code((std::istreambuf_iterator<char>(spirv)), std::istreambuf_iterator<char>());
+        uint64_t key = hash_bytes(code.data(), code.size());
+        const uint32_t parameters[3] = {dim, noise_texture_layer_count, cache_version};
+        return hash_bytes(reinterpret_cast<const unsigned char*>(parameters), sizeof(parameters), key);
+    }
+
+    std::string noise_texture_cache_path(uint64_t key)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "noise_textures_%016llx.bin", static_cast<unsigned long long>(key));
+        return std::string(noise_texture_cache_dir) + name;
+    }
+
+    bool load_noise_texture_cache(uint64_t key, uint32_t dim, NoiseTextureLayers& layers)
+    {
+        const std::string path = noise_texture_cache_path(key);
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return false;
+        CacheHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(CacheHeader));
+        if (!file || header.magic != cache_magic || header.version != cache_version || header.key != key || header.dim != dim || header.layer_count != noise_texture_layer_count)
+        {
+            spdlog::warn("Ignoring invalid noise texture cache \"{}\"", path);
+            return false;
+        }
+        layers.assign(noise_texture_layer_count, std::vector<unsigned char>(dim * dim * 4));
+        for (auto& layer : layers) file.read(reinterpret_cast<char*>(layer.data()), layer.size());
+        if (!file)
+        {
+            spdlog::warn("Noise texture cache \"{}\" is truncated", path);
+            return false;
+        }
+        spdlog::info("Loaded noise textures from cache \"{}\"", path);
+        return true;
+    }
+
+    void save_noise_texture_cache(uint64_t key, uint32_t dim, const NoiseTextureLayers& layers)
+    {
+        std::filesystem::create_directories(noise_texture_cache_dir);
+        const std::string path = noise_texture_cache_path(key);
+        // write to a temporary file first so that an interrupted write never leaves a corrupt cache behind
+        const std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!file.is_open())
+            {
+                spdlog::warn("Failed to write noise texture cache \"{}\"", path);
+                return;
+            }
+            CacheHeader header{cache_magic, cache_version, dim, uint32_t(layers.size()), key};
+            file.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+            for (const auto& layer : layers) file.write(reinterpret_cast<const char*>(layer.data()), layer.size());
+        }
+        std::filesystem::rename(tmp_path, path);
+        spdlog::info("Saved noise textures to cache \"{}\"", path);
+    }
+
+    NoiseTextureLayers generate_noise_textures(uint32_t dim, uint32_t row_step)
+    {
+        NoiseTextureLayers layers(noise_texture_layer_count, std::vector<unsigned char>(dim * dim * 4, 0));
+        parallel_for((dim + row_step - 1) / row_step, [&](uint32_t i) { generate_row(i * row_step, dim, layers); });
+        return layers;
+    }
+
+    NoiseTextureError compare_noise_textures(const NoiseTextureLayers& a, const NoiseTextureLayers& b, uint32_t dim, uint32_t row_step)
+    {
+        VE_ASSERT(a.size() == b.size(), "Noise texture sets differ in layer count!");
+        NoiseTextureError error;
+        uint64_t count = 0;
+        double sum = 0.0;
+        for (uint32_t l = 0; l < a.size(); ++l)
+        {
+            for (uint32_t y = 0; y < dim; y += row_step)
+            {
+                for (uint32_t i = y * dim * 4; i < (y + 1) * dim * 4; ++i)
+                {
+                    const float diff = std::abs(float(a[l][i]) - float(b[l][i])) / 255.0f;
+                    error.max = std::max(error.max, diff);
+                    sum += diff;
+                    ++count;
+                }
+            }
+        }
+        error.mean = count > 0 ? sum / count : 0.0f;
+        return error;
+    }
+} // namespace ve
@@ -0,0 +1,104 @@
+#include "RuntimeConfig.hpp"
+
+#include <fstream>
+
+#include "json.hpp"
+#include "ve_log.hpp"
+#include "vk/TunnelObjects.hpp"
+
+namespace ve
+{
+    std::string check_runtime_config(const RuntimeConfig& config)
+    {
+        if (config.segment_count < 4 || (config.segment_count & (config.segment_count - 1)) != 0) return "segment_count must be a power of two and at least 4";
+        if (config.vertices_per_sample == 0 || config.vertices_per_sample % get_lod_step(tunnel_lod_count - 1) != 0) return "vertices_per_sample must be a multiple of " + std::to_string(get_lod_step(tunnel_lod_count - 1));
+        if (config.samples_per_segment <= get_lod_step(tunnel_lod_count - 1) + 1) return "samples_per_segment must be larger than " + std::to_string(get_lod_step(tunnel_lod_count - 1) + 1);
+        if (config.samples_per_segment * config.vertices_per_sample > 65536) return "samples_per_segment * vertices_per_sample must not be larger than 65536 as the tunnel index pattern uses 16 bit indices";
+        if (config.fireflies_per_segment == 0) return "fireflies_per_segment must not be 0";
+        if (config.jet_particle_count == 0) return "jet_particle_count must not be 0";
+        if (config.reservoir_count == 0) return "reservoir_count must not be 0";
+        if (config.compact_tunnel_vertices > 1) return "compact_tunnel_vertices must be 0 or 1";
+        if (config.irradiance_cache_mode > 2) return "irradiance_cache_mode must be 0, 1 or 2";
+        if (config.host_blas_builds > 1) return "host_blas_builds must be 0 or 1";
+        return "";
+    }
+
+    RuntimeConfig load_runtime_config(const std::string& path, const RuntimeConfig& base)
+    {
+        std::ifstream file(path);
+        VE_ASSERT(file.is_open(), "Failed to open config \"{}\"!", path);
+        const nlohmann::json data = nlohmann::json::parse(file);
+        RuntimeConfig config = base;
+        for (const auto& parameter : runtime_config_parameters)
+        {
+            if (data.contains(parameter.name)) config.*parameter.value = data.at(parameter.name).get<uint32_t>();
+        }
+        return config;
+    }
+
+    void apply_runtime_config(const RuntimeConfig& config)
+    {
+        const std::string error = check_runtime_config(config);
+        VE_ASSERT(error.empty(), "Invalid config: {}", error);
+        segment_count = config.segment_count;
+        samples_per_segment = config.samples_per_segment;
+        vertices_per_sample = config.vertices_per_sample;
+        fireflies_per_segment = config.fireflies_per_segment;
+        jet_particle_count = config.jet_particle_count;
+        reservoir_count = config.reservoir_count;
+        compact_tunnel_vertices = config.compact_tunnel_vertices;
+        irradiance_cache_mode = config.irradiance_cache_mode;
+        host_blas_builds = config.host_blas_builds;
+        vertex_count = segment_count * samples_per_segment * vertices_per_sample;
+        vertices_per_segment = samples_per_segment * vertices_per_sample;
+        indices_per_segment = (samples_per_segment - 1) * vertices_per_sample * 6;
+        index_count = indices_per_segment * segment_count;
+        firefly_count = fireflies_per_segment * segment_count;
+        spdlog::info("Using config {}", to_string(config));
+    }
+
+    std::string to_string(const RuntimeConfig& config)
+    {
+        std::string s;
+        for (const auto& parameter : runtime_config_parameters)
+        {
+            if (!s.empty()) s += ", ";
+            s += std::string(parameter.name) + "=" + std::to_string(config.*parameter.value);
+        }
+        return s;
+    }
+
+    RuntimeConfigSweep load_runtime_config_sweep(const std::string& path, const RuntimeConfig& base)
+    {
+        std::ifstream file(path);
+        VE_ASSERT(file.is_open(), "Failed to open sweep \"{}\"!", path);
+        const nlohmann::json data = nlohmann::json::parse(file);
+        RuntimeConfigSweep sweep;
+        sweep.warmup_frames = data.value("warmup_frames", sweep.warmup_frames);
+        sweep.frames = data.value("frames", sweep.frames);
+        sweep.output = data.value("output", sweep.output);
+        sweep.configs.push_back(base);
+        if (!data.contains("parameters")) return sweep;
+        // expand the grid one parameter at a time
+        for (const auto& parameter : runtime_config_parameters)
+        {
+            if (!data.at("parameters").contains(parameter.name)) continue;
+            std::vector<RuntimeConfig> configs;
+            for (const RuntimeConfig& config : sweep.configs)
+            {
+                for (const auto& value : data.at("parameters").at(parameter.name))
+                {
+                    configs.push_back(config);
+                    configs.back().*parameter.value = value.get<uint32_t>();
+                }
+            }
+            sweep.configs = configs;
+        }
+        std::erase_if(sweep.configs, [](const RuntimeConfig& config) {
+            const std::string error = check_runtime_config(config);
+            if (!error.empty()) spdlog::warn("Skipping {}: {}", to_string(config), error);
+            return !error.empty();
+        });
+        return sweep;
+    }
+} // namespace ve
@@ -0,0 +1,441 @@
+#include "TunnelGenerator.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/trigonometric.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include "Parallel.hpp"
+#include "Simd.hpp"
+
+namespace ve
+{
+    namespace
+    {
+        // permutation polynomial: (34x^2 + x) mod 289
+        template<typename T>
+        T permute(const T& x)
+        {
+            const T y = (34.0f * x + 1.0f) * x;
+            return y - 289.0f * lane_floor(y * (1.0f / 289.0f));
+        }
+
+        template<typename T>
+        T mod7(const T& x)
+        {
+            return x - 7.0f * lane_floor(x * (1.0f / 7.0f));
+        }
+
+        // squared distances to the three feature points of one column of the 3x3 search window in cellular
+        template<typename T>
+        void cellular_column(const T& px, const T& pi_y, const T& pf_x, const T& pf_y, float dx_offset, T d[3])
+        {
+            constexpr float K = 0.142857142857f; // 1/7
+            constexpr float Ko = 0.428571428571f; // 3/7
+            constexpr float of[3] = {-0.5f, 0.5f, 1.5f};
+            for (int k = 0; k < 3; ++k)
+            {
+                const T p = permute(px + pi_y + float(k - 1));
+                const T ox = lane_fract(p * K) - Ko;
+                const T oy = mod7(lane_floor(p * K)) * K - Ko;
+                const T dx = pf_x + dx_offset + ox;
+                const T dy = pf_y - of[k] + oy;
+                d[k] = dx * dx + dy * dy;
+            }
+        }
+
+        // F2 - F1 cellular noise, mirrors cellular in tunnel.comp
+        template<typename T>
+        T cellular(const T& x, const T& y)
+        {
+            const T fx = lane_floor(x);
+            const T fy = lane_floor(y);
+            const T pi_x = fx - 289.0f * lane_floor(fx * (1.0f / 289.0f));
+            const T pi_y = fy - 289.0f * lane_floor(fy * (1.0f / 289.0f));
+            const T pf_x = x - fx;
+            const T pf_y = y - fy;
+            T d1[3], d2[3], d3[3];
+            cellular_column(permute(pi_x - 1.0f), pi_y, pf_x, pf_y, 0.5f, d1);
+            cellular_column(permute(pi_x), pi_y, pf_x, pf_y, -0.5f, d2);
+            cellular_column(permute(pi_x + 1.0f), pi_y, pf_x, pf_y, -1.5f, d3);
+            // sort out the two smallest distances (F1, F2)
+            T d1a[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                d1a[k] = lane_min(d1[k], d2[k]);
+                d2[k] = lane_min(lane_max(d1[k], d2[k]), d3[k]);
+                d1[k] = lane_min(d1a[k], d2[k]);
+                d2[k] = lane_max(d1a[k], d2[k]);
+            }
+            T x0 = lane_min(d1[0], d1[1]);
+            T y0 = lane_max(d1[0], d1[1]);
+            const T z0 = lane_max(x0, d1[2]);
+            x0 = lane_min(x0, d1[2]);
+            T f2 = lane_min(lane_min(lane_min(y0, d2[1]), lane_min(z0, d2[2])), d2[0]);
+            return 0.1f + (lane_sqrt(f2) - lane_sqrt(x0));
+        }
+
+        // same as sign() in glsl
+        float sign(float v)
+        {
+            return v > 0.0f ? 1.0f : (v < 0.0f ? -1.0f : 0.0f);
+        }
+
+        glm::vec3 reconstruct_normal(const TunnelVertex& v)
+        {
+            return glm::vec3(v.normal.x, v.normal.y, sign(std::bit_cast<float>(v.segment_uid)) * std::sqrt(std::max(0.0f, 1.0f - v.normal.x * v.normal.x - v.normal.y * v.normal.y)));
+        }
+    } // namespace
+
+    TunnelPath::TunnelPath(float segment_scale, uint32_t seed) : segment_scale(segment_scale), rnd(seed), dis(0.0f, 1.0f)
+    {}
+
+    TunnelSegmentPoints TunnelPath::first_segment() const
+    {
+        return TunnelSegmentPoints{glm::vec3(0.0f, 0.0f, -50.0f), glm::vec3(0.0f, 0.0f, -50.0f - segment_scale / 2.0f), glm::vec3(0.0f, 0.0f, -50.0f - segment_scale), 0};
+    }
+
+    TunnelSegmentPoints TunnelPath::next_segment(const TunnelSegmentPoints& segment)
+    {
+        TunnelSegmentPoints next;
+        next.segment_uid = segment.segment_uid + 1;
+        next.p1 = segment.p2 + segment.p2 - segment.p1;
+        next.p0 = segment.p2;
+        next.p2 = pop_bezier_point_queue(next.p0, next.p1);
+        return next;
+    }
+
+    glm::vec3 TunnelPath::random_cosine(const glm::vec3& normal, const float cosine_weight)
+    {
+        float theta = std::acos(std::pow(1.0f - std::abs(dis(rnd)), 1.0f / (1.0f + cosine_weight)));
+        float phi = 2.0f * M_PIf * dis(rnd);
+        glm::vec3 up = std::abs(normal.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+        glm::vec3 tangent = glm::normalize(glm::cross(up, normal));
+        glm::vec3 bitangent = glm::cross(normal, tangent);
+
+        glm::vec3 sample = glm::vec3(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
+        return glm::normalize(tangent * sample.x + bitangent * sample.y + normal * sample.z);
+    }
+
+    glm::vec3 TunnelPath::pop_bezier_point_queue(const glm::vec3& p0, const glm::vec3& p1)
+    {
+        // no more Bézier points left, create either a long curve or a small segment
+        if (bezier_points_queue.empty())
+        {
+            // high probability for small segment leads to areas with small curvy segments and single long curves
+            const uint32_t random_weight = dis(rnd) < 0.98f ? 1 : 16;
+            glm::vec3 p2 = p0 + segment_scale * random_weight * random_cosine(glm::normalize(p1 - p0), -2.0f * random_weight + 42.0);
+            glm::vec3 curve_p1 = p0 + (p1 - p0) * float(random_weight);
+            for (uint32_t i = 0; i < random_weight; ++i)
+            {
+                const float t = float(i + 1) / float(random_weight);
+                bezier_points_queue.push(std::pow(1 - t, 2.0f) * p0 + (2 - 2 * t) * t * curve_p1 + std::pow(t, 2.0f) * p2);
+            }
+        }
+        glm::vec3 p = bezier_points_queue.front();
+        bezier_points_queue.pop();
+        return p;
+    }
+
+    TunnelGenerator::TunnelGenerator(uint32_t samples_per_segment, uint32_t vertices_per_sample) : samples_per_segment(samples_per_segment), vertices_per_sample(vertices_per_sample), ring_cos(vertices_per_sample), ring_sin(vertices_per_sample)
+    {
+        for (uint32_t i = 0; i < vertices_per_sample; ++i)
+        {
+            const float angle = glm::radians((360.0f / float(vertices_per_sample)) * float(i));
+            ring_cos[i] = std::cos(angle);
+            ring_sin[i] = std::sin(angle);
+        }
+    }
+
+    uint32_t TunnelGenerator::get_vertices_per_segment() const
+    {
+        return samples_per_segment * vertices_per_sample;
+    }
+
+    TunnelRingFrame get_tunnel_ring_frame(const TunnelSegmentPoints& segment, float t)
+    {
+        const glm::vec3& p0 = segment.p0;
+        const glm::vec3& p1 = segment.p1;
+        const glm::vec3& p2 = segment.p2;
+        // interpolate over bézier points to get position and normal of sample
+        TunnelRingFrame frame;
+        frame.center = (1.0f - t) * (1.0f - t) * p0 + (2.0f - 2.0f * t) * t * p1 + t * t * p2;
+        frame.plane_normal = glm::normalize((2.0f - 2.0f * t) * (p1 - p0) + 2.0f * t * (p2 - p1));
+        const glm::vec3 first_dir = glm::normalize(p1 - p0);
+        const glm::vec3 cross_vector = std::abs(glm::dot(first_dir, glm::vec3(1.0f, 0.0f, 0.0f))) >= 0.999999f ? glm::cross(first_dir, glm::normalize(glm::vec3(0.99f, 0.0f, 0.01f))) : glm::cross(first_dir, glm::vec3(1.0f, 0.0f, 0.0f));
+        frame.plane_vector = glm::cross(frame.plane_normal, cross_vector);
+        frame.kv = glm::cross(frame.plane_normal, frame.plane_vector);
+        frame.kkv = frame.plane_normal * glm::dot(frame.plane_normal, frame.plane_vector);
+        return frame;
+    }
+
+    float get_tunnel_arc_length(const TunnelSegmentPoints& segment, float t)
+    {
+        // same as get_tunnel_arc_length in common.glsl; the speed 2 * |a + x * b| is the square root of a quadratic, which 5 point gauss-legendre quadrature integrates almost exactly
+        constexpr std::array<float, 5> nodes = {-0.9061798459f, -0.5384693101f, 0.0f, 0.5384693101f, 0.9061798459f};
+        constexpr std::array<float, 5> weights = {0.2369268851f, 0.4786286705f, 0.5688888889f, 0.4786286705f, 0.2369268851f};
+        const glm::vec3 a = segment.p1 - segment.p0;
+        const glm::vec3 b = segment.p0 - 2.0f * segment.p1 + segment.p2;
+        float arc_length = 0.0f;
+        for (uint32_t i = 0; i < nodes.size(); ++i) arc_length += weights[i] * glm::length(a + (t * 0.5f * (nodes[i] + 1.0f)) * b);
+        return arc_length * t;
+    }
+
+    float get_tunnel_ring_parameter(const TunnelSegmentPoints& segment, float arc_fraction)
+    {
+        // newton iterations on the arc length starting at the uniform parameter; the ends of the segment stay exactly at 0 and 1
+        const glm::vec3 a = segment.p1 - segment.p0;
+        const glm::vec3 b = segment.p0 - 2.0f * segment.p1 + segment.p2;
+        const float target = arc_fraction * get_tunnel_arc_length(segment, 1.0f);
+        float t = arc_fraction;
+        for (uint32_t i = 0; i < 3; ++i) t = std::clamp(t - (get_tunnel_arc_length(segment, t) - target) / (2.0f * glm::length(a + t * b)), 0.0f, 1.0f);
+        return t;
+    }
+
+    float get_tunnel_wall_radius(uint32_t segment_uid, float arc_fraction, float angle_fraction)
+    {
+        const float tex_s = std::abs(float(segment_uid % 2) - arc_fraction);
+        const float tex_t = std::abs(angle_fraction * 2.0f - 1.0f);
+        const float height = cellular(tex_s * 2.0f + float(segment_uid), tex_t * 3.0f) * (-std::pow(arc_fraction * 2.0f - 1.0f, 2.0f) + 1.0f);
+        return 20.0f - height * 12.0f;
+    }
+
+    float get_tunnel_wall_occlusion(uint32_t segment_uid, float arc_fraction, float angle_fraction, float radius, float segment_length)
+    {
+        // same constants as in tunnel_query.glsl
+        constexpr uint32_t directions = 8;
+        constexpr uint32_t steps = 2;
+        constexpr float ao_radius = 4.0f;
+        float occlusion = 0.0f;
+        for (uint32_t i = 0; i < directions; ++i)
+        {
+            const float direction_angle = 2.0f * M_PIf * (float(i) + 0.5f) / float(directions);
+            const glm::vec2 direction(std::cos(direction_angle), std::sin(direction_angle));
+            float max_horizon = 0.0f;
+            for (uint32_t j = 1; j <= steps; ++j)
+            {
+                const float step_distance = ao_radius * float(j) / float(steps);
+                const float neighbor_arc_fraction = std::clamp(arc_fraction + direction.x * step_distance / segment_length, 0.0f, 1.0f);
+                const float neighbor_angle_fraction = glm::fract(angle_fraction + direction.y * step_distance / (2.0f * M_PIf * radius));
+                const float height = radius - get_tunnel_wall_radius(segment_uid, neighbor_arc_fraction, neighbor_angle_fraction);
+                max_horizon = std::max(max_horizon, height / std::sqrt(height * height + step_distance * step_distance));
+            }
+            occlusion += max_horizon;
+        }
+        return 1.0f - occlusion / float(directions);
+    }
+
+    TunnelRingFrame TunnelGenerator::get_ring_frame(const TunnelSegmentPoints& segment, uint32_t sample_circle_id) const
+    {
+        return get_tunnel_ring_frame(segment, get_tunnel_ring_parameter(segment, float(sample_circle_id) / float(samples_per_segment - 1)));
+    }
+
+    glm::vec3 TunnelGenerator::get_ring_direction(const TunnelRingFrame& frame, uint32_t vertex_id) const
+    {
+        const float c = ring_cos[vertex_id];
+        const float s = ring_sin[vertex_id];
+        return glm::normalize(frame.plane_vector * c + frame.kv * s + frame.kkv * (1.0f - c));
+    }
+
+    void TunnelGenerator::generate_ring(const TunnelSegmentPoints& segment, uint32_t sample_circle_id, TunnelVertex* out) const
+    {
+        constexpr uint32_t lanes = lane_count<FloatLanes>();
+        const TunnelRingFrame frame = get_ring_frame(segment, sample_circle_id);
+        const glm::vec3& sample_pos = frame.center;
+        const glm::vec3& plane_vector = frame.plane_vector;
+        const glm::vec3& kv = frame.kv;
+        const glm::vec3& kkv = frame.kkv;
+        // texture coordinates and wall noise follow the arc length like the rings
+        const float arc_fraction = float(sample_circle_id) / float(samples_per_segment - 1);
+
+        const float tex_s = std::abs(float(segment.segment_uid % 2) - arc_fraction);
+        const FloatLanes scaled_tex_s(tex_s * 2.0f + float(segment.segment_uid));
+        const float height_weight = -std::pow(arc_fraction * 2.0f - 1.0f, 2.0f) + 1.0f;
+        const uint32_t segment_uid_bits = std::bit_cast<uint32_t>(float(segment.segment_uid));
+        const float segment_length = get_tunnel_arc_length(segment, 1.0f);
+
+        for (uint32_t v = 0; v < vertices_per_sample; v += lanes)
+        {
+            const uint32_t count = std::min(lanes, vertices_per_sample - v);
+            const FloatLanes c = lane_load<FloatLanes>(ring_cos.data() + v, count);
+            const FloatLanes s = lane_load<FloatLanes>(ring_sin.data() + v, count);
+            FloatLanes dx = plane_vector.x * c + kv.x * s + kkv.x * (1.0f - c);
+            FloatLanes dy = plane_vector.y * c + kv.y * s + kkv.y * (1.0f - c);
+            FloatLanes dz = plane_vector.z * c + kv.z * s + kkv.z * (1.0f - c);
+            const FloatLanes tex_t = lane_abs((lane_iota<FloatLanes>(float(v)) / float(vertices_per_sample)) * 2.0f - 1.0f);
+            const FloatLanes height = cellular(scaled_tex_s, tex_t * 3.0f) * height_weight;
+            const FloatLanes radius = 20.0f - height * 12.0f;
+            const FloatLanes scale = radius / lane_sqrt(dx * dx + dy * dy + dz * dz);
+            dx = dx * scale + sample_pos.x;
+            dy = dy * scale + sample_pos.y;
+            dz = dz * scale + sample_pos.z;
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                TunnelVertex& vertex = out[sample_circle_id * vertices_per_sample + v + i];
+                vertex.pos = glm::vec3(lane_get(dx, i), lane_get(dy, i), lane_get(dz, i));
+                vertex.normal = glm::vec2(0.0f);
+                vertex.tex = glm::packUnorm2x16(glm::vec2(tex_s, lane_get(tex_t, i)));
+                vertex.ao = get_tunnel_wall_occlusion(segment.segment_uid, arc_fraction, float(v + i) / float(vertices_per_sample), lane_get(radius, i), segment_length);
+                // the shaders store the segment uid as float whose sign is the sign of the normal's z component
+                vertex.segment_uid = segment_uid_bits;
+            }
+        }
+    }
+
+    void TunnelGenerator::compute_ring_normals(uint32_t sample_circle_id, TunnelVertex* out) const
+    {
+        for (uint32_t vertex_id = 0; vertex_id < vertices_per_sample; ++vertex_id)
+        {
+            const uint32_t idx = sample_circle_id * vertices_per_sample + vertex_id;
+            const glm::vec3 p0 = out[idx].pos;
+            glm::vec3 p1, p2;
+            // same choice of neighbors as in tunnel.comp
+            if (sample_circle_id == samples_per_segment - 1 && vertex_id == vertices_per_sample - 1)
+            {
+                p1 = out[idx - vertices_per_sample].pos;
+                p2 = out[idx - 1].pos;
+            }
+            else if (sample_circle_id == samples_per_segment - 1)
+            {
+                p2 = out[idx - vertices_per_sample].pos;
+                p1 = out[idx + 1].pos;
+            }
+            else if (vertex_id == vertices_per_sample - 1)
+            {
+                p2 = out[idx + vertices_per_sample].pos;
+                p1 = out[idx - 1].pos;
+            }
+            else
+            {
+                p1 = out[idx + vertices_per_sample].pos;
+                p2 = out[idx + 1].pos;
+            }
+            const glm::vec3 normal = glm::cross(glm::normalize(p1 - p0), glm::normalize(p2 - p0));
+            out[idx].normal = glm::vec2(normal.x, normal.y);
+            // same as set_tunnel_vertex_normal in common.glsl
+            float segment_uid = std::bit_cast<float>(out[idx].segment_uid);
+            if (sign(normal.z) != sign(segment_uid)) segment_uid *= -1.0f;
+            out[idx].segment_uid = std::bit_cast<uint32_t>(segment_uid);
+        }
+    }
+
+    void TunnelGenerator::generate_segment(const TunnelSegmentPoints& segment, TunnelVertex* out) const
+    {
+        for (uint32_t i = 0; i < samples_per_segment; ++i) generate_ring(segment, i, out);
+        for (uint32_t i = 0; i < samples_per_segment; ++i) compute_ring_normals(i, out);
+    }
+
+    void TunnelGenerator::generate_segments(const std::vector<TunnelSegmentPoints>& segments, std::vector<TunnelVertex>& out, uint32_t thread_count) const
+    {
+        const uint32_t vertices_per_segment = get_vertices_per_segment();
+        out.resize(segments.size() * vertices_per_segment);
+        // normals need the positions of the neighboring rings, so all positions are generated first
+        const uint32_t ring_count = segments.size() * samples_per_segment;
+        parallel_for(ring_count, [&](uint32_t i) {
+            generate_ring(segments[i / samples_per_segment], i % samples_per_segment, out.data() + (i / samples_per_segment) * vertices_per_segment);
+        }, thread_count);
+        parallel_for(ring_count, [&](uint32_t i) {
+            compute_ring_normals(i % samples_per_segment, out.data() + (i / samples_per_segment) * vertices_per_segment);
+        }, thread_count);
+    }
+
+    void TunnelGenerator::append_segment_indices(std::vector<uint32_t>& indices, uint32_t first_vertex) const
+    {
+        auto vertex = [&](uint32_t ring, uint32_t idx) { return first_vertex + ring * vertices_per_sample + idx % vertices_per_sample; };
+        for (uint32_t ring = 0; ring + 1 < samples_per_segment; ++ring)
+        {
+            for (uint32_t j = 0; j < vertices_per_sample; ++j)
+            {
+                indices.push_back(vertex(ring, j));
+                indices.push_back(vertex(ring, j + 1));
+                indices.push_back(vertex(ring + 1, j));
+                indices.push_back(vertex(ring, j + 1));
+                indices.push_back(vertex(ring + 1, j + 1));
+                indices.push_back(vertex(ring + 1, j));
+            }
+        }
+    }
+
+    void TunnelGenerator::compact_segment(const TunnelSegmentPoints& segment, const TunnelVertex* in, CompactTunnelVertex* out) const
+    {
+        for (uint32_t i = 0; i < samples_per_segment; ++i)
+        {
+            const glm::vec3 center = get_ring_frame(segment, i).center;
+            for (uint32_t j = 0; j < vertices_per_sample; ++j)
+            {
+                const TunnelVertex& v = in[i * vertices_per_sample + j];
+                out[i * vertices_per_sample + j] = CompactTunnelVertex{glm::distance(v.pos, center), pack_compact_tunnel_normal_ao(reconstruct_normal(v), v.ao)};
+            }
+        }
+    }
+
+    void TunnelGenerator::expand_segment(const TunnelSegmentPoints& segment, const CompactTunnelVertex* in, TunnelVertex* out) const
+    {
+        for (uint32_t i = 0; i < samples_per_segment; ++i)
+        {
+            const TunnelRingFrame frame = get_ring_frame(segment, i);
+            const float tex_s = std::abs(float(segment.segment_uid % 2) - float(i) / float(samples_per_segment - 1));
+            for (uint32_t j = 0; j < vertices_per_sample; ++j)
+            {
+                const CompactTunnelVertex& v = in[i * vertices_per_sample + j];
+                TunnelVertex& vertex = out[i * vertices_per_sample + j];
+                const glm::vec3 normal = unpack_octahedral_normal(v.normal_ao);
+                vertex.pos = frame.center + get_ring_direction(frame, j) * v.radius;
+                vertex.normal = glm::vec2(normal.x, normal.y);
+                vertex.tex = glm::packUnorm2x16(glm::vec2(tex_s, std::abs((float(j) / float(vertices_per_sample)) * 2.0f - 1.0f)));
+                vertex.ao = unpack_compact_tunnel_ao(v.normal_ao);
+                vertex.segment_uid = std::bit_cast<uint32_t>(normal.z < 0.0f ? -float(segment.segment_uid) : float(segment.segment_uid));
+            }
+        }
+    }
+
+    uint32_t pack_octahedral_normal(glm::vec3 n)
+    {
+        n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        glm::vec2 e(n.x, n.y);
+        if (n.z < 0.0f) e = (1.0f - glm::abs(glm::vec2(n.y, n.x))) * glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        // two 12 bit values, the upper 8 bits stay free for the ambient occlusion
+        auto encode = [](float v) { return uint32_t(std::round(std::clamp(v, -1.0f, 1.0f) * 2047.0f) + 2047.0f); };
+        return encode(e.x) | (encode(e.y) << 12);
+    }
+
+    glm::vec3 unpack_octahedral_normal(uint32_t packed_normal)
+    {
+        auto decode = [](uint32_t v) { return float(v & 0xFFF) / 2047.0f - 1.0f; };
+        glm::vec3 n(decode(packed_normal), decode(packed_normal >> 12), 0.0f);
+        n.z = 1.0f - std::abs(n.x) - std::abs(n.y);
+        const float t = std::max(-n.z, 0.0f);
+        n.x += n.x >= 0.0f ? -t : t;
+        n.y += n.y >= 0.0f ? -t : t;
+        return glm::normalize(n);
+    }
+
+    uint32_t pack_compact_tunnel_normal_ao(const glm::vec3& normal, float ao)
+    {
+        return pack_octahedral_normal(normal) | (uint32_t(std::round(std::clamp(ao, 0.0f, 1.0f) * 255.0f)) << 24);
+    }
+
+    float unpack_compact_tunnel_ao(uint32_t normal_ao)
+    {
+        return float(normal_ao >> 24) / 255.0f;
+    }
+
+    TunnelSegmentError compare_tunnel_vertices(const TunnelVertex* a, const TunnelVertex* b, uint32_t count, float position_tolerance, float normal_tolerance)
+    {
+        TunnelSegmentError error;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            const float position_error = glm::distance(a[i].pos, b[i].pos);
+            const float normal_error = glm::distance(reconstruct_normal(a[i]), reconstruct_normal(b[i]));
+            error.max_position = std::max(error.max_position, position_error);
+            error.max_normal = std::max(error.max_normal, normal_error);
+            error.max_ao = std::max(error.max_ao, std::abs(a[i].ao - b[i].ao));
+            if (position_error > position_tolerance || normal_error > normal_tolerance) error.vertices_out_of_tolerance++;
+        }
+        return error;
+    }
+} // namespace ve
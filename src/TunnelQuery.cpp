@@ -0,0 +1,139 @@
+#include "TunnelQuery.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <glm/geometric.hpp>
+
+namespace ve
+{
+    namespace
+    {
+        // real roots of a * t^3 + b * t^2 + c * t + d; degenerates to the quadratic and linear case if the leading coefficients are negligible
+        uint32_t solve_cubic(float a, float b, float c, float d, std::array<float, 3>& roots)
+        {
+            constexpr float eps = 1e-6f;
+            const float scale = std::max({std::abs(b), std::abs(c), std::abs(d)});
+            if (std::abs(a) <= eps * scale)
+            {
+                if (std::abs(b) <= eps * scale)
+                {
+                    if (c == 0.0f) return 0;
+                    roots[0] = -d / c;
+                    return 1;
+                }
+                const float discriminant = c * c - 4.0f * b * d;
+                if (discriminant < 0.0f) return 0;
+                const float sqrt_discriminant = std::sqrt(discriminant);
+                roots[0] = (-c + sqrt_discriminant) / (2.0f * b);
+                roots[1] = (-c - sqrt_discriminant) / (2.0f * b);
+                return 2;
+            }
+            // depressed cubic x^3 + p * x + q with t = x - b / 3
+            b /= a;
+            c /= a;
+            d /= a;
+            const float offset = b / 3.0f;
+            const float p = c - b * offset;
+            const float q = 2.0f * offset * offset * offset - offset * c + d;
+            const float discriminant = q * q / 4.0f + p * p * p / 27.0f;
+            if (discriminant >= 0.0f)
+            {
+                // one real root (Cardano)
+                const float sqrt_discriminant = std::sqrt(discriminant);
+                roots[0] = std::cbrt(-q / 2.0f + sqrt_discriminant) + std::cbrt(-q / 2.0f - sqrt_discriminant) - offset;
+                return 1;
+            }
+            // three real roots (trigonometric solution), p < 0 here
+            const float r = std::sqrt(-p / 3.0f);
+            const float phi = std::acos(std::clamp(-q / (2.0f * r * r * r), -1.0f, 1.0f));
+            for (uint32_t k = 0; k < 3; ++k) roots[k] = 2.0f * r * std::cos((phi - 2.0f * M_PIf * float(k)) / 3.0f) - offset;
+            return 3;
+        }
+
+        float distance2(const glm::vec3& a, const glm::vec3& b)
+        {
+            const glm::vec3 d = a - b;
+            return glm::dot(d, d);
+        }
+    } // namespace
+
+    float get_closest_bezier_parameter(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& pos)
+    {
+        // curve is p0 + 2 * t * a + t^2 * b; the derivative of the squared distance to pos is a cubic in t
+        const glm::vec3 a = p1 - p0;
+        const glm::vec3 b = p0 - 2.0f * p1 + p2;
+        const glm::vec3 m = p0 - pos;
+        std::array<float, 3> roots;
+        const uint32_t root_count = solve_cubic(glm::dot(b, b), 3.0f * glm::dot(a, b), 2.0f * glm::dot(a, a) + glm::dot(m, b), glm::dot(m, a), roots);
+        auto curve = [&](float t) { return p0 + 2.0f * t * a + t * t * b; };
+        // the minimum is either at a root inside the segment or at one of its ends
+        float best_t = 0.0f;
+        float best_distance = distance2(p0, pos);
+        if (distance2(p2, pos) < best_distance)
+        {
+            best_t = 1.0f;
+            best_distance = distance2(p2, pos);
+        }
+        for (uint32_t i = 0; i < root_count; ++i)
+        {
+            float t = std::clamp(roots[i], 0.0f, 1.0f);
+            // the closed form loses precision for nearly straight segments, two newton steps on the derivative fix that
+            for (uint32_t j = 0; j < 2; ++j)
+            {
+                const glm::vec3 tangent = 2.0f * a + 2.0f * t * b;
+                const glm::vec3 offset = curve(t) - pos;
+                const float slope = glm::dot(tangent, tangent) + 2.0f * glm::dot(offset, b);
+                if (slope > 0.0f) t = std::clamp(t - glm::dot(offset, tangent) / slope, 0.0f, 1.0f);
+            }
+            const float distance = distance2(curve(t), pos);
+            if (distance < best_distance)
+            {
+                best_t = t;
+                best_distance = distance;
+            }
+        }
+        return best_t;
+    }
+
+    TunnelQueryResult query_tunnel_segment(const TunnelSegmentPoints& segment, const glm::vec3& pos)
+    {
+        TunnelQueryResult result;
+        result.segment_uid = segment.segment_uid;
+        result.t = get_closest_bezier_parameter(segment.p0, segment.p1, segment.p2, pos);
+        result.arc_fraction = get_tunnel_arc_length(segment, result.t) / get_tunnel_arc_length(segment, 1.0f);
+        const TunnelRingFrame frame = get_tunnel_ring_frame(segment, result.t);
+        result.center = frame.center;
+        result.center_distance = glm::distance(pos, frame.center);
+        // pos lies in the ring plane unless the closest point is an end of the segment, so project it to get the radial part
+        glm::vec3 radial = pos - frame.center;
+        radial -= frame.plane_normal * glm::dot(radial, frame.plane_normal);
+        // plane_vector is perpendicular to plane_normal, so rotating it by the angle gives cos * plane_vector + sin * kv
+        const float angle = std::atan2(glm::dot(radial, glm::normalize(frame.kv)), glm::dot(radial, glm::normalize(frame.plane_vector)));
+        result.angle_fraction = angle / (2.0f * M_PIf);
+        if (result.angle_fraction < 0.0f) result.angle_fraction += 1.0f;
+        result.wall_radius = get_tunnel_wall_radius(segment.segment_uid, result.arc_fraction, result.angle_fraction);
+        result.wall_distance = result.wall_radius - glm::length(radial);
+        return result;
+    }
+
+    TunnelQueryResult query_tunnel(const std::vector<TunnelSegmentPoints>& segments, const glm::vec3& pos)
+    {
+        uint32_t closest_segment = 0;
+        float closest_distance = std::numeric_limits<float>::max();
+        for (uint32_t i = 0; i < segments.size(); ++i)
+        {
+            const TunnelSegmentPoints& s = segments[i];
+            const float t = get_closest_bezier_parameter(s.p0, s.p1, s.p2, pos);
+            const float distance = distance2((1.0f - t) * (1.0f - t) * s.p0 + (2.0f - 2.0f * t) * t * s.p1 + t * t * s.p2, pos);
+            if (distance < closest_distance)
+            {
+                closest_segment = i;
+                closest_distance = distance;
+            }
+        }
+        // only the closest segment needs the more expensive wall radius
+        return query_tunnel_segment(segments[closest_segment], pos);
+    }
+} // namespace ve
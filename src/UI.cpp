@@ -1,4 +1,7 @@
 #include "UI.hpp"
+
+#include <algorithm>
+
 #include "imgui.h"
 #include "backends/imgui_impl_vulkan.h"
 #include "backends/imgui_impl_sdl.h"
@@ -6,18 +9,24 @@
 #include "implot_internal.h"
 
 #include "ve_log.hpp"
+#include "vk/PathTracer.hpp"
 #include "vk/Timer.hpp"
+#include "vk/TunnelObjects.hpp"
 
 namespace ve
 {
     constexpr uint32_t plot_value_count = 1024;
     constexpr float update_weight = 0.1f;
 
-    UI::UI(const VulkanMainContext& vmc, const RenderPass& render_pass, uint32_t frames) : vmc(vmc), frametime_values(plot_value_count, 0.0f), devicetimings(DeviceTimer::TIMER_COUNT, 0.0f)
+    UI::UI(const VulkanMainContext& vmc, const RenderPass& render_pass, uint32_t frames) : vmc(vmc), frametime_values(plot_value_count, 0.0f), prefetch_frametime_values{FixVector<float>(plot_value_count, 0.0f), FixVector<float>(plot_value_count, 0.0f)}, devicetimings(DeviceTimer::TIMER_COUNT, 0.0f)
     {
         for (uint32_t i = 0; i < DeviceTimer::TIMER_COUNT; ++i) devicetiming_values.push_back(FixVector<float>(plot_value_count, 0.0f));
         // use less values for plotting as the tunnel advancement happens not so often, there should still be a plot visible though
         devicetiming_values[DeviceTimer::COMPUTE_TUNNEL_ADVANCE] = FixVector<float>(128, 0.0f);
+        devicetiming_values[DeviceTimer::COMPUTE_BLAS_BUILD] = FixVector<float>(128, 0.0f);
+        devicetiming_values[DeviceTimer::COMPUTE_BLAS_REFIT] = FixVector<float>(128, 0.0f);
+        devicetiming_values[DeviceTimer::COMPUTE_TLAS_BUILD] = FixVector<float>(128, 0.0f);
+        devicetiming_values[DeviceTimer::COMPUTE_TUNNEL_SEGMENT] = FixVector<float>(128, 0.0f);
 
         std::vector<vk::DescriptorPoolSize> pool_sizes =
         {
@@ -117,10 +126,30 @@ namespace ve
         ImGui::Checkbox("SegmentUIDView", &(gs.segment_uid_view));
         ImGui::Separator();
         ImGui::Checkbox("CollisionDetection", &(gs.collision_detection_active));
+        ImGui::SameLine();
+        ImGui::Text(("Distance to tunnel wall: " + ve::to_string(gs.player_wall_distance, 4)).c_str());
+        ImGui::Checkbox("AdaptiveTessellation", &(gs.adaptive_tessellation));
+        ImGui::SameLine();
+        ImGui::Checkbox("TunnelPrefetch", &(gs.tunnel_prefetch));
+        ImGui::SameLine();
+        ImGui::Checkbox("FrustumCulling", &(gs.tunnel_frustum_culling));
+        ImGui::SameLine();
+        ImGui::Checkbox("SegmentBLAS", &(gs.tunnel_blas_ring));
+        ImGui::SameLine();
+        ImGui::Checkbox("SegmentBLASRefit", &(gs.tunnel_blas_refit));
+        gs.validate_tunnel = ImGui::Button("Validate tunnel on CPU");
+        constexpr std::array<const char*, 3> collision_mode_names = {"AllTriangles", "BroadPhase", "RayQueries"};
+        ImGui::Combo("CollisionMode", &gs.collision_mode, collision_mode_names.data(), collision_mode_names.size());
+        constexpr std::array<const char*, 3> irradiance_cache_mode_names = {"Off", "Far", "All"};
+        ImGui::Combo("IrradianceCache", &gs.irradiance_cache_mode, irradiance_cache_mode_names.data(), irradiance_cache_mode_names.size());
+        ImGui::SliderFloat("IrradianceCacheDistance", &gs.irradiance_cache_distance, 0.0f, 200.0f);
+        ImGui::Checkbox("IrradianceCacheErrorView", &(gs.irradiance_cache_error_view));
         ImGui::Separator();
         time_diff = time_diff * (1 - update_weight) + gs.time_diff * update_weight;
         frametime = frametime * (1 - update_weight) + gs.frametime * update_weight;
         frametime_values.push_back(gs.frametime);
+        prefetch_frametime_values[gs.tunnel_prefetch].push_back(gs.frametime);
+        prefetch_frametime_counts[gs.tunnel_prefetch] = std::min(prefetch_frametime_counts[gs.tunnel_prefetch] + 1, prefetch_frametime_values[gs.tunnel_prefetch].size());
         for (uint32_t i = 0; i < DeviceTimer::TIMER_COUNT; ++i)
         {
             if (!std::signbit(gs.devicetimings[i])) 
@@ -129,6 +158,24 @@ namespace ve
                 devicetiming_values[i].push_back(gs.devicetimings[i]);
             }
         }
+        tlas_builds_per_frame = tlas_builds_per_frame * (1 - update_weight) + float(gs.tlas_update == uint32_t(TLASUpdate::Build)) * update_weight;
+        tlas_refits_per_frame = tlas_refits_per_frame * (1 - update_weight) + float(gs.tlas_update == uint32_t(TLASUpdate::Refit)) * update_weight;
+        // keep separate averages for both tessellation modes to be able to compare them
+        tessellation_frametimes[gs.adaptive_tessellation] = tessellation_frametimes[gs.adaptive_tessellation] * (1 - update_weight) + gs.frametime * update_weight;
+        if (!std::signbit(gs.devicetimings[DeviceTimer::COMPUTE_BLAS_BUILD]))
+        {
+            tessellation_blas_timings[gs.adaptive_tessellation] = tessellation_blas_timings[gs.adaptive_tessellation] * (1 - update_weight) + gs.devicetimings[DeviceTimer::COMPUTE_BLAS_BUILD] * update_weight;
+            blas_ring_timings[gs.tunnel_blas_ring] = blas_ring_timings[gs.tunnel_blas_ring] * (1 - update_weight) + gs.devicetimings[DeviceTimer::COMPUTE_BLAS_BUILD] * update_weight;
+        }
+        irradiance_cache_frametimes[gs.irradiance_cache_mode] = irradiance_cache_frametimes[gs.irradiance_cache_mode] * (1 - update_weight) + gs.frametime * update_weight;
+        if (!std::signbit(gs.devicetimings[DeviceTimer::RENDERING_LIGHTING]))
+        {
+            irradiance_cache_lighting_timings[gs.irradiance_cache_mode] = irradiance_cache_lighting_timings[gs.irradiance_cache_mode] * (1 - update_weight) + gs.devicetimings[DeviceTimer::RENDERING_LIGHTING] * update_weight;
+        }
+        if (!std::signbit(gs.devicetimings[DeviceTimer::COMPUTE_PLAYER_TUNNEL_COLLISION]))
+        {
+            collision_timings[gs.collision_mode] = collision_timings[gs.collision_mode] * (1 - update_weight) + gs.devicetimings[DeviceTimer::COMPUTE_PLAYER_TUNNEL_COLLISION] * update_weight;
+        }
         if (ImGui::CollapsingHeader("Timings"))
         {
             ImGui::Text((ve::to_string(time_diff * 1000, 4) + " ms; FPS: " + ve::to_string(1.0 / time_diff) + " (" + ve::to_string(frametime, 4) + " ms; FPS: " + ve::to_string(1000.0 / frametime) + ")").c_str());
@@ -137,8 +184,48 @@ namespace ve
             ImGui::Text(("RENDERING_UI: " + ve::to_string(devicetimings[DeviceTimer::RENDERING_UI], 4) + " ms").c_str());
             ImGui::Text(("RENDERING_TUNNEL: " + ve::to_string(devicetimings[DeviceTimer::RENDERING_TUNNEL], 4) + " ms").c_str());
             ImGui::Text(("COMPUTE_TUNNEL_ADVANCE: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_TUNNEL_ADVANCE], 4) + " ms").c_str());
+            ImGui::Text(("COMPUTE_TUNNEL_SEGMENT: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_TUNNEL_SEGMENT], 4) + " ms").c_str());
             ImGui::Text(("FIREFLY_MOVE_STEP: " + ve::to_string(devicetimings[DeviceTimer::FIREFLY_MOVE_STEP], 4) + " ms").c_str());
             ImGui::Text(("PLAYER_TUNNEL_COLLISION: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_PLAYER_TUNNEL_COLLISION], 4) + " ms").c_str());
+            ImGui::Text(("BLAS_BUILD: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_BLAS_BUILD], 4) + " ms").c_str());
+            ImGui::Text(("BLAS_REFIT: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_BLAS_REFIT], 4) + " ms").c_str());
+            ImGui::Text(("TLAS_BUILD: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_TLAS_BUILD], 4) + " ms (" + ve::to_string(tlas_builds_per_frame, 2) + " builds, " + ve::to_string(tlas_refits_per_frame, 2) + " refits per frame)").c_str());
+            ImGui::Text(("IRRADIANCE_CACHE: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_IRRADIANCE_CACHE], 4) + " ms").c_str());
+            ImGui::Text(("RENDERING_LIGHTING: " + ve::to_string(devicetimings[DeviceTimer::RENDERING_LIGHTING], 4) + " ms").c_str());
+        }
+        if (ImGui::CollapsingHeader("Memory"))
+        {
+            ImGui::Text(("Allocated: " + std::to_string(vmc.get_allocated_bytes() / (1024 * 1024)) + " MB").c_str());
+            ImGui::Text(("Released by acceleration structure compaction: " + std::to_string(gs.blas_compaction_saved_bytes / 1024) + " KB").c_str());
+            ImGui::Text(("Scratch arenas: " + std::to_string(gs.scratch_arena_bytes / 1024) + " KB (separate buffers: " + std::to_string(gs.dedicated_scratch_bytes / 1024) + " KB)").c_str());
+        }
+        if (ImGui::CollapsingHeader("Tessellation"))
+        {
+            ImGui::Text(("Tunnel triangles: " + std::to_string(gs.tunnel_triangle_count) + " (fixed density: " + std::to_string(index_count / 3) + ")").c_str());
+            ImGui::Text(("Culled tunnel triangles: " + std::to_string(gs.tunnel_culled_triangle_count)).c_str());
+            ImGui::Text(("Adaptive: " + ve::to_string(tessellation_frametimes[1], 4) + " ms frame; " + ve::to_string(tessellation_blas_timings[1], 4) + " ms BLAS build").c_str());
+            ImGui::Text(("Fixed: " + ve::to_string(tessellation_frametimes[0], 4) + " ms frame; " + ve::to_string(tessellation_blas_timings[0], 4) + " ms BLAS build").c_str());
+            ImGui::Text(("BLAS per segment: " + ve::to_string(blas_ring_timings[1], 4) + " ms; whole tunnel: " + ve::to_string(blas_ring_timings[0], 4) + " ms").c_str());
+            ImGui::Text(("Segment BLAS rebuild: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_BLAS_BUILD], 4) + " ms; refit: " + ve::to_string(devicetimings[DeviceTimer::COMPUTE_BLAS_REFIT], 4) + " ms").c_str());
+        }
+        if (ImGui::CollapsingHeader("Collision"))
+        {
+            ImGui::Text(("Tested triangles: " + std::to_string(gs.collision_triangle_count)).c_str());
+            for (uint32_t i = 0; i < collision_timings.size(); ++i)
+            {
+                ImGui::Text((std::string(collision_mode_names[i]) + ": " + ve::to_string(collision_timings[i], 4) + " ms").c_str());
+            }
+            if (gs.collision_ray_hit.t >= 0.0f)
+            {
+                ImGui::Text(("Closest ray hit: " + ve::to_string(gs.collision_ray_hit.t, 4) + " (normal " + ve::to_string(gs.collision_ray_hit.normal.x, 2) + ", " + ve::to_string(gs.collision_ray_hit.normal.y, 2) + ", " + ve::to_string(gs.collision_ray_hit.normal.z, 2) + ")").c_str());
+            }
+        }
+        if (ImGui::CollapsingHeader("Firefly lighting"))
+        {
+            for (uint32_t i = 0; i < irradiance_cache_frametimes.size(); ++i)
+            {
+                ImGui::Text((std::string("Irradiance cache ") + irradiance_cache_mode_names[i] + ": " + ve::to_string(irradiance_cache_frametimes[i], 4) + " ms frame; " + ve::to_string(irradiance_cache_lighting_timings[i], 4) + " ms lighting").c_str());
+            }
         }
         if (ImGui::CollapsingHeader("Plots"))
         {
@@ -153,6 +240,7 @@ namespace ve
                 ImPlot::PlotLine("RENDERING_TUNNEL", devicetiming_values[DeviceTimer::RENDERING_TUNNEL].data(), devicetiming_values[DeviceTimer::RENDERING_TUNNEL].size());
                 ImPlot::PlotLine("FIREFLY_MOVE_STEP", devicetiming_values[DeviceTimer::FIREFLY_MOVE_STEP].data(), devicetiming_values[DeviceTimer::FIREFLY_MOVE_STEP].size());
                 ImPlot::PlotLine("PLAYER_TUNNEL_COLLISION", devicetiming_values[DeviceTimer::COMPUTE_PLAYER_TUNNEL_COLLISION].data(), devicetiming_values[DeviceTimer::COMPUTE_PLAYER_TUNNEL_COLLISION].size());
+                ImPlot::PlotLine("RENDERING_LIGHTING", devicetiming_values[DeviceTimer::RENDERING_LIGHTING].data(), devicetiming_values[DeviceTimer::RENDERING_LIGHTING].size());
                 ImPlot::EndPlot();
             }
             if (ImPlot::BeginPlot("Compute Timings"))
@@ -160,6 +248,28 @@ namespace ve
                 ImPlot::SetupAxisLimitsConstraints(ImAxis_Y1, 0.0, 100.0);
                 ImPlot::SetupAxes("Frame", "Time [ms]", ImPlotAxisFlags_AutoFit, ImPlotAxisFlags_LockMin | ImPlotAxisFlags_AutoFit);
                 ImPlot::PlotLine("COMPUTE_TUNNEL_ADVANCE", devicetiming_values[DeviceTimer::COMPUTE_TUNNEL_ADVANCE].data(), devicetiming_values[DeviceTimer::COMPUTE_TUNNEL_ADVANCE].size());
+                ImPlot::PlotLine("TUNNEL_SEGMENT", devicetiming_values[DeviceTimer::COMPUTE_TUNNEL_SEGMENT].data(), devicetiming_values[DeviceTimer::COMPUTE_TUNNEL_SEGMENT].size());
+                ImPlot::PlotLine("BLAS_BUILD", devicetiming_values[DeviceTimer::COMPUTE_BLAS_BUILD].data(), devicetiming_values[DeviceTimer::COMPUTE_BLAS_BUILD].size());
+                ImPlot::PlotLine("BLAS_REFIT", devicetiming_values[DeviceTimer::COMPUTE_BLAS_REFIT].data(), devicetiming_values[DeviceTimer::COMPUTE_BLAS_REFIT].size());
+                ImPlot::PlotLine("TLAS_BUILD", devicetiming_values[DeviceTimer::COMPUTE_TLAS_BUILD].data(), devicetiming_values[DeviceTimer::COMPUTE_TLAS_BUILD].size());
+                ImPlot::EndPlot();
+            }
+            if (ImPlot::BeginPlot("Frametime Histogram"))
+            {
+                // only the newest values are plotted until the FixVector is full, so the histogram is not distorted by the initial values
+                std::array<float*, 2> values;
+                float max_frametime = 0.0f;
+                for (uint32_t i = 0; i < 2; ++i)
+                {
+                    values[i] = prefetch_frametime_values[i].data() + prefetch_frametime_values[i].size() - prefetch_frametime_counts[i];
+                    if (prefetch_frametime_counts[i] > 0) max_frametime = std::max(max_frametime, *std::max_element(values[i], values[i] + prefetch_frametime_counts[i]));
+                }
+                // both histograms share the bins to be comparable
+                ImPlot::SetupAxes("Time [ms]", "Frames", ImPlotAxisFlags_AutoFit, ImPlotAxisFlags_AutoFit);
+                ImPlot::SetNextFillStyle(IMPLOT_AUTO_COL, 0.5f);
+                ImPlot::PlotHistogram("ON_DEMAND", values[0], prefetch_frametime_counts[0], 64, 1.0, ImPlotRange(0.0, max_frametime));
+                ImPlot::SetNextFillStyle(IMPLOT_AUTO_COL, 0.5f);
+                ImPlot::PlotHistogram("PREFETCH", values[1], prefetch_frametime_counts[1], 64, 1.0, ImPlotRange(0.0, max_frametime));
                 ImPlot::EndPlot();
             }
         }
@@ -12,6 +12,7 @@ namespace ve
         vcc.add_graphics_buffers(frames_in_flight * 3);
         vcc.add_compute_buffers(frames_in_flight * 3);
         vcc.add_transfer_buffers(1);
+        vcc.add_async_compute_buffers(1);
 
         swapchain.construct();
 
@@ -59,7 +60,8 @@ namespace ve
         }
         scene.load(std::string("../assets/scenes/") + filename);
         scene.construct(swapchain.get_deferred_render_pass());
-        spdlog::info("Loading scene took: {} ms", (timer.elapsed()));
+        load_time = timer.elapsed<std::milli>();
+        spdlog::info("Loading scene took: {} ms", load_time);
         create_lighting_pipeline();
     }
 
@@ -67,7 +69,7 @@ namespace ve
     {
         create_lighting_descriptor_sets();
         std::vector<ShaderInfo> shader_infos(2);
-        std::array<vk::SpecializationMapEntry, 7> fragment_entries;
+        std::array<vk::SpecializationMapEntry, 11> fragment_entries;
         fragment_entries[0] = vk::SpecializationMapEntry(0, 0, sizeof(uint32_t));
         fragment_entries[1] = vk::SpecializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t));
         fragment_entries[2] = vk::SpecializationMapEntry(2, sizeof(uint32_t) * 2, sizeof(uint32_t));
@@ -75,7 +77,11 @@ namespace ve
         fragment_entries[4] = vk::SpecializationMapEntry(4, sizeof(uint32_t) * 4, sizeof(uint32_t));
         fragment_entries[5] = vk::SpecializationMapEntry(5, sizeof(uint32_t) * 5, sizeof(uint32_t));
         fragment_entries[6] = vk::SpecializationMapEntry(6, sizeof(uint32_t) * 6, sizeof(uint32_t));
-        std::array<uint32_t, 7> fragment_entries_data{scene.get_light_count(), segment_count, fireflies_per_segment, reservoir_count, swapchain.get_extent().width, swapchain.get_extent().height, 1};
+        fragment_entries[7] = vk::SpecializationMapEntry(7, sizeof(uint32_t) * 7, sizeof(uint32_t));
+        fragment_entries[8] = vk::SpecializationMapEntry(8, sizeof(uint32_t) * 8, sizeof(uint32_t));
+        fragment_entries[9] = vk::SpecializationMapEntry(9, sizeof(uint32_t) * 9, sizeof(uint32_t));
+        fragment_entries[10] = vk::SpecializationMapEntry(10, sizeof(uint32_t) * 10, sizeof(uint32_t));
+        std::array<uint32_t, 11> fragment_entries_data{scene.get_light_count(), segment_count, fireflies_per_segment, reservoir_count, swapchain.get_extent().width, swapchain.get_extent().height, 1, samples_per_segment, vertices_per_sample, irradiance_cache_rings, irradiance_cache_angles};
         vk::SpecializationInfo fragment_spec_info(fragment_entries.size(), fragment_entries.data(), sizeof(uint32_t) * fragment_entries_data.size(), fragment_entries_data.data());
 
         shader_infos[0] = ShaderInfo{"lighting.vert", vk::ShaderStageFlagBits::eVertex};
@@ -100,7 +106,8 @@ namespace ve
         lighting_dsh.add_binding(4, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eFragment);
         lighting_dsh.add_binding(5, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         lighting_dsh.add_binding(6, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eFragment);
-        lighting_dsh.add_binding(10, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
+        lighting_dsh.add_binding(7, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
+        lighting_dsh.add_binding(9, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         lighting_dsh.add_binding(11, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         lighting_dsh.add_binding(12, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         lighting_dsh.add_binding(13, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
@@ -124,7 +131,8 @@ namespace ve
                 lighting_dsh.add_descriptor(4, storage.get_buffer_by_name("spaceship_lights_" + std::to_string(j)));
                 lighting_dsh.add_descriptor(5, storage.get_buffer_by_name("firefly_vertices_" + std::to_string(j)));
                 lighting_dsh.add_descriptor(6, storage.get_image_by_name("noise_textures"));
-                lighting_dsh.add_descriptor(10, storage.get_buffer_by_name("tunnel_indices"));
+                lighting_dsh.add_descriptor(7, storage.get_buffer_by_name("tunnel_bezier_points"));
+                lighting_dsh.add_descriptor(9, storage.get_buffer_by_name("firefly_irradiance_cache_" + std::to_string(j)));
                 lighting_dsh.add_descriptor(11, storage.get_buffer_by_name("tunnel_vertices"));
                 lighting_dsh.add_descriptor(12, storage.get_buffer_by_name("indices"));
                 lighting_dsh.add_descriptor(13, storage.get_buffer_by_name("vertices"));
@@ -185,8 +193,9 @@ namespace ve
         scene.update_game_state(compute_cb, gs, timers[gs.current_frame]);
         compute_cb.end();
         vk::CommandBuffer& cb = vcc.begin(vcc.graphics_cb[gs.current_frame]);
-        timers[gs.current_frame].reset(cb, {DeviceTimer::RENDERING_ALL, DeviceTimer::RENDERING_APP, DeviceTimer::RENDERING_UI, DeviceTimer::RENDERING_TUNNEL});
+        timers[gs.current_frame].reset(cb, {DeviceTimer::RENDERING_ALL, DeviceTimer::RENDERING_APP, DeviceTimer::RENDERING_UI, DeviceTimer::RENDERING_TUNNEL, DeviceTimer::RENDERING_LIGHTING});
         timers[gs.current_frame].start(cb, DeviceTimer::RENDERING_ALL, vk::PipelineStageFlagBits::eAllGraphics);
+        scene.prepare_draw(cb, gs);
         vk::RenderPassBeginInfo rpbi{};
         rpbi.sType = vk::StructureType::eRenderPassBeginInfo;
         rpbi.renderPass = swapchain.get_deferred_render_pass().get();
@@ -239,12 +248,14 @@ namespace ve
         lighting_clear_values[1].depthStencil.stencil = 0;
         lighting_rpbi.clearValueCount = lighting_clear_values.size();
         lighting_rpbi.pClearValues = lighting_clear_values.data();
+        // both lighting passes, to compare the firefly lighting with and without the irradiance cache
+        timers[gs.current_frame].start(lighting_cb_0, DeviceTimer::RENDERING_LIGHTING, vk::PipelineStageFlagBits::eTopOfPipe);
         lighting_cb_0.beginRenderPass(lighting_rpbi, vk::SubpassContents::eInline);
         lighting_cb_0.setViewport(0, viewport);
         lighting_cb_0.setScissor(0, scissor);
         lighting_cb_0.bindPipeline(vk::PipelineBindPoint::eGraphics, lighting_pipeline_0.get());
         lighting_cb_0.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, lighting_pipeline_0.get_layout(), 0, lighting_dsh.get_sets()[gs.current_frame * frames_in_flight], {});
-        LightingPassPushConstants lppc{.first_segment_indices_idx = gs.first_segment_indices_idx, .time = gs.time, .normal_view = gs.normal_view, .color_view = gs.color_view, .segment_uid_view = gs.segment_uid_view};
+        LightingPassPushConstants lppc{.first_segment_slot = gs.first_segment_slot, .time = gs.time, .normal_view = gs.normal_view, .color_view = gs.color_view, .segment_uid_view = gs.segment_uid_view, .irradiance_cache_mode = uint32_t(gs.irradiance_cache_mode), .irradiance_cache_error_view = gs.irradiance_cache_error_view, .irradiance_cache_distance = gs.irradiance_cache_distance, .player_pos = gs.player_pos};
         lighting_cb_0.pushConstants(lighting_pipeline_0.get_layout(), vk::ShaderStageFlagBits::eFragment, 0, sizeof(LightingPassPushConstants), &lppc);
         lighting_cb_0.draw(3, 1, 0, 0);
         lighting_cb_0.endRenderPass();
@@ -258,6 +269,7 @@ namespace ve
         lighting_cb_1.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, lighting_pipeline_1.get_layout(), 0, lighting_dsh.get_sets()[gs.current_frame * frames_in_flight + 1], {});
         lighting_cb_1.pushConstants(lighting_pipeline_1.get_layout(), vk::ShaderStageFlagBits::eFragment, 0, sizeof(LightingPassPushConstants), &lppc);
         lighting_cb_1.draw(3, 1, 0, 0);
+        timers[gs.current_frame].stop(lighting_cb_1, DeviceTimer::RENDERING_LIGHTING, vk::PipelineStageFlagBits::eFragmentShader);
         timers[gs.current_frame].start(lighting_cb_1, DeviceTimer::RENDERING_UI, vk::PipelineStageFlagBits::eTopOfPipe);
         if (gs.show_ui) ui.draw(lighting_cb_1, gs);
         timers[gs.current_frame].stop(lighting_cb_1, DeviceTimer::RENDERING_UI, vk::PipelineStageFlagBits::eBottomOfPipe);
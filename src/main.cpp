@@ -1,5 +1,10 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <filesystem>
+#include <random>
 #include <stdexcept>
 #include <thread>
 #define GLM_FORCE_RADIANS
@@ -9,21 +14,50 @@
 #include <SDL2/SDL_mixer.h>
 
 #include "vk/common.hpp"
+#include "Bvh.hpp"
 #include "Camera.hpp"
 #include "EventHandler.hpp"
+#include "NoiseTextures.hpp"
+#include "Parallel.hpp"
+#include "RuntimeConfig.hpp"
+#include "Simd.hpp"
+#include "TunnelQuery.hpp"
 #include "ve_log.hpp"
 #include "vk/Timer.hpp"
+#include "vk/TunnelObjects.hpp"
 #include "vk/VulkanMainContext.hpp"
 #include "vk/VulkanCommandContext.hpp"
 #include "Storage.hpp"
 #include "WorkContext.hpp"
 
+struct BenchmarkResult
+{
+    float frametime = 0.0f;
+    std::vector<double> devicetimings;
+    // share of the frames that built or refit the top level acceleration structure
+    float tlas_builds = 0.0f;
+    float tlas_refits = 0.0f;
+    uint64_t allocated_bytes = 0;
+    // of the default scene in ms
+    double load_time = 0.0;
+    double blas_build_time = 0.0;
+};
+
+struct LoadBenchmarkResult
+{
+    // averages in ms
+    double load_time = 0.0;
+    double blas_build_time = 0.0;
+    bool built_blas_on_host = false;
+};
+
 class MainContext
 {
 public:
     MainContext() : extent(1000, 800), vmc(extent.width, extent.height), vcc(vmc), wc(vmc, vcc), camera(60.0f, extent.width, extent.height), gs{.cam = camera}
     {
         gs.devicetimings.resize(ve::DeviceTimer::TIMER_COUNT, 0.0f);
+        gs.irradiance_cache_mode = ve::irradiance_cache_mode;
         extent = wc.swapchain.get_extent();
         camera.updateScreenSize(extent.width, extent.height);
     }
@@ -45,15 +79,7 @@ public:
 
     void run()
     {
-        std::vector<std::string> scene_names;
-        gs.current_scene = 0;
-        for (const auto& entry : std::filesystem::directory_iterator("../assets/scenes/"))
-        {
-            if (entry.path().filename() == "escapevulkan.json") gs.current_scene = scene_names.size();
-            scene_names.push_back(entry.path().filename());
-        }
-        for (const auto& name : scene_names) gs.scene_names.push_back(&name.front());
-        wc.load_scene(gs.scene_names[gs.current_scene]);
+        load_default_scene();
         constexpr float min_frametime = 5.0f;
         // keep time measurement and frametime separate to be able to use a frame limiter
         ve::HostTimer timer;
@@ -100,6 +126,7 @@ public:
             }
             gs.time_diff = timer.restart();
             gs.time += gs.time_diff;
+            gs.frametime = gs.time_diff * 1000.0f;
             // calculate actual frametime by subtracting the waiting time
             //gs.frametime = gs.time_diff - std::max(0.0f, min_frametime - gs.frametime);
             if (gs.load_scene)
@@ -112,6 +139,71 @@ public:
         std::cout << "Distance: " << gs.tunnel_distance_travelled << std::endl;
     }
 
+    // renders warmup_frames + frames frames with the scripted camera and averages the measurements of the last frames
+    BenchmarkResult benchmark(uint32_t warmup_frames, uint32_t frames)
+    {
+        load_default_scene();
+        gs.scripted_camera = true;
+        gs.collision_detection_active = false;
+        gs.show_ui = false;
+        BenchmarkResult result;
+        result.load_time = wc.load_time;
+        result.blas_build_time = wc.scene.blas_build_time;
+        result.devicetimings.resize(ve::DeviceTimer::TIMER_COUNT, 0.0);
+        std::vector<uint32_t> devicetiming_counts(ve::DeviceTimer::TIMER_COUNT, 0);
+        ve::HostTimer timer;
+        SDL_Event e;
+        for (uint32_t i = 0; i < warmup_frames + frames; ++i)
+        {
+            gs.cam.updateVP(gs.time_diff);
+            gs.player_pos = camera.getPosition();
+            try
+            {
+                wc.draw_frame(gs);
+            }
+            catch (const vk::OutOfDateKHRError e)
+            {
+                extent = wc.recreate_swapchain();
+                camera.updateScreenSize(extent.width, extent.height);
+            }
+            while (SDL_PollEvent(&e)) eh.dispatch_event(e);
+            gs.time_diff = timer.restart();
+            gs.time += gs.time_diff;
+            gs.frametime = gs.time_diff * 1000.0f;
+            if (i < warmup_frames) continue;
+            result.frametime += gs.frametime / frames;
+            result.tlas_builds += float(gs.tlas_update == uint32_t(ve::TLASUpdate::Build)) / frames;
+            result.tlas_refits += float(gs.tlas_update == uint32_t(ve::TLASUpdate::Refit)) / frames;
+            for (uint32_t j = 0; j < ve::DeviceTimer::TIMER_COUNT; ++j)
+            {
+                // timers that did not run in a frame are negative
+                if (std::signbit(gs.devicetimings[j])) continue;
+                result.devicetimings[j] += gs.devicetimings[j];
+                devicetiming_counts[j]++;
+            }
+        }
+        for (uint32_t j = 0; j < ve::DeviceTimer::TIMER_COUNT; ++j) result.devicetimings[j] = devicetiming_counts[j] > 0 ? result.devicetimings[j] / devicetiming_counts[j] : 0.0;
+        result.allocated_bytes = vmc.get_allocated_bytes();
+        vmc.logical_device.get().waitIdle();
+        return result;
+    }
+
+    // loads the default scene repetitions times
+    LoadBenchmarkResult benchmark_load(uint32_t repetitions)
+    {
+        LoadBenchmarkResult result;
+        for (uint32_t i = 0; i < repetitions; ++i)
+        {
+            if (i == 0) load_default_scene();
+            else wc.load_scene(gs.scene_names[gs.current_scene]);
+            result.load_time += wc.load_time / repetitions;
+            result.blas_build_time += wc.scene.blas_build_time / repetitions;
+        }
+        result.built_blas_on_host = wc.scene.built_blas_on_host;
+        vmc.logical_device.get().waitIdle();
+        return result;
+    }
+
 private:
     Mix_Chunk* spaceship_sound = nullptr;
     Mix_Chunk* crash_sound = nullptr;
@@ -128,6 +220,19 @@ private:
     glm::vec3 rotation_speed;
     ve::GameState gs;
     bool game_mode = false;
+    std::vector<std::string> scene_names;
+
+    void load_default_scene()
+    {
+        gs.current_scene = 0;
+        for (const auto& entry : std::filesystem::directory_iterator("../assets/scenes/"))
+        {
+            if (entry.path().filename() == "escapevulkan.json") gs.current_scene = scene_names.size();
+            scene_names.push_back(entry.path().filename());
+        }
+        for (const auto& name : scene_names) gs.scene_names.push_back(&name.front());
+        wc.load_scene(gs.scene_names[gs.current_scene]);
+    }
 
     void dispatch_pressed_keys()
     {
@@ -257,6 +362,351 @@ private:
     }
 };
 
+// creates the noise texture cache on the cpu if it is missing and validates the existing one otherwise; does not need a gpu
+int noise_cache()
+{
+    const uint64_t key = ve::noise_texture_cache_key(ve::noise_texture_dim);
+    ve::HostTimer timer;
+    ve::NoiseTextureLayers layers = ve::generate_noise_textures(ve::noise_texture_dim);
+    spdlog::info("Generating noise textures on the CPU took {} ms", timer.elapsed<std::milli>());
+    ve::NoiseTextureLayers cached;
+    if (ve::load_noise_texture_cache(key, ve::noise_texture_dim, cached))
+    {
+        const ve::NoiseTextureError error = ve::compare_noise_textures(cached, layers, ve::noise_texture_dim);
+        spdlog::info("Cached noise textures differ from CPU reference by max {} and mean {}", error.max, error.mean);
+        if (error.max > ve::noise_texture_max_error || error.mean > ve::noise_texture_mean_error)
+        {
+            spdlog::error("Cached noise textures exceed the tolerance (max {}, mean {}), delete {} to regenerate them", ve::noise_texture_max_error, ve::noise_texture_mean_error, ve::noise_texture_cache_path(key));
+            return 1;
+        }
+        return 0;
+    }
+    ve::save_noise_texture_cache(key, ve::noise_texture_dim, layers);
+    return 0;
+}
+
+// generates tunnel segments on the cpu and reports the throughput; does not need a gpu
+int benchmark_tunnel_cpu()
+{
+    constexpr uint32_t benchmark_segment_count = 256;
+    ve::TunnelPath path(ve::segment_scale);
+    ve::TunnelGenerator generator(ve::samples_per_segment, ve::vertices_per_sample);
+    std::vector<ve::TunnelSegmentPoints> segments{path.first_segment()};
+    while (segments.size() < benchmark_segment_count) segments.push_back(path.next_segment(segments.back()));
+    std::vector<ve::TunnelVertex> vertices;
+    const uint32_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+    for (uint32_t threads : {1u, thread_count})
+    {
+        ve::HostTimer timer;
+        generator.generate_segments(segments, vertices, threads);
+        const float time = timer.elapsed();
+        spdlog::info("Generated {} tunnel segments with {} thread(s) in {} ms ({} segments/s)", benchmark_segment_count, threads, time * 1000.0f, benchmark_segment_count / time);
+    }
+    // error of the compact vertex encoding and the memory it saves
+    const uint32_t vertices_per_segment = generator.get_vertices_per_segment();
+    std::vector<ve::CompactTunnelVertex> compact_vertices(vertices_per_segment);
+    std::vector<ve::TunnelVertex> expanded_vertices(vertices_per_segment);
+    ve::TunnelSegmentError error;
+    for (uint32_t i = 0; i < benchmark_segment_count; ++i)
+    {
+        generator.compact_segment(segments[i], vertices.data() + i * vertices_per_segment, compact_vertices.data());
+        generator.expand_segment(segments[i], compact_vertices.data(), expanded_vertices.data());
+        const ve::TunnelSegmentError segment_error = ve::compare_tunnel_vertices(expanded_vertices.data(), vertices.data() + i * vertices_per_segment, vertices_per_segment, 1e-3f, 2e-3f);
+        error.max_position = std::max(error.max_position, segment_error.max_position);
+        error.max_normal = std::max(error.max_normal, segment_error.max_normal);
+        error.max_ao = std::max(error.max_ao, segment_error.max_ao);
+        error.vertices_out_of_tolerance += segment_error.vertices_out_of_tolerance;
+    }
+    spdlog::info("Compact tunnel vertices differ by max {} (position), max {} (normal) and max {} (ambient occlusion), {} vertices out of tolerance", error.max_position, error.max_normal, error.max_ao, error.vertices_out_of_tolerance);
+    const float mib = 1024.0f * 1024.0f;
+    const uint32_t tunnel_vertex_count = ve::get_segment_slot_count() * ve::vertices_per_segment;
+    spdlog::info("Tunnel vertex buffer: {} MiB with {} B per vertex, compact {} MiB with {} B per vertex (+{} MiB positions for the acceleration structure)", tunnel_vertex_count * sizeof(ve::TunnelVertex) / mib, sizeof(ve::TunnelVertex), tunnel_vertex_count * sizeof(ve::CompactTunnelVertex) / mib, sizeof(ve::CompactTunnelVertex), tunnel_vertex_count * sizeof(glm::vec3) / mib);
+    // spacing of neighboring rings with uniform curve parameters compared to the arc length parameterization that tunnel.comp uses
+    float max_uniform_spacing = 0.0f;
+    float max_segment_length = 0.0f;
+    for (bool arc_length : {false, true})
+    {
+        double sum = 0.0;
+        double sum_squares = 0.0;
+        float max_spacing = 0.0f;
+        float max_ratio = 1.0f;
+        for (const ve::TunnelSegmentPoints& segment : segments)
+        {
+            float segment_min = std::numeric_limits<float>::max();
+            float segment_max = 0.0f;
+            for (uint32_t i = 0; i + 1 < ve::samples_per_segment; ++i)
+            {
+                const float arc_fraction_a = float(i) / float(ve::samples_per_segment - 1);
+                const float arc_fraction_b = float(i + 1) / float(ve::samples_per_segment - 1);
+                const float t_a = arc_length ? ve::get_tunnel_ring_parameter(segment, arc_fraction_a) : arc_fraction_a;
+                const float t_b = arc_length ? ve::get_tunnel_ring_parameter(segment, arc_fraction_b) : arc_fraction_b;
+                const float spacing = glm::distance(ve::get_tunnel_ring_frame(segment, t_a).center, ve::get_tunnel_ring_frame(segment, t_b).center);
+                sum += spacing;
+                sum_squares += spacing * spacing;
+                segment_min = std::min(segment_min, spacing);
+                segment_max = std::max(segment_max, spacing);
+            }
+            max_spacing = std::max(max_spacing, segment_max);
+            max_ratio = std::max(max_ratio, segment_max / segment_min);
+            if (!arc_length) max_segment_length = std::max(max_segment_length, ve::get_tunnel_arc_length(segment, 1.0f));
+        }
+        if (!arc_length) max_uniform_spacing = max_spacing;
+        const double count = benchmark_segment_count * (ve::samples_per_segment - 1);
+        const double mean = sum / count;
+        const double variance = sum_squares / count - mean * mean;
+        spdlog::info("Ring spacing with {}: mean {}, variance {}, max {}, largest ratio of max to min spacing in a segment {}", arc_length ? "arc length parameterization" : "uniform curve parameter", mean, variance, max_spacing, max_ratio);
+    }
+    spdlog::info("Evenly spaced rings reach the max spacing of {} uniform rings with {} samples per segment", ve::samples_per_segment, uint32_t(std::ceil(max_segment_length / max_uniform_spacing)) + 1);
+    return 0;
+}
+
+// measures the analytic tunnel queries against a scan over all vertices of a segment
+int benchmark_tunnel_query()
+{
+    constexpr uint32_t benchmark_segment_count = 256;
+    constexpr uint32_t query_count = 1000000;
+    constexpr uint32_t brute_force_query_count = 1000;
+    ve::TunnelPath path(ve::segment_scale);
+    ve::TunnelGenerator generator(ve::samples_per_segment, ve::vertices_per_sample);
+    std::vector<ve::TunnelSegmentPoints> segments{path.first_segment()};
+    while (segments.size() < benchmark_segment_count) segments.push_back(path.next_segment(segments.back()));
+    // random positions inside and slightly outside of the tunnel
+    std::mt19937 rnd(0);
+    std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+    std::vector<glm::vec3> positions(query_count);
+    std::vector<uint32_t> position_segments(query_count);
+    for (uint32_t i = 0; i < query_count; ++i)
+    {
+        position_segments[i] = std::min(uint32_t(dis(rnd) * benchmark_segment_count), benchmark_segment_count - 1);
+        const ve::TunnelRingFrame frame = ve::get_tunnel_ring_frame(segments[position_segments[i]], dis(rnd));
+        const float angle = dis(rnd) * 2.0f * M_PIf;
+        positions[i] = frame.center + (glm::normalize(frame.plane_vector) * std::cos(angle) + glm::normalize(frame.kv) * std::sin(angle)) * dis(rnd) * 25.0f;
+    }
+    // keep the results alive so that the compiler does not remove the queries
+    float checksum = 0.0f;
+    ve::HostTimer timer;
+    for (uint32_t i = 0; i < query_count; ++i)
+    {
+        const ve::TunnelSegmentPoints& s = segments[position_segments[i]];
+        checksum += ve::get_closest_bezier_parameter(s.p0, s.p1, s.p2, positions[i]);
+    }
+    float time = timer.elapsed();
+    spdlog::info("Closest point on center line: {} queries/s", query_count / time);
+    timer.restart();
+    for (uint32_t i = 0; i < query_count; ++i) checksum += ve::query_tunnel_segment(segments[position_segments[i]], positions[i]).wall_distance;
+    time = timer.elapsed();
+    spdlog::info("Distance to wall: {} queries/s", query_count / time);
+    // same window of segments that is rendered
+    timer.restart();
+    for (uint32_t i = 0; i < query_count; ++i)
+    {
+        const uint32_t first_segment = std::min(position_segments[i], benchmark_segment_count - ve::segment_count);
+        const std::vector<ve::TunnelSegmentPoints> window(segments.begin() + first_segment, segments.begin() + first_segment + ve::segment_count);
+        checksum += ve::query_tunnel(window, positions[i]).wall_distance;
+    }
+    time = timer.elapsed();
+    spdlog::info("Segment lookup and distance to wall over {} segments: {} queries/s", ve::segment_count, query_count / time);
+
+    std::vector<ve::TunnelVertex> vertices;
+    generator.generate_segments(segments, vertices);
+    const uint32_t vertices_per_segment = generator.get_vertices_per_segment();
+    timer.restart();
+    for (uint32_t i = 0; i < brute_force_query_count; ++i)
+    {
+        float min_distance = std::numeric_limits<float>::max();
+        for (uint32_t j = 0; j < vertices_per_segment; ++j) min_distance = std::min(min_distance, glm::distance(vertices[position_segments[i] * vertices_per_segment + j].pos, positions[i]));
+        checksum += min_distance;
+    }
+    time = timer.elapsed();
+    spdlog::info("Closest vertex scan of one segment: {} queries/s", brute_force_query_count / time);
+
+    // the vertices of the generated mesh lie on the wall, so their distance to it has to be close to 0
+    float max_wall_distance = 0.0f;
+    uint32_t ring_mismatches = 0;
+    for (uint32_t i = 0; i < vertices.size(); ++i)
+    {
+        const ve::TunnelQueryResult result = ve::query_tunnel_segment(segments[i / vertices_per_segment], vertices[i].pos);
+        max_wall_distance = std::max(max_wall_distance, std::abs(result.wall_distance));
+        // on strongly curved segments the closest point of the center line may belong to another ring
+        const uint32_t ring = (i % vertices_per_segment) / ve::vertices_per_sample;
+        if (std::abs(result.arc_fraction * (ve::samples_per_segment - 1) - float(ring)) > 0.01f) ring_mismatches++;
+    }
+    spdlog::info("Mesh vertices are max {} away from the queried wall; {} of {} vertices are closer to the center of another ring (checksum {})", max_wall_distance, ring_mismatches, vertices.size(), checksum);
+    return 0;
+}
+
+// builds a cpu bvh over tunnel segments and measures the queries against each other and a scan over all triangles; does not need a gpu
+int benchmark_bvh()
+{
+    constexpr uint32_t benchmark_segment_count = 256;
+    constexpr uint32_t packet_size = 64;
+    constexpr uint32_t packet_count = 16384;
+    constexpr uint32_t brute_force_ray_count = 256;
+    ve::TunnelPath path(ve::segment_scale);
+    ve::TunnelGenerator generator(ve::samples_per_segment, ve::vertices_per_sample);
+    std::vector<ve::TunnelSegmentPoints> segments{path.first_segment()};
+    while (segments.size() < benchmark_segment_count) segments.push_back(path.next_segment(segments.back()));
+    std::vector<ve::TunnelVertex> vertices;
+    generator.generate_segments(segments, vertices);
+    std::vector<uint32_t> indices;
+    for (uint32_t i = 0; i < benchmark_segment_count; ++i) generator.append_segment_indices(indices, i * generator.get_vertices_per_segment());
+    const std::vector<glm::vec3> positions = ve::Bvh::get_positions(vertices);
+
+    ve::Bvh bvh;
+    const uint32_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+    for (uint32_t threads : {1u, thread_count})
+    {
+        ve::HostTimer timer;
+        bvh.build(positions, indices, threads);
+        spdlog::info("Built BVH over {} triangles with {} thread(s) in {} ms ({} nodes, SAH cost {})", indices.size() / 3, threads, timer.elapsed<std::milli>(), bvh.get_nodes().size(), bvh.get_sah_cost());
+    }
+
+    // every packet is like a tile of primary rays: one origin on the center line and directions in a narrow cone
+    std::mt19937 rnd(0);
+    std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+    auto random_dir = [&]() {
+        const float z = 2.0f * dis(rnd) - 1.0f;
+        const float phi = 2.0f * M_PIf * dis(rnd);
+        const float r = std::sqrt(1.0f - z * z);
+        return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+    };
+    std::vector<ve::BvhRay> rays(packet_size * packet_count);
+    for (uint32_t i = 0; i < packet_count; ++i)
+    {
+        const uint32_t segment = std::min(uint32_t(dis(rnd) * benchmark_segment_count), benchmark_segment_count - 1);
+        const glm::vec3 origin = ve::get_tunnel_ring_frame(segments[segment], dis(rnd)).center;
+        const glm::vec3 dir = random_dir();
+        for (uint32_t j = 0; j < packet_size; ++j) rays[i * packet_size + j] = ve::BvhRay{origin, glm::normalize(dir + 0.05f * random_dir())};
+    }
+    std::vector<ve::BvhHit> hits(rays.size());
+    std::vector<ve::BvhHit> packet_hits(rays.size());
+    std::vector<uint8_t> occluded(rays.size());
+    std::vector<uint8_t> packet_occluded(rays.size());
+    const double mrays = rays.size() / 1e6;
+    ve::HostTimer timer;
+    for (uint32_t i = 0; i < rays.size(); ++i) hits[i] = bvh.intersect(rays[i]);
+    spdlog::info("Closest hit, single rays: {} Mrays/s", mrays / timer.restart());
+    for (uint32_t i = 0; i < packet_count; ++i) bvh.intersect_packet(rays.data() + i * packet_size, packet_size, packet_hits.data() + i * packet_size);
+    spdlog::info("Closest hit, packets of {} rays with {} simd lanes: {} Mrays/s", packet_size, ve::lane_count<ve::FloatLanes>(), mrays / timer.restart());
+    ve::parallel_for(packet_count, [&](uint32_t i) { bvh.intersect_packet(rays.data() + i * packet_size, packet_size, packet_hits.data() + i * packet_size); }, thread_count);
+    spdlog::info("Closest hit, packets on {} threads: {} Mrays/s", thread_count, mrays / timer.restart());
+    for (uint32_t i = 0; i < rays.size(); ++i) occluded[i] = bvh.occluded(rays[i]);
+    spdlog::info("Any hit, single rays: {} Mrays/s", mrays / timer.restart());
+    for (uint32_t i = 0; i < packet_count; ++i) bvh.occluded_packet(rays.data() + i * packet_size, packet_size, packet_occluded.data() + i * packet_size);
+    spdlog::info("Any hit, packets: {} Mrays/s", mrays / timer.restart());
+    uint32_t mismatches = 0;
+    uint32_t hit_count = 0;
+    for (uint32_t i = 0; i < rays.size(); ++i)
+    {
+        const bool hit = hits[i].primitive != uint32_t(-1);
+        hit_count += hit;
+        if (hits[i].primitive != packet_hits[i].primitive || occluded[i] != hit || packet_occluded[i] != hit) mismatches++;
+    }
+    spdlog::info("{} of {} rays hit the tunnel, {} differ between single rays, packets and any hit queries", hit_count, rays.size(), mismatches);
+
+    // scan over all triangles as a reference for the closest hits
+    float max_t_error = 0.0f;
+    uint32_t brute_force_mismatches = 0;
+    timer.restart();
+    for (uint32_t i = 0; i < brute_force_ray_count; ++i)
+    {
+        const ve::BvhRay& ray = rays[i * (rays.size() / brute_force_ray_count)];
+        float closest_t = std::numeric_limits<float>::max();
+        for (uint32_t j = 0; j < indices.size(); j += 3)
+        {
+            const glm::vec3 e1 = positions[indices[j + 1]] - positions[indices[j]];
+            const glm::vec3 e2 = positions[indices[j + 2]] - positions[indices[j]];
+            const glm::vec3 p = glm::cross(ray.dir, e2);
+            const float det = glm::dot(e1, p);
+            if (det == 0.0f) continue;
+            const glm::vec3 s = ray.origin - positions[indices[j]];
+            const float u = glm::dot(s, p) / det;
+            const glm::vec3 q = glm::cross(s, e1);
+            const float v = glm::dot(ray.dir, q) / det;
+            const float t = glm::dot(e2, q) / det;
+            if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > ray.t_min && t < closest_t) closest_t = t;
+        }
+        const ve::BvhHit& hit = hits[i * (rays.size() / brute_force_ray_count)];
+        if ((closest_t < std::numeric_limits<float>::max()) != (hit.primitive != uint32_t(-1))) brute_force_mismatches++;
+        else if (hit.primitive != uint32_t(-1)) max_t_error = std::max(max_t_error, std::abs(hit.t - closest_t));
+    }
+    spdlog::info("Scan over all triangles: {} rays/s; {} of {} rays differ from the BVH, max distance error {}", brute_force_ray_count / timer.elapsed(), brute_force_mismatches, brute_force_ray_count, max_t_error);
+
+    // a refit keeps the tree of the old positions, so its cost grows with the deformation compared to a new build
+    std::vector<glm::vec3> deformed_positions = positions;
+    for (glm::vec3& p : deformed_positions) p += glm::vec3(0.0f, 2.0f * std::sin(p.z * 0.05f), 2.0f * std::sin(p.x * 0.05f));
+    timer.restart();
+    bvh.refit(deformed_positions);
+    spdlog::info("Refit in {} ms (SAH cost {})", timer.elapsed<std::milli>(), bvh.get_sah_cost());
+    std::vector<ve::BvhHit> refit_hits(rays.size());
+    timer.restart();
+    ve::parallel_for(packet_count, [&](uint32_t i) { bvh.intersect_packet(rays.data() + i * packet_size, packet_size, refit_hits.data() + i * packet_size); }, thread_count);
+    const double refit_time = timer.elapsed();
+    timer.restart();
+    bvh.build(deformed_positions, indices, thread_count);
+    spdlog::info("Rebuild in {} ms (SAH cost {})", timer.elapsed<std::milli>(), bvh.get_sah_cost());
+    timer.restart();
+    ve::parallel_for(packet_count, [&](uint32_t i) { bvh.intersect_packet(rays.data() + i * packet_size, packet_size, packet_hits.data() + i * packet_size); }, thread_count);
+    const double rebuild_time = timer.elapsed();
+    mismatches = 0;
+    for (uint32_t i = 0; i < rays.size(); ++i) mismatches += refit_hits[i].primitive != packet_hits[i].primitive;
+    spdlog::info("Closest hit after refit {} Mrays/s, after rebuild {} Mrays/s; {} rays differ", mrays / refit_time, mrays / rebuild_time, mismatches);
+    return 0;
+}
+
+// loads the default scene with the acceleration structures of the models built on the device and on the host
+int benchmark_load(const ve::RuntimeConfig& base_config)
+{
+    constexpr uint32_t repetitions = 5;
+    ve::RuntimeConfig config = base_config;
+    for (uint32_t host_blas_builds : {0u, 1u})
+    {
+        config.host_blas_builds = host_blas_builds;
+        ve::apply_runtime_config(config);
+        LoadBenchmarkResult result;
+        {
+            MainContext mc;
+            result = mc.benchmark_load(repetitions);
+        }
+        if (host_blas_builds != uint32_t(result.built_blas_on_host))
+        {
+            spdlog::warn("Acceleration structure host commands are not supported, cannot compare with builds on the host");
+            break;
+        }
+        spdlog::info("Acceleration structures built on the {}: {} ms load, {} ms of it building the acceleration structures (average of {} loads)", host_blas_builds ? "host" : "device", result.load_time, result.blas_build_time, repetitions);
+    }
+    return 0;
+}
+
+// renders every config of the sweep with the scripted camera and writes the measurements to a csv file
+int sweep(const std::string& path, const ve::RuntimeConfig& base_config)
+{
+    const ve::RuntimeConfigSweep config_sweep = ve::load_runtime_config_sweep(path, base_config);
+    std::ofstream csv(config_sweep.output);
+    VE_ASSERT(csv.is_open(), "Failed to open \"{}\"!", config_sweep.output);
+    for (const auto& parameter : ve::runtime_config_parameters) csv << parameter.name << ",";
+    csv << "FRAMETIME";
+    for (const char* name : ve::DeviceTimer::timer_names) csv << "," << name;
+    csv << ",TLAS_BUILDS_PER_FRAME,TLAS_REFITS_PER_FRAME,ALLOCATED_BYTES,LOAD_TIME,BLAS_BUILD_TIME" << std::endl;
+    for (uint32_t i = 0; i < config_sweep.configs.size(); ++i)
+    {
+        spdlog::info("Sweep {}/{}", i + 1, config_sweep.configs.size());
+        ve::apply_runtime_config(config_sweep.configs[i]);
+        BenchmarkResult result;
+        {
+            // every config needs a fresh context as all buffers and pipelines depend on it
+            MainContext mc;
+            result = mc.benchmark(config_sweep.warmup_frames, config_sweep.frames);
+        }
+        for (const auto& parameter : ve::runtime_config_parameters) csv << config_sweep.configs[i].*parameter.value << ",";
+        csv << result.frametime;
+        for (double timing : result.devicetimings) csv << "," << timing;
+        csv << "," << result.tlas_builds << "," << result.tlas_refits << "," << result.allocated_bytes << "," << result.load_time << "," << result.blas_build_time << std::endl;
+    }
+    spdlog::info("Wrote sweep results to \"{}\"", config_sweep.output);
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
     std::vector<spdlog::sink_ptr> sinks;
@@ -267,6 +717,22 @@ int main(int argc, char** argv)
     spdlog::set_level(spdlog::level::debug);
     spdlog::set_pattern("[%Y-%m-%d %T.%e] [%L] %v");
     spdlog::info("Starting");
+    const std::vector<std::string> args(argv + 1, argv + argc);
+    // value of an option that is given as "--option value"
+    auto get_option = [&args](const std::string& option, const std::string& default_value) {
+        auto it = std::find(args.begin(), args.end(), option);
+        return (it != args.end() && it + 1 != args.end()) ? *(it + 1) : default_value;
+    };
+    const std::string config_path = get_option("--config", "../assets/config.json");
+    ve::RuntimeConfig config;
+    if (std::filesystem::exists(config_path)) config = ve::load_runtime_config(config_path);
+    ve::apply_runtime_config(config);
+    if (std::find(args.begin(), args.end(), "--noise-cache") != args.end()) return noise_cache();
+    if (std::find(args.begin(), args.end(), "--benchmark-tunnel-cpu") != args.end()) return benchmark_tunnel_cpu();
+    if (std::find(args.begin(), args.end(), "--benchmark-tunnel-query") != args.end()) return benchmark_tunnel_query();
+    if (std::find(args.begin(), args.end(), "--benchmark-bvh") != args.end()) return benchmark_bvh();
+    if (std::find(args.begin(), args.end(), "--benchmark-load") != args.end()) return benchmark_load(config);
+    if (std::find(args.begin(), args.end(), "--sweep") != args.end()) return sweep(get_option("--sweep", ""), config);
     auto t1 = std::chrono::high_resolution_clock::now();
     MainContext mc;
     auto t2 = std::chrono::high_resolution_clock::now();
@@ -4,7 +4,7 @@
 
 namespace ve
 {
-    CollisionHandler::CollisionHandler(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : vmc(vmc), vcc(vcc), storage(storage), compute_dsh(vmc), compute_pipeline(vmc), render_pipeline(vmc)
+    CollisionHandler::CollisionHandler(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : vmc(vmc), vcc(vcc), storage(storage), compute_dsh(vmc), compute_pipeline(vmc), broad_phase_pipeline(vmc), narrow_phase_pipeline(vmc), ray_pipeline(vmc), render_pipeline(vmc)
     {}
 
     void CollisionHandler::create_buffers(const std::vector<Vertex>& vertices, uint32_t scene_player_start_idx, uint32_t scene_player_idx_count)
@@ -22,6 +22,11 @@ namespace ve
         storage.get_buffer(bb_buffer).update_data(bb);
         return_buffers.push_back(storage.add_named_buffer(std::string("collision_return_0"), sizeof(int32_t), vk::BufferUsageFlagBits::eStorageBuffer, false, vmc.queue_family_indices.compute));
         return_buffers.push_back(storage.add_named_buffer(std::string("collision_return_1"), sizeof(int32_t), vk::BufferUsageFlagBits::eStorageBuffer, false, vmc.queue_family_indices.compute));
+        candidate_buffers.push_back(storage.add_named_buffer(std::string("collision_candidates_0"), sizeof(PlayerCollisionCandidates), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer, false, vmc.queue_family_indices.compute));
+        candidate_buffers.push_back(storage.add_named_buffer(std::string("collision_candidates_1"), sizeof(PlayerCollisionCandidates), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer, false, vmc.queue_family_indices.compute));
+        const std::vector<CollisionRayHit> no_ray_hits(collision_ray_count, CollisionRayHit{glm::vec3(0.0f), -1.0f});
+        ray_hit_buffers.push_back(storage.add_named_buffer(std::string("collision_ray_hits_0"), no_ray_hits, vk::BufferUsageFlagBits::eStorageBuffer, false, vmc.queue_family_indices.compute));
+        ray_hit_buffers.push_back(storage.add_named_buffer(std::string("collision_ray_hits_1"), no_ray_hits, vk::BufferUsageFlagBits::eStorageBuffer, false, vmc.queue_family_indices.compute));
         reset_shader_return_values(0);
         reset_shader_return_values(1);
         std::vector<DebugVertex> bb_vertices(36);
@@ -76,21 +81,29 @@ namespace ve
     {
         compute_dsh.add_binding(0, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(1, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
-        compute_dsh.add_binding(2, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(4, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(5, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(6, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(7, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(8, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(9, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(10, vk::DescriptorType::eAccelerationStructureKHR, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(11, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         for (uint32_t i = 0; i < frames_in_flight; ++i)
         {
             compute_dsh.new_set();
             compute_dsh.add_descriptor(0, storage.get_buffer(bb_buffer));
             compute_dsh.add_descriptor(1, storage.get_buffer(return_buffers[i]));
-            compute_dsh.add_descriptor(2, storage.get_buffer_by_name("tunnel_indices"));
             compute_dsh.add_descriptor(3, storage.get_buffer_by_name("tunnel_vertices"));
             compute_dsh.add_descriptor(4, storage.get_buffer_by_name("indices"));
             compute_dsh.add_descriptor(5, storage.get_buffer_by_name("vertices"));
             compute_dsh.add_descriptor(6, storage.get_buffer_by_name("bb_mm_" + std::to_string(i)));
+            compute_dsh.add_descriptor(7, storage.get_buffer_by_name("tunnel_bezier_points"));
+            compute_dsh.add_descriptor(8, storage.get_buffer_by_name("tunnel_segment_uids"));
+            compute_dsh.add_descriptor(9, storage.get_buffer(candidate_buffers[i]));
+            compute_dsh.add_descriptor(10, storage.get_buffer_by_name("tlas_" + std::to_string(i)));
+            compute_dsh.add_descriptor(11, storage.get_buffer(ray_hit_buffers[i]));
         }
         compute_dsh.construct();
         construct_pipelines(render_pass);
@@ -111,7 +124,7 @@ namespace ve
         pcrs.push_back(vk::PushConstantRange(vk::ShaderStageFlagBits::eVertex, 0, sizeof(DebugPushConstants)));
         render_pipeline.construct(render_pass, std::nullopt, shader_infos, vk::PolygonMode::eLine, DebugVertex::get_binding_descriptions(), DebugVertex::get_attribute_descriptions(), vk::PrimitiveTopology::eTriangleList, pcrs);
 
-        std::array<vk::SpecializationMapEntry, 7> compute_entries;
+        std::array<vk::SpecializationMapEntry, 9> compute_entries;
         compute_entries[0] = vk::SpecializationMapEntry(0, 0, sizeof(uint32_t));
         compute_entries[1] = vk::SpecializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t));
         compute_entries[2] = vk::SpecializationMapEntry(2, sizeof(uint32_t) * 2, sizeof(uint32_t));
@@ -119,21 +132,35 @@ namespace ve
         compute_entries[4] = vk::SpecializationMapEntry(4, sizeof(uint32_t) * 4, sizeof(uint32_t));
         compute_entries[5] = vk::SpecializationMapEntry(5, sizeof(uint32_t) * 5, sizeof(uint32_t));
         compute_entries[6] = vk::SpecializationMapEntry(6, sizeof(uint32_t) * 6, sizeof(uint32_t));
-        std::array<uint32_t, 7> compute_entries_data{segment_count, samples_per_segment, vertices_per_sample, indices_per_segment, player_start_idx, player_idx_count, player_segment_position};
+        compute_entries[7] = vk::SpecializationMapEntry(7, sizeof(uint32_t) * 7, sizeof(uint32_t));
+        compute_entries[8] = vk::SpecializationMapEntry(8, sizeof(uint32_t) * 8, sizeof(uint32_t));
+        std::array<uint32_t, 9> compute_entries_data{segment_count, samples_per_segment, vertices_per_sample, indices_per_segment, player_start_idx, player_idx_count, player_segment_position, compact_tunnel_vertices, 0};
         vk::SpecializationInfo compute_spec_info(compute_entries.size(), compute_entries.data(), compute_entries_data.size() * sizeof(uint32_t), compute_entries_data.data());
         compute_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"player_tunnel_collision.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(uint32_t));
+        broad_phase_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"player_tunnel_collision_broad_phase.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(uint32_t));
+        compute_entries_data[8] = 1;
+        narrow_phase_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"player_tunnel_collision.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(uint32_t));
+        ray_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"player_collision_rays.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(CollisionRayPushConstants));
     }
 
     void CollisionHandler::self_destruct(bool full)
     {
         render_pipeline.self_destruct();
         compute_pipeline.self_destruct();
+        broad_phase_pipeline.self_destruct();
+        narrow_phase_pipeline.self_destruct();
+        ray_pipeline.self_destruct();
         if (full)
         {
             compute_dsh.self_destruct();
             storage.get_buffer(bb_buffer).self_destruct();
             for (auto& b : return_buffers) storage.get_buffer(b).self_destruct();
             return_buffers.clear();
+            for (auto& b : candidate_buffers) storage.get_buffer(b).self_destruct();
+            candidate_buffers.clear();
+            for (auto& b : ray_hit_buffers) storage.get_buffer(b).self_destruct();
+            ray_hit_buffers.clear();
+            prev_player_m.reset();
             storage.get_buffer(vertex_buffer).self_destruct();
         }
     }
@@ -148,17 +175,45 @@ namespace ve
         cb.draw(36, 1, 0, 0);
     }
 
-    void CollisionHandler::compute(GameState& gs, DeviceTimer& timer)
+    void CollisionHandler::compute(GameState& gs, DeviceTimer& timer, const glm::mat4& player_m)
     {
         vk::CommandBuffer& cb = vcc.begin(vcc.compute_cb[gs.current_frame + frames_in_flight]);
         timer.reset(cb, {DeviceTimer::COMPUTE_PLAYER_TUNNEL_COLLISION});
         timer.start(cb, DeviceTimer::COMPUTE_PLAYER_TUNNEL_COLLISION, vk::PipelineStageFlagBits::eAllCommands);
-        cb.bindPipeline(vk::PipelineBindPoint::eCompute, compute_pipeline.get());
-        cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, compute_pipeline.get_layout(), 0, compute_dsh.get_sets()[gs.current_frame], {});
-        cb.pushConstants(compute_pipeline.get_layout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(uint32_t), &gs.first_segment_indices_idx);
-        cb.dispatch(((indices_per_segment * 2) / 3 + 31) / 32, 1, 1);
+        if (gs.collision_mode == collision_mode_ray_queries)
+        {
+            // the top level acceleration structure was built by the compute command buffer of the frame that is submitted before this one
+            vk::MemoryBarrier memory_barrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR);
+            cb.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eComputeShader, {}, {memory_barrier}, {}, {});
+            CollisionRayPushConstants crpc{.prev_m = prev_player_m.value_or(player_m), .first_segment_slot = gs.first_segment_slot};
+            cb.bindPipeline(vk::PipelineBindPoint::eCompute, ray_pipeline.get());
+            cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, ray_pipeline.get_layout(), 0, compute_dsh.get_sets()[gs.current_frame], {});
+            cb.pushConstants(ray_pipeline.get_layout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(CollisionRayPushConstants), &crpc);
+            cb.dispatch((collision_ray_count + 31) / 32, 1, 1);
+        }
+        else if (gs.collision_mode == collision_mode_broad_phase)
+        {
+            cb.bindPipeline(vk::PipelineBindPoint::eCompute, broad_phase_pipeline.get());
+            cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, broad_phase_pipeline.get_layout(), 0, compute_dsh.get_sets()[gs.current_frame], {});
+            cb.pushConstants(broad_phase_pipeline.get_layout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(uint32_t), &gs.first_segment_slot);
+            cb.dispatch(1, 1, 1);
+            vk::MemoryBarrier memory_barrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead);
+            cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eComputeShader, {}, {memory_barrier}, {}, {});
+            cb.bindPipeline(vk::PipelineBindPoint::eCompute, narrow_phase_pipeline.get());
+            cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, narrow_phase_pipeline.get_layout(), 0, compute_dsh.get_sets()[gs.current_frame], {});
+            cb.pushConstants(narrow_phase_pipeline.get_layout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(uint32_t), &gs.first_segment_slot);
+            cb.dispatchIndirect(storage.get_buffer(candidate_buffers[gs.current_frame]).get(), offsetof(PlayerCollisionCandidates, dispatch));
+        }
+        else
+        {
+            cb.bindPipeline(vk::PipelineBindPoint::eCompute, compute_pipeline.get());
+            cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, compute_pipeline.get_layout(), 0, compute_dsh.get_sets()[gs.current_frame], {});
+            cb.pushConstants(compute_pipeline.get_layout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(uint32_t), &gs.first_segment_slot);
+            cb.dispatch(((indices_per_segment * 2) / 3 + 31) / 32, 1, 1);
+        }
         timer.stop(cb, DeviceTimer::COMPUTE_PLAYER_TUNNEL_COLLISION, vk::PipelineStageFlagBits::eComputeShader);
         cb.end();
+        prev_player_m = player_m;
     }
 
     int32_t CollisionHandler::get_shader_return_value(uint32_t frame_idx)
@@ -166,6 +221,21 @@ namespace ve
         return storage.get_buffer(return_buffers[frame_idx]).obtain_first_element<int32_t>();
     }
 
+    uint32_t CollisionHandler::get_candidate_triangle_count(uint32_t frame_idx)
+    {
+        return storage.get_buffer(candidate_buffers[frame_idx]).obtain_first_element<PlayerCollisionCandidates>().triangle_count;
+    }
+
+    CollisionRayHit CollisionHandler::get_closest_ray_hit(uint32_t frame_idx)
+    {
+        CollisionRayHit closest{glm::vec3(0.0f), -1.0f};
+        for (const CollisionRayHit& hit : storage.get_buffer(ray_hit_buffers[frame_idx]).obtain_all_data<CollisionRayHit>())
+        {
+            if (hit.t >= 0.0f && (closest.t < 0.0f || hit.t < closest.t)) closest = hit;
+        }
+        return closest;
+    }
+
     void CollisionHandler::reset_shader_return_values(uint32_t frame_idx)
     {
         storage.get_buffer(return_buffers[frame_idx]).update_data(0);
@@ -3,7 +3,7 @@
 
 namespace ve
 {
-    Fireflies::Fireflies(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : render_dsh(vmc), compute_dsh(vmc), vmc(vmc), vcc(vcc), storage(storage), render_pipeline(vmc), move_compute_pipeline(vmc), tunnel_collision_compute_pipeline(vmc)
+    Fireflies::Fireflies(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : render_dsh(vmc), compute_dsh(vmc), vmc(vmc), vcc(vcc), storage(storage), render_pipeline(vmc), move_compute_pipeline(vmc), tunnel_collision_compute_pipeline(vmc), irradiance_cache_compute_pipeline(vmc)
     {}
 
     void Fireflies::self_destruct(bool full)
@@ -11,12 +11,15 @@ namespace ve
         render_pipeline.self_destruct();
         move_compute_pipeline.self_destruct();
         tunnel_collision_compute_pipeline.self_destruct();
+        irradiance_cache_compute_pipeline.self_destruct();
         if (full)
         {
             render_dsh.self_destruct();
             compute_dsh.self_destruct();
             for (auto i : vertex_buffers) storage.destroy_buffer(i);
             vertex_buffers.clear();
+            for (auto i : irradiance_cache_buffers) storage.destroy_buffer(i);
+            irradiance_cache_buffers.clear();
             for (auto i : model_render_data_buffers) storage.destroy_buffer(i);
             model_render_data_buffers.clear();
         }
@@ -27,6 +30,11 @@ namespace ve
         std::vector<FireflyVertex> vertices(firefly_count);
         vertex_buffers.push_back(storage.add_named_buffer(std::string("firefly_vertices_0"), vertices, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute));
         vertex_buffers.push_back(storage.add_named_buffer(std::string("firefly_vertices_1"), vertices, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute));
+        std::vector<glm::vec4> irradiance_cache(segment_count * irradiance_cache_rings * irradiance_cache_angles, glm::vec4(0.0f));
+        for (uint32_t i = 0; i < frames_in_flight; ++i)
+        {
+            irradiance_cache_buffers.push_back(storage.add_named_buffer("firefly_irradiance_cache_" + std::to_string(i), irradiance_cache, vk::BufferUsageFlagBits::eStorageBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute));
+        }
     }
 
     void Fireflies::construct(const RenderPass& render_pass)
@@ -35,10 +43,11 @@ namespace ve
         compute_dsh.add_binding(0, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(1, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
-        compute_dsh.add_binding(4, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(5, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(6, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(7, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(8, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(9, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
 
         // add one uniform buffer and descriptor set for each frame as the uniform buffer is changed in every frame
         for (uint32_t i = 0; i < frames_in_flight; ++i)
@@ -53,10 +62,11 @@ namespace ve
             compute_dsh.add_descriptor(0, storage.get_buffer(vertex_buffers[1 - i]));
             compute_dsh.add_descriptor(1, storage.get_buffer(vertex_buffers[i]));
             compute_dsh.add_descriptor(3, storage.get_buffer_by_name("tunnel_bezier_points"));
-            compute_dsh.add_descriptor(4, storage.get_buffer_by_name("tunnel_indices"));
             compute_dsh.add_descriptor(5, storage.get_buffer_by_name("tunnel_vertices"));
             compute_dsh.add_descriptor(6, storage.get_buffer_by_name("player_bb"));
             compute_dsh.add_descriptor(7, storage.get_buffer_by_name("bb_mm_" + std::to_string(i)));
+            compute_dsh.add_descriptor(8, storage.get_buffer_by_name("tunnel_segment_uids"));
+            compute_dsh.add_descriptor(9, storage.get_buffer(irradiance_cache_buffers[i]));
         }
         render_dsh.construct();
         compute_dsh.construct();
@@ -76,18 +86,22 @@ namespace ve
         shader_infos[1] = ShaderInfo{"fireflies.frag", vk::ShaderStageFlagBits::eFragment};
         render_pipeline.construct(render_pass, render_dsh.get_layouts()[0], shader_infos, vk::PolygonMode::ePoint, FireflyVertex::get_binding_descriptions(), FireflyVertex::get_attribute_descriptions(), vk::PrimitiveTopology::ePointList);
 
-        std::array<vk::SpecializationMapEntry, 6> compute_entries;
+        std::array<vk::SpecializationMapEntry, 9> compute_entries;
         compute_entries[0] = vk::SpecializationMapEntry(0, 0, sizeof(uint32_t));
         compute_entries[1] = vk::SpecializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t));
         compute_entries[2] = vk::SpecializationMapEntry(2, sizeof(uint32_t) * 2, sizeof(uint32_t));
         compute_entries[3] = vk::SpecializationMapEntry(3, sizeof(uint32_t) * 3, sizeof(uint32_t));
         compute_entries[4] = vk::SpecializationMapEntry(4, sizeof(uint32_t) * 4, sizeof(uint32_t));
         compute_entries[5] = vk::SpecializationMapEntry(5, sizeof(uint32_t) * 5, sizeof(uint32_t));
-        std::array<uint32_t, 6> compute_entries_data{segment_count, samples_per_segment, vertices_per_sample, fireflies_per_segment, firefly_count, indices_per_segment};
+        compute_entries[6] = vk::SpecializationMapEntry(6, sizeof(uint32_t) * 6, sizeof(uint32_t));
+        compute_entries[7] = vk::SpecializationMapEntry(7, sizeof(uint32_t) * 7, sizeof(uint32_t));
+        compute_entries[8] = vk::SpecializationMapEntry(8, sizeof(uint32_t) * 8, sizeof(uint32_t));
+        std::array<uint32_t, 9> compute_entries_data{segment_count, samples_per_segment, vertices_per_sample, fireflies_per_segment, firefly_count, indices_per_segment, compact_tunnel_vertices, irradiance_cache_rings, irradiance_cache_angles};
         vk::SpecializationInfo compute_spec_info(compute_entries.size(), compute_entries.data(), compute_entries_data.size() * sizeof(uint32_t), compute_entries_data.data());
 
         move_compute_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"fireflies_move.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(FireflyMovePushConstants));
         tunnel_collision_compute_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"fireflies_tunnel_collision.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(FireflyMovePushConstants));
+        irradiance_cache_compute_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"fireflies_irradiance_cache.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(FireflyMovePushConstants));
     }
 
     void Fireflies::reload_shaders(const RenderPass& render_pass)
@@ -127,4 +141,18 @@ namespace ve
         cb.dispatch((firefly_count + 31) / 32, ((indices_per_segment / 3) + 31) / 32, 1);
         timer.stop(cb, DeviceTimer::FIREFLY_MOVE_STEP, vk::PipelineStageFlagBits::eComputeShader);
     }
+
+    void Fireflies::update_irradiance_cache(vk::CommandBuffer& cb, const GameState& gs, DeviceTimer& timer, FireflyMovePushConstants& fmpc)
+    {
+        timer.reset(cb, {DeviceTimer::COMPUTE_IRRADIANCE_CACHE});
+        timer.start(cb, DeviceTimer::COMPUTE_IRRADIANCE_CACHE, vk::PipelineStageFlagBits::eAllCommands);
+        // the fireflies were moved by the collision pass and new ones may have been spawned with the bézier points of a new segment
+        vk::MemoryBarrier memory_barrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eShaderRead);
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlagBits::eDeviceGroup, {memory_barrier}, {}, {});
+        cb.bindPipeline(vk::PipelineBindPoint::eCompute, irradiance_cache_compute_pipeline.get());
+        cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, irradiance_cache_compute_pipeline.get_layout(), 0, compute_dsh.get_sets()[gs.current_frame], {});
+        cb.pushConstants(irradiance_cache_compute_pipeline.get_layout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(FireflyMovePushConstants), &fmpc);
+        cb.dispatch((segment_count * irradiance_cache_rings * irradiance_cache_angles + 31) / 32, 1, 1);
+        timer.stop(cb, DeviceTimer::COMPUTE_IRRADIANCE_CACHE, vk::PipelineStageFlagBits::eComputeShader);
+    }
 } // namespace ve
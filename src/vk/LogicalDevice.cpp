@@ -1,5 +1,8 @@
 #include "vk/LogicalDevice.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <optional>
 #include <set>
 
@@ -14,14 +17,16 @@ namespace ve
     {
         std::vector<vk::DeviceQueueCreateInfo> qci_s;
         std::set<uint32_t> unique_queue_families = {queue_family_indices.graphics, queue_family_indices.compute, queue_family_indices.transfer, queue_family_indices.present};
-        float queue_prio = 1.0f;
+        // the compute family gets a second queue with lower priority for background work like segment prefetching if available
+        const std::array<float, 2> queue_prios = {1.0f, 0.5f};
+        const uint32_t compute_queue_count = std::min(uint32_t(queue_prios.size()), p_device.get().getQueueFamilyProperties()[queue_family_indices.compute].queueCount);
         for (uint32_t queue_family : unique_queue_families)
         {
             vk::DeviceQueueCreateInfo qci{};
             qci.sType = vk::StructureType::eDeviceQueueCreateInfo;
             qci.queueFamilyIndex = queue_family;
-            qci.queueCount = 1;
-            qci.pQueuePriorities = &queue_prio;
+            qci.queueCount = queue_family == queue_family_indices.compute ? compute_queue_count : 1;
+            qci.pQueuePriorities = queue_prios.data();
             qci_s.push_back(qci);
         }
 
@@ -31,10 +36,16 @@ namespace ve
         vk::PhysicalDeviceAccelerationStructureFeaturesKHR as_features;
         as_features.pNext = &rq_features;
         as_features.accelerationStructure = VK_TRUE;
+        // builds on the host are optional and only used with the deferred host operations extension to run them on worker threads
+        const auto supported_features = p_device.get().getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceAccelerationStructureFeaturesKHR>();
+        const bool deferred_host_operations = std::any_of(p_device.get_extensions().begin(), p_device.get_extensions().end(), [](const char* name) { return std::strcmp(name, VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME) == 0; });
+        acceleration_structure_host_commands = deferred_host_operations && supported_features.get<vk::PhysicalDeviceAccelerationStructureFeaturesKHR>().accelerationStructureHostCommands;
+        as_features.accelerationStructureHostCommands = acceleration_structure_host_commands;
 
         vk::PhysicalDeviceVulkan12Features device_features_12;
         device_features_12.pNext = &as_features;
         device_features_12.bufferDeviceAddress = VK_TRUE;
+        device_features_12.drawIndirectCount = VK_TRUE;
 
         vk::PhysicalDeviceVulkan13Features device_features_13;
         device_features_13.pNext = &device_features_12;
@@ -46,6 +57,8 @@ namespace ve
         core_device_features.fillModeNonSolid = VK_TRUE;
         core_device_features.fragmentStoresAndAtomics = VK_TRUE;
         core_device_features.wideLines = VK_TRUE;
+        core_device_features.multiDrawIndirect = VK_TRUE;
+        core_device_features.drawIndirectFirstInstance = VK_TRUE;
 
         vk::PhysicalDeviceFeatures2 device_features;
         device_features.pNext = &device_features_13;
@@ -62,6 +75,7 @@ namespace ve
         device = p_device.get().createDevice(dci);
         queues.emplace(QueueIndex::Graphics, device.getQueue(queue_family_indices.graphics, 0));
         queues.emplace(QueueIndex::Compute, device.getQueue(queue_family_indices.compute, 0));
+        queues.emplace(QueueIndex::AsyncCompute, device.getQueue(queue_family_indices.compute, compute_queue_count - 1));
         queues.emplace(QueueIndex::Transfer, device.getQueue(queue_family_indices.transfer, 0));
         queues.emplace(QueueIndex::Present, device.getQueue(queue_family_indices.present, 0));
         VULKAN_HPP_DEFAULT_DISPATCHER.init(device);
@@ -76,4 +90,9 @@ namespace ve
     {
         return device;
     }
+
+    bool LogicalDevice::supports_acceleration_structure_host_commands() const
+    {
+        return acceleration_structure_host_commands;
+    }
 } // namespace ve
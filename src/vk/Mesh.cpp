@@ -7,7 +7,7 @@ namespace ve
 
     void Mesh::draw(vk::CommandBuffer& cb, const vk::PipelineLayout layout, const std::vector<vk::DescriptorSet>& sets, GameState& gs)
     {
-        PushConstants pc{.mesh_render_data_idx = mesh_render_data_idx, .first_segment_indices_idx = gs.first_segment_indices_idx, .time = gs.time, .tex_view = gs.tex_view};
+        PushConstants pc{.mesh_render_data_idx = mesh_render_data_idx, .first_segment_slot = gs.first_segment_slot, .time = gs.time, .tex_view = gs.tex_view};
         cb.pushConstants(layout, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment, 0, sizeof(PushConstants), &pc);
         cb.drawIndexed(index_count, 1, index_offset, 0, 0);
     }
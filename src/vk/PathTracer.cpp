@@ -1,8 +1,17 @@
 #include "vk/PathTracer.hpp"
 
+#include <algorithm>
+#include <thread>
+
+#include "Parallel.hpp"
+
 namespace ve 
 {
-    PathTracer::PathTracer(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : vmc(vmc), vcc(vcc), storage(storage) {}
+    PathTracer::PathTracer(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : vmc(vmc), vcc(vcc), storage(storage)
+    {
+        auto properties = vmc.physical_device.get().getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
+        scratch_alignment = properties.get<vk::PhysicalDeviceAccelerationStructurePropertiesKHR>().minAccelerationStructureScratchOffsetAlignment;
+    }
 
     void PathTracer::self_destruct()
     {
@@ -10,39 +19,86 @@ namespace ve
         {
             vmc.logical_device.get().destroyAccelerationStructureKHR(topLevelAS[i].handle);
             storage.destroy_buffer(topLevelAS[i].buffer);
-            storage.destroy_buffer(topLevelAS[i].scratch_buffer);
             storage.destroy_buffer(instances_buffer[i]);
+            if (scratch_arenas[i].buffer != uint32_t(-1)) storage.destroy_buffer(scratch_arenas[i].buffer);
+            scratch_arenas[i] = ScratchArena();
+            for (uint32_t buffer : retired_scratch_buffers[i]) storage.destroy_buffer(buffer);
+            retired_scratch_buffers[i].clear();
 
             for (auto& blas : bottomLevelAS[i])
             {
-                vmc.logical_device.get().destroyAccelerationStructureKHR(blas.handle);
-                storage.destroy_buffer(blas.buffer);
-                storage.destroy_buffer(blas.scratch_buffer);
+                if (owns_blas(i, blas)) destroy_blas(blas);
             }
             bottomLevelAS[i].clear();
+            for (auto& blas : retired_blas[i]) destroy_blas(blas);
+            retired_blas[i].clear();
         }
+        if (compaction_query_pool) vmc.logical_device.get().destroyQueryPool(compaction_query_pool);
+        compaction_query_pool = nullptr;
+        compaction_query_count = 0;
+        blas_names.clear();
+        host_blas_batch.clear();
+        compaction_saved_bytes = 0;
+        dedicated_scratch_bytes = 0;
     }
 
-    void PathTracer::create_blas(vk::CommandBuffer& cb, uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, vk::DeviceSize vertex_stride, BottomLevelAccelerationStructure& blas)
+    void PathTracer::destroy_blas(BottomLevelAccelerationStructure& blas)
     {
-        Buffer& vertex_buffer = storage.get_buffer(vertex_buffer_id);
-        Buffer& index_buffer = storage.get_buffer(index_buffer_id);
+        vmc.logical_device.get().destroyAccelerationStructureKHR(blas.handle);
+        storage.destroy_buffer(blas.buffer);
+    }
 
-        vk::DeviceOrHostAddressConstKHR vertex_buffer_device_adress(vertex_buffer.get_device_address());
-        vk::DeviceOrHostAddressConstKHR index_buffer_device_adress(index_buffer.get_device_address());
+    bool PathTracer::owns_blas(uint32_t frame_idx, const BottomLevelAccelerationStructure& blas) const
+    {
+        // shared acceleration structures only exist in the list of the first frame
+        return frame_idx == 0 || !blas.shared;
+    }
 
+    const BottomLevelAccelerationStructure& PathTracer::get_blas(uint32_t frame_idx, uint32_t blas_idx) const
+    {
+        return bottomLevelAS[owns_blas(frame_idx, bottomLevelAS[frame_idx][blas_idx]) ? frame_idx : 0][blas_idx];
+    }
+
+    void PathTracer::release_retired(uint32_t frame_idx)
+    {
+        // the last submission of this frame finished before its command buffer is recorded again
+        for (auto& blas : retired_blas[frame_idx]) destroy_blas(blas);
+        retired_blas[frame_idx].clear();
+        for (uint32_t buffer : retired_scratch_buffers[frame_idx]) storage.destroy_buffer(buffer);
+        retired_scratch_buffers[frame_idx].clear();
+    }
+
+    vk::DeviceAddress PathTracer::reserve_scratch(uint32_t arena_idx, vk::DeviceSize size)
+    {
+        ScratchArena& arena = scratch_arenas[arena_idx];
+        if (size > arena.size)
+        {
+            // builds recorded before into the same command buffer may still use the old buffer
+            if (arena.buffer != uint32_t(-1)) retired_scratch_buffers[arena_idx].push_back(arena.buffer);
+            // the start of the buffer is only guaranteed to be aligned for storage buffers; unnamed as the retired buffer of the arena may still exist
+            arena.buffer = storage.add_buffer(size + scratch_alignment, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress, true, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
+            arena.size = size;
+            arena.address = align_scratch(storage.get_buffer(arena.buffer).get_device_address());
+        }
+        return arena.address;
+    }
+
+    vk::DeviceSize PathTracer::align_scratch(vk::DeviceSize size) const
+    {
+        return (size + scratch_alignment - 1) / scratch_alignment * scratch_alignment;
+    }
+
+    std::vector<uint32_t> PathTracer::add_geometries(BLASBuild& build, vk::DeviceOrHostAddressConstKHR vertices, uint32_t vertex_count, vk::DeviceSize vertex_stride, vk::DeviceOrHostAddressConstKHR indices, vk::IndexType index_type, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, const std::vector<uint32_t>& first_vertices) const
+    {
         std::vector<uint32_t> num_triangles;
-        std::vector<vk::AccelerationStructureBuildRangeInfoKHR> asbris;
-        std::vector<vk::AccelerationStructureBuildRangeInfoKHR*> pasbris;
-        std::vector<vk::AccelerationStructureGeometryKHR> asgs;
         for (uint32_t i = 0; i < index_offsets.size(); ++i)
         {
             vk::AccelerationStructureBuildRangeInfoKHR asbri{};
             asbri.primitiveCount = index_counts[i] / 3;
-            asbri.primitiveOffset = sizeof(uint32_t) * index_offsets[i];
-            asbri.firstVertex = 0;
+            asbri.primitiveOffset = (index_type == vk::IndexType::eUint16 ? sizeof(uint16_t) : sizeof(uint32_t)) * index_offsets[i];
+            asbri.firstVertex = first_vertices.empty() ? 0 : first_vertices[i];
             asbri.transformOffset = 0;
-            asbris.push_back(asbri);
+            build.ranges.push_back(asbri);
             num_triangles.push_back(asbri.primitiveCount);
 
             vk::AccelerationStructureGeometryKHR asg{};
@@ -50,98 +106,436 @@ namespace ve
             asg.geometryType = vk::GeometryTypeKHR::eTriangles;
             asg.geometry.triangles.sType = vk::StructureType::eAccelerationStructureGeometryTrianglesDataKHR;
             asg.geometry.triangles.vertexFormat = vk::Format::eR32G32B32Sfloat;
-            asg.geometry.triangles.vertexData = vertex_buffer_device_adress;
-            asg.geometry.triangles.maxVertex = vertex_buffer.get_element_count();
+            asg.geometry.triangles.vertexData = vertices;
+            asg.geometry.triangles.maxVertex = vertex_count;
             asg.geometry.triangles.vertexStride = vertex_stride;
-            asg.geometry.triangles.indexType = vk::IndexType::eUint32;
-            asg.geometry.triangles.indexData = index_buffer_device_adress;
+            asg.geometry.triangles.indexType = index_type;
+            asg.geometry.triangles.indexData = indices;
             asg.geometry.triangles.transformData.deviceAddress = 0;
             asg.geometry.triangles.transformData.hostAddress = nullptr;
-            asgs.push_back(asg);
+            build.geometries.push_back(asg);
         }
-        pasbris.push_back(asbris.data());
+        return num_triangles;
+    }
 
-        vk::AccelerationStructureBuildGeometryInfoKHR asbgi{};
-        asbgi.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
-        asbgi.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
-        asbgi.mode = vk::BuildAccelerationStructureModeKHR::eBuild;
-        asbgi.geometryCount = asgs.size();
-        asbgi.pGeometries = asgs.data();
+    void PathTracer::create_blas(BottomLevelAccelerationStructure& blas, vk::DeviceSize size, bool device_local)
+    {
+        blas.buffer = storage.add_buffer(size, vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR, device_local, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
+
+        vk::AccelerationStructureCreateInfoKHR asci{};
+        asci.sType = vk::StructureType::eAccelerationStructureCreateInfoKHR;
+        asci.buffer = storage.get_buffer(blas.buffer).get();
+        asci.size = size;
+        asci.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+        blas.handle = vmc.logical_device.get().createAccelerationStructureKHR(asci);
+
+        vk::AccelerationStructureDeviceAddressInfoKHR asdai{};
+        asdai.sType = vk::StructureType::eAccelerationStructureDeviceAddressInfoKHR;
+        asdai.accelerationStructure = blas.handle;
+        blas.deviceAddress = vmc.logical_device.get().getAccelerationStructureAddressKHR(&asdai);
+    }
 
-        if (!blas.is_built)
-        {
-            vk::AccelerationStructureBuildSizesInfoKHR asbsi = vmc.logical_device.get().getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, asbgi, num_triangles);
+    PathTracer::BLASBuild PathTracer::prepare_blas_build(const BLASBuildInfo& b, uint32_t frame_idx)
+    {
+        BottomLevelAccelerationStructure& blas = bottomLevelAS[frame_idx][b.blas_idx];
+        VE_ASSERT(!b.refit || (blas.is_built && blas.allow_update), "Trying to refit a bottom level acceleration structure that was not built with eAllowUpdate!");
+        VE_ASSERT(!blas.is_built || !blas.compact, "Trying to build a compacted bottom level acceleration structure again!");
+        Buffer& vertex_buffer = storage.get_buffer(b.vertex_buffer_id);
+        Buffer& index_buffer = storage.get_buffer(b.index_buffer_id);
 
-            blas.buffer = storage.add_buffer(asbsi.accelerationStructureSize, vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR, true, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
+        vk::DeviceOrHostAddressConstKHR vertex_buffer_device_adress(vertex_buffer.get_device_address());
+        vk::DeviceOrHostAddressConstKHR index_buffer_device_adress(index_buffer.get_device_address());
 
-            vk::AccelerationStructureCreateInfoKHR asci{};
-            asci.sType = vk::StructureType::eAccelerationStructureCreateInfoKHR;
-            asci.buffer = storage.get_buffer(blas.buffer).get();
-            asci.size = asbsi.accelerationStructureSize;
-            asci.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
-            blas.handle = vmc.logical_device.get().createAccelerationStructureKHR(asci);
+        BLASBuild build{.frame_idx = frame_idx, .blas_idx = b.blas_idx};
+        std::vector<uint32_t> num_triangles = add_geometries(build, vertex_buffer_device_adress, vertex_buffer.get_element_count(), b.vertex_stride, index_buffer_device_adress, b.index_type, b.index_offsets, b.index_counts, b.first_vertices);
 
-            vk::AccelerationStructureDeviceAddressInfoKHR asdai{};
-            asdai.sType = vk::StructureType::eAccelerationStructureDeviceAddressInfoKHR;
-            asdai.accelerationStructure = blas.handle;
+        vk::AccelerationStructureBuildGeometryInfoKHR& asbgi = build.info;
+        asbgi.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+        // an update has to use the same flags as the build it refits
+        asbgi.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+        if (blas.allow_update) asbgi.flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+        if (blas.compact) asbgi.flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+        asbgi.mode = b.refit ? vk::BuildAccelerationStructureModeKHR::eUpdate : vk::BuildAccelerationStructureModeKHR::eBuild;
+        asbgi.geometryCount = build.geometries.size();
+        asbgi.pGeometries = build.geometries.data();
+
+        // the acceleration structure is created when it is added, so instances can reference it before its build is recorded
+        if (!blas.handle)
+        {
+            vk::AccelerationStructureBuildSizesInfoKHR asbsi = vmc.logical_device.get().getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, asbgi, num_triangles);
 
-            blas.deviceAddress = vmc.logical_device.get().getAccelerationStructureAddressKHR(&asdai);
+            create_blas(blas, asbsi.accelerationStructureSize, true);
 
-            blas.scratch_buffer = storage.add_buffer(asbsi.buildScratchSize, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress, true, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute); 
+            // the scratch memory comes from the arena when the build is recorded
+            blas.scratch_size = std::max(asbsi.buildScratchSize, asbsi.updateScratchSize);
+            dedicated_scratch_bytes += blas.scratch_size;
         }
 
+        // in place update, the source is the acceleration structure itself
+        if (b.refit) asbgi.srcAccelerationStructure = blas.handle;
         asbgi.dstAccelerationStructure = blas.handle;
-        asbgi.scratchData.deviceAddress = storage.get_buffer(blas.scratch_buffer).get_device_address();
-        std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> asbgis{};
-        asbgis.push_back(asbgi);
+        return build;
+    }
 
+    void PathTracer::record_blas_builds(vk::CommandBuffer& cb, std::vector<BLASBuild>& builds, uint32_t arena_idx)
+    {
+        if (builds.empty()) return;
+        // builds of the same command must not share scratch memory, so every one gets its own aligned range of the arena
+        vk::DeviceSize scratch_size = 0;
+        for (const BLASBuild& build : builds) scratch_size += align_scratch(bottomLevelAS[build.frame_idx][build.blas_idx].scratch_size);
+        vk::DeviceAddress scratch_address = reserve_scratch(arena_idx, scratch_size);
+        std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> asbgis;
+        std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> pasbris;
+        for (BLASBuild& build : builds)
+        {
+            // the geometries may have moved since the build was prepared
+            build.info.pGeometries = build.geometries.data();
+            build.info.scratchData.deviceAddress = scratch_address;
+            scratch_address += align_scratch(bottomLevelAS[build.frame_idx][build.blas_idx].scratch_size);
+            asbgis.push_back(build.info);
+            pasbris.push_back(build.ranges.data());
+        }
         cb.buildAccelerationStructuresKHR(asbgis, pasbris);
-        vk::BufferMemoryBarrier buffer_memory_barrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR, vmc.queue_family_indices.compute, vmc.queue_family_indices.compute, storage.get_buffer(blas.buffer).get(), 0, storage.get_buffer(blas.buffer).get_byte_size());
-        cb.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::DependencyFlagBits::eDeviceGroup, {}, {buffer_memory_barrier}, {});
-        blas.is_built = true;
+        // the next build may reuse the scratch memory, so its writes have to wait for this build as well
+        vk::MemoryBarrier memory_barrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, {memory_barrier}, {}, {});
+
+        // the compacted size is only known after the build, compact_blas reads it once it is available
+        const uint32_t first_query = compaction_query_count;
+        std::vector<vk::AccelerationStructureKHR> compacted_handles;
+        for (const BLASBuild& build : builds)
+        {
+            BottomLevelAccelerationStructure& blas = bottomLevelAS[build.frame_idx][build.blas_idx];
+            if (blas.compact)
+            {
+                VE_ASSERT(compaction_query_count < max_compaction_queries, "Too many compacted bottom level acceleration structures!");
+                blas.compaction_query = compaction_query_count++;
+                compacted_handles.push_back(blas.handle);
+            }
+            blas.is_built = true;
+        }
+        if (compacted_handles.empty()) return;
+        if (!compaction_query_pool)
+        {
+            vk::QueryPoolCreateInfo qpci{};
+            qpci.sType = vk::StructureType::eQueryPoolCreateInfo;
+            qpci.queryType = vk::QueryType::eAccelerationStructureCompactedSizeKHR;
+            qpci.queryCount = max_compaction_queries;
+            compaction_query_pool = vmc.logical_device.get().createQueryPool(qpci);
+        }
+        cb.resetQueryPool(compaction_query_pool, first_query, compacted_handles.size());
+        cb.writeAccelerationStructuresPropertiesKHR(compacted_handles, vk::QueryType::eAccelerationStructureCompactedSizeKHR, compaction_query_pool, first_query);
+    }
+
+    uint32_t PathTracer::add_blas(vk::CommandBuffer& cb, uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, vk::DeviceSize vertex_stride, const std::vector<uint32_t>& first_vertices, vk::IndexType index_type, bool allow_update, bool compact, const std::string& name) 
+    {
+        std::vector<BLASBuild> builds;
+        const uint32_t blas_idx = push_blas(BLASBuildInfo{vertex_buffer_id, index_buffer_id, index_offsets, index_counts, vertex_stride, uint32_t(bottomLevelAS[0].size()), first_vertices, index_type, false}, allow_update, compact, name, builds);
+        // acceleration structures are added while loading, when the submissions are waited for, so the arena of the first frame is free
+        record_blas_builds(cb, builds, 0);
+        return blas_idx;
+    }
+
+    uint32_t PathTracer::add_blas_to_batch(uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, vk::DeviceSize vertex_stride, const std::vector<uint32_t>& first_vertices, vk::IndexType index_type, bool allow_update, bool compact, const std::string& name)
+    {
+        return push_blas(BLASBuildInfo{vertex_buffer_id, index_buffer_id, index_offsets, index_counts, vertex_stride, uint32_t(bottomLevelAS[0].size()), first_vertices, index_type, false}, allow_update, compact, name, blas_batch);
+    }
+
+    void PathTracer::build_blas_batch(vk::CommandBuffer& cb)
+    {
+        record_blas_builds(cb, blas_batch, 0);
+        blas_batch.clear();
+    }
+
+    bool PathTracer::supports_host_builds() const
+    {
+        return vmc.logical_device.supports_acceleration_structure_host_commands();
+    }
+
+    uint32_t PathTracer::add_host_blas_to_batch(const void* vertices, uint32_t vertex_count, vk::DeviceSize vertex_stride, const uint32_t* indices, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, const std::string& name)
+    {
+        VE_ASSERT(supports_host_builds(), "Device does not support building acceleration structures on the host!");
+        const uint32_t blas_idx = bottomLevelAS[0].size();
+        blas_names.push_back(name);
+        for (uint32_t i = 0; i < 2; ++i) bottomLevelAS[i].push_back(BottomLevelAccelerationStructure{.compact = true, .shared = true});
+        BottomLevelAccelerationStructure& blas = bottomLevelAS[0][blas_idx];
+
+        BLASBuild build{.frame_idx = 0, .blas_idx = blas_idx};
+        std::vector<uint32_t> num_triangles = add_geometries(build, vk::DeviceOrHostAddressConstKHR(vertices), vertex_count, vertex_stride, vk::DeviceOrHostAddressConstKHR(indices), vk::IndexType::eUint32, index_offsets, index_counts, {});
+        build.info.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+        build.info.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+        build.info.mode = vk::BuildAccelerationStructureModeKHR::eBuild;
+        build.info.geometryCount = build.geometries.size();
+        build.info.pGeometries = build.geometries.data();
+
+        // the host writes the acceleration structure, so it has to be in host visible memory until it is copied to the device
+        vk::AccelerationStructureBuildSizesInfoKHR asbsi = vmc.logical_device.get().getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eHost, build.info, num_triangles);
+        create_blas(blas, asbsi.accelerationStructureSize, false);
+        // host scratch memory is allocated by build_host_blas_batch and does not count as scratch buffer
+        blas.scratch_size = asbsi.buildScratchSize;
+        build.info.dstAccelerationStructure = blas.handle;
+        host_blas_batch.push_back(build);
+        return blas_idx;
+    }
+
+    void PathTracer::build_host_blas_batch(vk::CommandBuffer& cb, uint32_t thread_count)
+    {
+        if (host_blas_batch.empty()) return;
+        const vk::Device& device = vmc.logical_device.get();
+        std::vector<std::vector<uint8_t>> scratch(host_blas_batch.size());
+        std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> asbgis;
+        std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> pasbris;
+        std::vector<vk::AccelerationStructureKHR> handles;
+        for (uint32_t i = 0; i < host_blas_batch.size(); ++i)
+        {
+            BLASBuild& build = host_blas_batch[i];
+            scratch[i].resize(bottomLevelAS[0][build.blas_idx].scratch_size);
+            build.info.pGeometries = build.geometries.data();
+            build.info.scratchData.hostAddress = scratch[i].data();
+            asbgis.push_back(build.info);
+            pasbris.push_back(build.ranges.data());
+            handles.push_back(build.info.dstAccelerationStructure);
+        }
+
+        // the implementation splits the builds into work for every thread that joins the deferred operation
+        vk::DeferredOperationKHR operation = device.createDeferredOperationKHR();
+        vk::Result result = device.buildAccelerationStructuresKHR(operation, asbgis, pasbris);
+        if (result == vk::Result::eOperationDeferredKHR)
+        {
+            if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+            thread_count = std::min(thread_count, device.getDeferredOperationMaxConcurrencyKHR(operation));
+            // a thread returns idle if there is no work left for it, but the operation may not be complete until the other threads returned
+            parallel_for(thread_count, [&](uint32_t) {
+                while (device.deferredOperationJoinKHR(operation) == vk::Result::eThreadIdleKHR) std::this_thread::yield();
+            }, thread_count);
+            result = device.getDeferredOperationResultKHR(operation);
+        }
+        // the implementation may also have built them right away
+        else if (result == vk::Result::eOperationNotDeferredKHR) result = vk::Result::eSuccess;
+        device.destroyDeferredOperationKHR(operation);
+        VE_CHECK(result, "Failed to build acceleration structures on the host!");
+
+        // tracing acceleration structures in host visible memory is slow, so they are copied to device local memory
+        // the builds are complete, so the compacted sizes are known without a query pool and the copies can be compacted right away
+        const std::vector<vk::DeviceSize> compacted_sizes = device.writeAccelerationStructuresPropertiesKHR<vk::DeviceSize>(handles, vk::QueryType::eAccelerationStructureCompactedSizeKHR, handles.size() * sizeof(vk::DeviceSize), sizeof(vk::DeviceSize));
+        for (uint32_t i = 0; i < host_blas_batch.size(); ++i)
+        {
+            bottomLevelAS[0][host_blas_batch[i].blas_idx].is_built = true;
+            replace_with_compacted(cb, 0, host_blas_batch[i].blas_idx, compacted_sizes[i]);
+        }
+        vk::MemoryBarrier memory_barrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR);
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, {memory_barrier}, {}, {});
+        mark_tlas(TLASUpdate::Build);
+        host_blas_batch.clear();
     }
 
-    uint32_t PathTracer::add_blas(vk::CommandBuffer& cb, uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, vk::DeviceSize vertex_stride) 
+    uint32_t PathTracer::push_blas(const BLASBuildInfo& b, bool allow_update, bool compact, const std::string& name, std::vector<BLASBuild>& builds)
     {
-        bottomLevelAS[0].push_back(BottomLevelAccelerationStructure{});
-        create_blas(cb, vertex_buffer_id, index_buffer_id, index_offsets, index_counts, vertex_stride, bottomLevelAS[0].back());
-        bottomLevelAS[1].push_back(BottomLevelAccelerationStructure{});
-        create_blas(cb, vertex_buffer_id, index_buffer_id, index_offsets, index_counts, vertex_stride, bottomLevelAS[1].back());
-        return bottomLevelAS[0].size() - 1;
+        blas_names.push_back(name);
+        for (uint32_t i = 0; i < 2; ++i)
+        {
+            // compacted acceleration structures are never built again, so the frames in flight can share them
+            bottomLevelAS[i].push_back(BottomLevelAccelerationStructure{.allow_update = allow_update, .compact = compact, .shared = compact});
+            if (owns_blas(i, bottomLevelAS[i].back())) builds.push_back(prepare_blas_build(b, i));
+        }
+        return b.blas_idx;
     }
 
-    void PathTracer::update_blas(uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, uint32_t blas_idx, uint32_t frame_idx, vk::DeviceSize vertex_stride)
+    void PathTracer::update_blas(uint32_t vertex_buffer_id, uint32_t index_buffer_id, const std::vector<uint32_t>& index_offsets, const std::vector<uint32_t>& index_counts, uint32_t blas_idx, uint32_t frame_idx, vk::DeviceSize vertex_stride, const std::vector<uint32_t>& first_vertices, vk::IndexType index_type, bool refit)
     {
-        for (auto& i : bottomLevelAS_dirty_build_info) i.push_back(BLASBuildInfo{vertex_buffer_id, index_buffer_id, index_offsets, index_counts, vertex_stride, blas_idx});
+        for (auto& dirty : bottomLevelAS_dirty_build_info)
+        {
+            // a pending build of the same acceleration structure is replaced as both read the current vertices
+            // the replacement may only be a refit if the pending one was a refit as well, otherwise the geometries could differ from the last build
+            bool pending_rebuild = false;
+            std::vector<BLASBuildInfo> kept;
+            for (const BLASBuildInfo& b : dirty)
+            {
+                if (b.blas_idx == blas_idx) pending_rebuild |= !b.refit;
+                else kept.push_back(b);
+            }
+            kept.push_back(BLASBuildInfo{vertex_buffer_id, index_buffer_id, index_offsets, index_counts, vertex_stride, blas_idx, first_vertices, index_type, refit && !pending_rebuild});
+            dirty.swap(kept);
+        }
     }
 
     uint32_t PathTracer::add_instance(uint32_t blas_idx, const glm::mat4& M, uint32_t custom_index)
     {
         vk::AccelerationStructureInstanceKHR instance;
         instance.transform = std::array<std::array<float, 4>, 3>({std::array<float, 4>({M[0][0], M[0][1], M[0][2], M[0][3]}), std::array<float, 4>({M[1][0], M[1][1], M[1][2], M[1][3]}), std::array<float, 4>({M[2][0], M[2][1], M[2][2], M[2][3]})});
-        instance.accelerationStructureReference = bottomLevelAS[0][blas_idx].deviceAddress;
+        instance.accelerationStructureReference = get_blas(0, blas_idx).deviceAddress;
         instance.instanceCustomIndex = custom_index;
         instance.setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
         instance.mask = 0xFF;
         instances[0].push_back(instance);
-        instance.accelerationStructureReference = bottomLevelAS[1][blas_idx].deviceAddress;
+        instance.accelerationStructureReference = get_blas(1, blas_idx).deviceAddress;
         instances[1].push_back(instance);
+        mark_tlas(TLASUpdate::Build);
         return instances[0].size() - 1;
     }
 
     void PathTracer::update_instance(uint32_t instance_idx, const glm::mat4& M)
     {
-        instances[0][instance_idx].transform = std::array<std::array<float, 4>, 3>({std::array<float, 4>({M[0][0], M[1][0], M[2][0], M[3][0]}), std::array<float, 4>({M[0][1], M[1][1], M[2][1], M[3][1]}), std::array<float, 4>({M[0][2], M[1][2], M[2][2], M[3][2]})});
-        instances[1][instance_idx].transform = std::array<std::array<float, 4>, 3>({std::array<float, 4>({M[0][0], M[1][0], M[2][0], M[3][0]}), std::array<float, 4>({M[0][1], M[1][1], M[2][1], M[3][1]}), std::array<float, 4>({M[0][2], M[1][2], M[2][2], M[3][2]})});
+        const vk::TransformMatrixKHR transform(std::array<std::array<float, 4>, 3>({std::array<float, 4>({M[0][0], M[1][0], M[2][0], M[3][0]}), std::array<float, 4>({M[0][1], M[1][1], M[2][1], M[3][1]}), std::array<float, 4>({M[0][2], M[1][2], M[2][2], M[3][2]})}));
+        // the player is updated every frame, but does not always move
+        if (instances[0][instance_idx].transform == transform) return;
+        instances[0][instance_idx].transform = transform;
+        instances[1][instance_idx].transform = transform;
+        mark_tlas(TLASUpdate::Refit);
+    }
+
+    void PathTracer::set_instance_mask(uint32_t instance_idx, uint8_t mask)
+    {
+        if (instances[0][instance_idx].mask == mask) return;
+        instances[0][instance_idx].mask = mask;
+        instances[1][instance_idx].mask = mask;
+        mark_tlas(TLASUpdate::Refit);
     }
 
-    void PathTracer::create_tlas(vk::CommandBuffer& cb, uint32_t frame_idx)
+    void PathTracer::mark_tlas(TLASUpdate update)
     {
+        for (TLASUpdate& u : tlas_updates) u = std::max(u, update);
+    }
+
+    TLASUpdate PathTracer::get_tlas_update(uint32_t frame_idx) const
+    {
+        if (tlas_updates[frame_idx] == TLASUpdate::Refit && tlas_refit_counts[frame_idx] >= max_tlas_refits) return TLASUpdate::Build;
+        return tlas_updates[frame_idx];
+    }
+
+    bool PathTracer::has_dirty_blas(uint32_t frame_idx) const
+    {
+        return !bottomLevelAS_dirty_build_info[frame_idx].empty();
+    }
+
+    bool PathTracer::has_dirty_blas(uint32_t frame_idx, bool refit) const
+    {
+        return std::any_of(bottomLevelAS_dirty_build_info[frame_idx].begin(), bottomLevelAS_dirty_build_info[frame_idx].end(), [refit](const BLASBuildInfo& b) { return b.refit == refit; });
+    }
+
+    void PathTracer::build_dirty_blas(vk::CommandBuffer& cb, uint32_t frame_idx)
+    {
+        std::vector<BLASBuild> builds;
+        for (const BLASBuildInfo& b : bottomLevelAS_dirty_build_info[frame_idx]) builds.push_back(prepare_blas_build(b, frame_idx));
+        record_blas_builds(cb, builds, frame_idx);
+        // the instances keep their references as the acceleration structures are rebuilt in place, but their bounds changed
+        if (!builds.empty()) tlas_updates[frame_idx] = std::max(tlas_updates[frame_idx], TLASUpdate::Refit);
+        bottomLevelAS_dirty_build_info[frame_idx].clear();
+    }
+
+    void PathTracer::build_dirty_blas(vk::CommandBuffer& cb, uint32_t frame_idx, bool refit)
+    {
+        std::vector<BLASBuild> builds;
+        std::vector<BLASBuildInfo> remaining;
         for (const BLASBuildInfo& b : bottomLevelAS_dirty_build_info[frame_idx])
         {
-            create_blas(cb, b.vertex_buffer_id, b.index_buffer_id, b.index_offsets, b.index_counts, b.vertex_stride, bottomLevelAS[frame_idx][b.blas_idx]);
+            if (b.refit == refit) builds.push_back(prepare_blas_build(b, frame_idx));
+            else remaining.push_back(b);
         }
-        bottomLevelAS_dirty_build_info[frame_idx].clear();
+        record_blas_builds(cb, builds, frame_idx);
+        if (!builds.empty()) tlas_updates[frame_idx] = std::max(tlas_updates[frame_idx], TLASUpdate::Refit);
+        bottomLevelAS_dirty_build_info[frame_idx].swap(remaining);
+    }
+
+    void PathTracer::compact_blas(vk::CommandBuffer& cb, uint32_t frame_idx)
+    {
+        if (!compaction_query_pool) return;
+
+        bool compacted_any = false;
+        bool compacted_shared = false;
+        for (uint32_t i = 0; i < bottomLevelAS[frame_idx].size(); ++i)
+        {
+            BottomLevelAccelerationStructure& blas = bottomLevelAS[frame_idx][i];
+            // shared acceleration structures are compacted by the first frame
+            if (!owns_blas(frame_idx, blas) || blas.compaction_query == uint32_t(-1)) continue;
+            // the query is not waited for, the acceleration structure is compacted in a later frame if the build did not finish yet
+            vk::DeviceSize compacted_size = 0;
+            vk::Result result = vmc.logical_device.get().getQueryPoolResults(compaction_query_pool, blas.compaction_query, 1, sizeof(vk::DeviceSize), &compacted_size, sizeof(vk::DeviceSize), vk::QueryResultFlagBits::e64);
+            if (result != vk::Result::eSuccess) continue;
+
+            compacted_shared |= blas.shared;
+            // a dedicated scratch buffer could have been released now
+            dedicated_scratch_bytes -= blas.scratch_size;
+            replace_with_compacted(cb, frame_idx, i, compacted_size);
+            compacted_any = true;
+        }
+        if (compacted_any)
+        {
+            // also covers the builds of the other frame as it is submitted later to the same queue
+            vk::MemoryBarrier memory_barrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR);
+            cb.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, {memory_barrier}, {}, {});
+            if (compacted_shared) mark_tlas(TLASUpdate::Build);
+            else tlas_updates[frame_idx] = TLASUpdate::Build;
+        }
+    }
+
+    void PathTracer::replace_with_compacted(vk::CommandBuffer& cb, uint32_t frame_idx, uint32_t blas_idx, vk::DeviceSize compacted_size)
+    {
+        BottomLevelAccelerationStructure& blas = bottomLevelAS[frame_idx][blas_idx];
+        BottomLevelAccelerationStructure compacted{.is_built = true, .compact = true, .shared = blas.shared};
+        create_blas(compacted, compacted_size, true);
+
+        vk::CopyAccelerationStructureInfoKHR casi(blas.handle, compacted.handle, vk::CopyAccelerationStructureModeKHR::eCompact);
+        cb.copyAccelerationStructureKHR(casi);
+
+        // the instances of this frame (or of both frames for a shared one) have to point to the copy, which changes the top level acceleration structures
+        for (uint32_t j = 0; j < 2; ++j)
+        {
+            if (j != frame_idx && !blas.shared) continue;
+            for (vk::AccelerationStructureInstanceKHR& instance : instances[j])
+            {
+                if (instance.accelerationStructureReference == blas.deviceAddress) instance.accelerationStructureReference = compacted.deviceAddress;
+            }
+        }
+        const uint64_t build_size = storage.get_buffer(blas.buffer).get_byte_size();
+        compaction_saved_bytes += build_size - compacted_size;
+        spdlog::info("Compacted acceleration structure of {}{} from {} KB to {} KB", blas_names[blas_idx].empty() ? std::to_string(blas_idx) : blas_names[blas_idx], blas.shared ? "" : " (frame " + std::to_string(frame_idx) + ")", build_size / 1024, compacted_size / 1024);
+
+        // the submission of the other frame that may still use a shared one finished before this frame is recorded again
+        retired_blas[frame_idx].push_back(blas);
+        blas = compacted;
+    }
+
+    uint64_t PathTracer::get_compaction_saved_bytes() const
+    {
+        return compaction_saved_bytes;
+    }
+
+    vk::DeviceSize PathTracer::get_acceleration_structure_bytes() const
+    {
+        vk::DeviceSize bytes = 0;
+        for (uint32_t i = 0; i < 2; ++i)
+        {
+            for (const auto& blas : bottomLevelAS[i])
+            {
+                if (owns_blas(i, blas)) bytes += storage.get_buffer(blas.buffer).get_byte_size();
+            }
+            if (topLevelAS[i].is_built) bytes += storage.get_buffer(topLevelAS[i].buffer).get_byte_size();
+        }
+        return bytes;
+    }
+
+    vk::DeviceSize PathTracer::get_scratch_bytes() const
+    {
+        vk::DeviceSize bytes = 0;
+        for (const ScratchArena& arena : scratch_arenas)
+        {
+            if (arena.buffer != uint32_t(-1)) bytes += storage.get_buffer(arena.buffer).get_byte_size();
+        }
+        return bytes;
+    }
+
+    vk::DeviceSize PathTracer::get_dedicated_scratch_bytes() const
+    {
+        return dedicated_scratch_bytes;
+    }
+
+    TLASUpdate PathTracer::create_tlas(vk::CommandBuffer& cb, uint32_t frame_idx)
+    {
+        build_dirty_blas(cb, frame_idx);
+        const TLASUpdate update = get_tlas_update(frame_idx);
+        // the acceleration structure of this frame index still contains the current instances
+        if (update == TLASUpdate::None) return update;
         if (!topLevelAS[frame_idx].is_built)
         {
             instances_buffer[frame_idx] = storage.add_buffer(instances[frame_idx].data(), instances[frame_idx].size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, false, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
@@ -160,8 +554,8 @@ namespace ve
 
         vk::AccelerationStructureBuildGeometryInfoKHR asbgi;
         asbgi.type = vk::AccelerationStructureTypeKHR::eTopLevel;
-        asbgi.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
-        asbgi.mode = vk::BuildAccelerationStructureModeKHR::eBuild;
+        asbgi.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+        asbgi.mode = update == TLASUpdate::Refit ? vk::BuildAccelerationStructureModeKHR::eUpdate : vk::BuildAccelerationStructureModeKHR::eBuild;
         asbgi.geometryCount = 1;
         asbgi.pGeometries = &asg;
 
@@ -190,11 +584,14 @@ namespace ve
             wdsas[frame_idx].pAccelerationStructures = &(topLevelAS[frame_idx].handle);
             storage.get_buffer(topLevelAS[frame_idx].buffer).pNext = &(wdsas[frame_idx]);
 
-            topLevelAS[frame_idx].scratch_buffer = storage.add_buffer(asbsi.buildScratchSize, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress, true, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute); 
+            topLevelAS[frame_idx].scratch_size = std::max(asbsi.buildScratchSize, asbsi.updateScratchSize);
+            dedicated_scratch_bytes += topLevelAS[frame_idx].scratch_size;
         }
 
+        if (update == TLASUpdate::Refit) asbgi.srcAccelerationStructure = topLevelAS[frame_idx].handle;
         asbgi.dstAccelerationStructure = topLevelAS[frame_idx].handle;
-        asbgi.scratchData.deviceAddress = storage.get_buffer(topLevelAS[frame_idx].scratch_buffer).get_device_address();
+        // builds of bottom level acceleration structures recorded before end with a barrier, so the arena can be reused
+        asbgi.scratchData.deviceAddress = reserve_scratch(frame_idx, topLevelAS[frame_idx].scratch_size);
 
         vk::AccelerationStructureBuildRangeInfoKHR asbri{};
         asbri.primitiveCount = instances[frame_idx].size();
@@ -205,5 +602,8 @@ namespace ve
 
         cb.buildAccelerationStructuresKHR(asbgi, asbris);
         topLevelAS[frame_idx].is_built = true;
+        tlas_refit_counts[frame_idx] = update == TLASUpdate::Refit ? tlas_refit_counts[frame_idx] + 1 : 0;
+        tlas_updates[frame_idx] = TLASUpdate::None;
+        return update;
     }
 } // namespace ve
@@ -4,10 +4,16 @@
 #include <glm/gtx/transform.hpp>
 
 #include "json.hpp"
+#include "RuntimeConfig.hpp"
 #include "vk/TunnelObjects.hpp"
 
 namespace ve
 {
+    // segments per frame
+    constexpr float scripted_camera_speed = 0.02f;
+    // build one acceleration structure for all models except the player
+    constexpr bool merge_static_models = true;
+
     Scene::Scene(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : vmc(vmc), vcc(vcc), storage(storage), tunnel_objects(vmc, vcc, storage), collision_handler(vmc, vcc, storage), path_tracer(vmc, vcc, storage), jp(vmc, vcc, storage)
     {}
 
@@ -21,6 +27,7 @@ namespace ve
         path_tracer.create_tlas(cb, 0);
         path_tracer.create_tlas(cb, 1);
         vcc.submit_compute(cb, true);
+        spdlog::info("Acceleration structures: {:.2f} MB, scratch arenas: {:.2f} MB (separate scratch buffers would need {:.2f} MB)", path_tracer.get_acceleration_structure_bytes() / 1e6, path_tracer.get_scratch_bytes() / 1e6, path_tracer.get_dedicated_scratch_bytes() / 1e6);
         // initialize tunnel
         tunnel_objects.construct(render_pass);
         collision_handler.construct(render_pass);
@@ -37,7 +44,6 @@ namespace ve
             ros.at(ShaderFlavor::Default).dsh.add_descriptor(4, storage.get_buffer_by_name("spaceship_lights_" + std::to_string(i)));
             ros.at(ShaderFlavor::Default).dsh.add_descriptor(5, storage.get_buffer_by_name("firefly_vertices_" + std::to_string(i)));
             ros.at(ShaderFlavor::Default).dsh.add_descriptor(6, storage.get_image_by_name("noise_textures"));
-            ros.at(ShaderFlavor::Default).dsh.add_descriptor(10, storage.get_buffer_by_name("tunnel_indices"));
             ros.at(ShaderFlavor::Default).dsh.add_descriptor(11, storage.get_buffer_by_name("tunnel_vertices"));
             ros.at(ShaderFlavor::Default).dsh.add_descriptor(12, storage.get_buffer_by_name("indices"));
             ros.at(ShaderFlavor::Default).dsh.add_descriptor(13, storage.get_buffer_by_name("vertices"));
@@ -50,7 +56,6 @@ namespace ve
             ros.at(ShaderFlavor::Basic).dsh.add_descriptor(4, storage.get_buffer_by_name("spaceship_lights_" + std::to_string(i)));
             ros.at(ShaderFlavor::Basic).dsh.add_descriptor(5, storage.get_buffer_by_name("firefly_vertices_" + std::to_string(i)));
             ros.at(ShaderFlavor::Basic).dsh.add_descriptor(6, storage.get_image_by_name("noise_textures"));
-            ros.at(ShaderFlavor::Basic).dsh.add_descriptor(10, storage.get_buffer_by_name("tunnel_indices"));
             ros.at(ShaderFlavor::Basic).dsh.add_descriptor(11, storage.get_buffer_by_name("tunnel_vertices"));
             ros.at(ShaderFlavor::Basic).dsh.add_descriptor(12, storage.get_buffer_by_name("indices"));
             ros.at(ShaderFlavor::Basic).dsh.add_descriptor(13, storage.get_buffer_by_name("vertices"));
@@ -139,6 +144,7 @@ namespace ve
         auto add_model = [&](Model& model, const std::string& name, const glm::mat4& transformation) -> void
         {
             model_infos.push_back({});
+            model_infos.back().name = name;
             model_infos.back().index_buffer_idx = indices.size();
             vertices.insert(vertices.end(), model.vertices.begin(), model.vertices.end());
             indices.insert(indices.end(), model.indices.begin(), model.indices.end());
@@ -178,7 +184,6 @@ namespace ve
         ros.at(ShaderFlavor::Default).dsh.add_binding(4, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Default).dsh.add_binding(5, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Default).dsh.add_binding(6, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eFragment);
-        ros.at(ShaderFlavor::Default).dsh.add_binding(10, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Default).dsh.add_binding(11, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Default).dsh.add_binding(12, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Default).dsh.add_binding(13, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
@@ -190,7 +195,6 @@ namespace ve
         ros.at(ShaderFlavor::Basic).dsh.add_binding(4, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Basic).dsh.add_binding(5, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Basic).dsh.add_binding(6, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eFragment);
-        ros.at(ShaderFlavor::Basic).dsh.add_binding(10, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Basic).dsh.add_binding(11, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Basic).dsh.add_binding(12, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         ros.at(ShaderFlavor::Basic).dsh.add_binding(13, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
@@ -245,14 +249,55 @@ namespace ve
         }
         vertex_buffer = storage.add_named_buffer(std::string("vertices"), vertices, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
         index_buffer = storage.add_named_buffer(std::string("indices"), indices, vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
-        vk::CommandBuffer& cb = vcc.begin(vcc.compute_cb[0]);
+        HostTimer blas_timer;
+        // the vertices of the models are already transformed, only the player is moved by its instance
+        // all other models are static and share one acceleration structure with one geometry per mesh, which saves instances and builds
+        ModelInfo static_models{.name = "static models"};
+        uint32_t static_model_count = 0;
+        for (const ModelInfo& mi : model_infos)
+        {
+            if (mi.name == "Player") continue;
+            ++static_model_count;
+            static_models.mesh_index_offsets.insert(static_models.mesh_index_offsets.end(), mi.mesh_index_offsets.begin(), mi.mesh_index_offsets.end());
+            static_models.mesh_index_count.insert(static_models.mesh_index_count.end(), mi.mesh_index_count.begin(), mi.mesh_index_count.end());
+        }
+        const bool merge = merge_static_models && static_model_count > 1;
+        built_blas_on_host = host_blas_builds && path_tracer.supports_host_builds();
+        if (host_blas_builds && !built_blas_on_host) spdlog::warn("Acceleration structure host commands are not supported, building the acceleration structures of the models on the device");
+        // the host builds read the vertices and indices that are still in host memory
+        // models are static geometry that is only transformed by its instance, so their acceleration structures can be compacted
+        auto add_model_blas = [&](const ModelInfo& mi) -> uint32_t
+        {
+            if (built_blas_on_host) return path_tracer.add_host_blas_to_batch(vertices.data(), vertices.size(), sizeof(Vertex), indices.data(), mi.mesh_index_offsets, mi.mesh_index_count, mi.name);
+            return path_tracer.add_blas_to_batch(vertex_buffer, index_buffer, mi.mesh_index_offsets, mi.mesh_index_count, sizeof(Vertex), {}, vk::IndexType::eUint32, false, true, mi.name);
+        };
+        bool static_models_added = false;
+        // all builds are recorded at once and only need a single barrier
         for (uint32_t i = 0; i < model_infos.size(); ++i)
         {
             ModelInfo& mi = model_infos[i];
-            mi.blas_idx = path_tracer.add_blas(cb, vertex_buffer, index_buffer, mi.mesh_index_offsets, mi.mesh_index_count, sizeof(Vertex));
+            if (merge && mi.name != "Player")
+            {
+                if (!static_models_added)
+                {
+                    static_models.blas_idx = add_model_blas(static_models);
+                    static_models.instance_idx = path_tracer.add_instance(static_models.blas_idx, glm::mat4(1.0f), i);
+                    static_models_added = true;
+                }
+                mi.blas_idx = static_models.blas_idx;
+                mi.instance_idx = static_models.instance_idx;
+                continue;
+            }
+            mi.blas_idx = add_model_blas(mi);
             mi.instance_idx = path_tracer.add_instance(mi.blas_idx, model_render_data[i].M, i);
+            if (mi.name == "Player") path_tracer.set_instance_mask(mi.instance_idx, player_instance_mask);
         }
+        vk::CommandBuffer& cb = vcc.begin(vcc.compute_cb[0]);
+        path_tracer.build_blas_batch(cb);
+        path_tracer.build_host_blas_batch(cb);
         vcc.submit_compute(cb, true);
+        blas_build_time = blas_timer.elapsed<std::milli>();
+        spdlog::info("Building the acceleration structures of {} models on the {} took: {} ms", model_infos.size(), built_blas_on_host ? "host" : "device", blas_build_time);
         if (!materials.empty())
         {
             material_buffer = storage.add_named_buffer(std::string("materials"), materials, vk::BufferUsageFlagBits::eStorageBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics);
@@ -327,6 +372,11 @@ namespace ve
         return ros.at(flavor).dsh;
     }
 
+    void Scene::prepare_draw(vk::CommandBuffer& cb, GameState& gs)
+    {
+        tunnel_objects.cull(cb, gs);
+    }
+
     void Scene::draw(vk::CommandBuffer& cb, GameState& gs, DeviceTimer& timer)
     {
         uint32_t player_idx = model_handles.at("Player");
@@ -359,6 +409,9 @@ namespace ve
         {
             model_render_data[player_idx].segment_uid++;
         }
+        const TunnelQueryResult tunnel_query = tunnel_objects.query_tunnel(player_position);
+        gs.player_wall_distance = tunnel_query.wall_distance;
+        gs.player_center_distance = tunnel_query.center_distance;
         for (uint32_t i = 0; i < model_render_data.size(); ++i)
         {
             model_render_data[i].prev_MVP = model_render_data[i].MVP;
@@ -375,15 +428,29 @@ namespace ve
             glm::vec4 tmp_dir = model_render_data[player_idx].M * glm::vec4(initial_light_values[i].second, 0.0f);
             lights[i].dir = glm::vec3(tmp_dir);
         }
-        path_tracer.update_instance(0, model_render_data[player_idx].M);
+        path_tracer.update_instance(model_infos[player_idx].instance_idx, model_render_data[player_idx].M);
 
         ModelMatrices bb_mm{.m = model_render_data[player_idx].M, .inv_m = glm::inverse(model_render_data[player_idx].M)};
         storage.get_buffer(bb_mm_buffers[gs.current_frame]).update_data(bb_mm);
+        if (gs.validate_tunnel) tunnel_objects.validate_segments_on_cpu(gs);
+        const uint32_t first_segment_slot = gs.first_segment_slot;
         tunnel_objects.advance(gs, timer, path_tracer);
-        collision_handler.compute(gs, timer);
+        // scripted camera flies along the center of the tunnel with a fixed distance per frame to make runs comparable
+        if (gs.scripted_camera)
+        {
+            // the tunnel moved one segment forward, so the progress relative to the player's segment decreases
+            if (gs.first_segment_slot != first_segment_slot) gs.scripted_camera_progress -= 1.0f;
+            gs.scripted_camera_progress += scripted_camera_speed;
+            gs.cam.position = tunnel_objects.get_tunnel_path_position(gs.scripted_camera_progress);
+            const glm::vec3 dir = tunnel_objects.get_tunnel_path_direction(gs.scripted_camera_progress);
+            gs.cam.orientation = glm::quatLookAt(dir, std::abs(glm::dot(dir, glm::vec3(1.0f, 0.0f, 0.0f))) > 0.999f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f));
+        }
+        collision_handler.compute(gs, timer, model_render_data[player_idx].M);
 
         if (!lights.empty()) storage.get_buffer(light_buffers[gs.current_frame]).update_data(lights);
         storage.get_buffer(model_render_data_buffers[gs.current_frame]).update_data(model_render_data);
+        gs.collision_triangle_count = gs.collision_mode == collision_mode_broad_phase ? collision_handler.get_candidate_triangle_count(gs.current_frame) : (gs.collision_mode == collision_mode_all_triangles ? (indices_per_segment * 2) / 3 : 0);
+        gs.collision_ray_hit = gs.collision_mode == collision_mode_ray_queries ? collision_handler.get_closest_ray_hit(gs.current_frame) : CollisionRayHit{glm::vec3(0.0f), -1.0f};
         // handle collision: reset ship and let it blink for 3s
         if (gs.player_reset_blink_counter == 0 && collision_handler.get_shader_return_value(gs.current_frame) != 0 && gs.collision_detection_active)
         {
@@ -1,9 +1,50 @@
 #include "vk/Tunnel.hpp"
+
+#include <cstddef>
+#include <cstring>
+
+#include "NoiseTextures.hpp"
 #include "vk/TunnelObjects.hpp"
 
 namespace ve
 {
-    Tunnel::Tunnel(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : skybox_dsh(vmc), render_dsh(vmc), vmc(vmc), vcc(vcc), storage(storage), skybox_render_pipeline(vmc), pipeline(vmc), mesh_view_pipeline(vmc)
+    // adds the triangles of one segment at the given tessellation level
+    // get_tunnel_vertex_idx in common.glsl computes the same triangulation in the shaders
+    void append_segment_indices(std::vector<uint16_t>& indices, uint32_t first_vertex, uint32_t lod)
+    {
+        const uint32_t step = get_lod_step(lod);
+        std::vector<uint32_t> rings;
+        for (uint32_t i = 0; i < samples_per_segment - 1; i += step) rings.push_back(i);
+        rings.push_back(samples_per_segment - 1);
+        auto vertex = [&](uint32_t ring, uint32_t idx) { return uint16_t(first_vertex + ring * vertices_per_sample + idx % vertices_per_sample); };
+        for (uint32_t i = 0; i < rings.size() - 1; ++i)
+        {
+            const uint32_t ring_a = rings[i];
+            const uint32_t ring_b = rings[i + 1];
+            // first and last ring keep all vertices
+            const uint32_t step_a = ring_a == 0 ? 1 : step;
+            const uint32_t step_b = ring_b == samples_per_segment - 1 ? 1 : step;
+            // every cell between the two rings covers step vertices; triangulate it with a fan over the edges of ring a followed by a fan over the edges of ring b
+            // for level 0 this gives the 2 triangles per vertex of the full density mesh
+            for (uint32_t j = 0; j < vertices_per_sample; j += step)
+            {
+                for (uint32_t k = j; k < j + step; k += step_a)
+                {
+                    indices.push_back(vertex(ring_a, k));
+                    indices.push_back(vertex(ring_a, k + step_a));
+                    indices.push_back(vertex(ring_b, j));
+                }
+                for (uint32_t k = j; k < j + step; k += step_b)
+                {
+                    indices.push_back(vertex(ring_a, j + step));
+                    indices.push_back(vertex(ring_b, k + step_b));
+                    indices.push_back(vertex(ring_b, k));
+                }
+            }
+        }
+    }
+
+    Tunnel::Tunnel(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : skybox_dsh(vmc), render_dsh(vmc), cull_dsh(vmc), vmc(vmc), vcc(vcc), storage(storage), skybox_render_pipeline(vmc), pipeline(vmc), mesh_view_pipeline(vmc), cull_pipeline(vmc)
     {}
 
     void Tunnel::self_destruct(bool full)
@@ -11,8 +52,9 @@ namespace ve
         skybox_render_pipeline.self_destruct();
         pipeline.self_destruct();
         mesh_view_pipeline.self_destruct();
+        cull_pipeline.self_destruct();
         render_dsh.self_destruct();
-        storage.destroy_image(noise_textures);
+        cull_dsh.self_destruct();
         for (auto i : model_render_data_buffers) storage.destroy_buffer(i);
         model_render_data_buffers.clear();
         if (full)
@@ -20,47 +62,49 @@ namespace ve
             skybox_dsh.self_destruct();
             storage.destroy_buffer(skybox_vertex_buffer);
             storage.destroy_image(skybox_texture);
+            storage.destroy_image(noise_textures);
             storage.destroy_buffer(vertex_buffer);
-            storage.destroy_buffer(index_buffer);
+            if (blas_vertex_buffer != vertex_buffer) storage.destroy_buffer(blas_vertex_buffer);
+            storage.destroy_buffer(segment_uid_buffer);
+            storage.destroy_buffer(index_pattern_buffer);
+            for (auto i : draw_command_buffers) storage.destroy_buffer(i);
+            draw_command_buffers.clear();
+            for (auto i : cull_stats_buffers) storage.destroy_buffer(i);
+            cull_stats_buffers.clear();
         }
     }
 
     void Tunnel::create_buffers()
     {
         skybox_texture = storage.add_named_image("skybox_texture", "../assets/textures/tunnel_skybox_texture.png", true, 0, std::vector<uint32_t>{vmc.queue_family_indices.graphics, vmc.queue_family_indices.transfer}, vk::ImageUsageFlagBits::eSampled);
-        // double space is needed to enable that new vertices can replace old ones as the tunnel continuously moves forward
-        std::vector<TunnelVertex> vertices(vertex_count * 2);
-        std::vector<uint32_t> indices(index_count * 2);
-        // write indices in advance even for the currently unused space that is reserved for the FixVector behavior
-        for (uint32_t i = 0; i < segment_count * 2; ++i)
+        create_noise_textures();
+        // rendering and collision detection compute the indices in the shaders, only the acceleration structure build needs an index buffer
+        // every segment has the same triangulation, so one segment per tessellation level is enough; the build offsets it to the segment's vertices
+        // the indices are relative to the first vertex of a segment, so 16 bits are enough (check_runtime_config limits the vertices per segment)
+        std::vector<uint16_t> indices;
+        indices.reserve(get_lod_index_offset(tunnel_lod_count));
+        for (uint32_t lod = 0; lod < tunnel_lod_count; ++lod) append_segment_indices(indices, 0, lod);
+        spdlog::info("Tunnel index pattern uses {} KB instead of {} KB for 32 bit indices of all segment slots", indices.size() * sizeof(uint16_t) / 1024, indices.size() * get_segment_slot_count() * sizeof(uint32_t) / 1024);
+        // new segments replace the oldest ones in a ring of segment slots as the tunnel continuously moves forward
+        const uint32_t slot_vertex_count = get_segment_slot_count() * vertices_per_segment;
+        constexpr vk::BufferUsageFlags blas_input_usage = vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
+        const vk::BufferUsageFlags vertex_usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst;
+        if (compact_tunnel_vertices)
         {
-            for (uint32_t j = 0; j < samples_per_segment - 1; ++j)
-            {
-                for (uint32_t k = 0; k < vertices_per_sample - 1; ++k)
-                {
-                    // iterate over all vertices and add 2 triangles per vertex to build the quad that lies in direction of the circle and to the next sample circle
-                    const uint32_t indices_idx = i * indices_per_segment + j * vertices_per_sample * 6 + k * 6;
-                    const uint32_t vertices_idx = i * samples_per_segment * vertices_per_sample + j * vertices_per_sample + k;
-                    indices[indices_idx] = vertices_idx;
-                    indices[indices_idx + 1] = vertices_idx + 1;
-                    indices[indices_idx + 2] = vertices_idx + vertices_per_sample;
-                    indices[indices_idx + 3] = vertices_idx + 1;
-                    indices[indices_idx + 4] = vertices_idx + vertices_per_sample + 1;
-                    indices[indices_idx + 5] = vertices_idx + vertices_per_sample;
-                }
-                // close the ring with the last element
-                const uint32_t last_indices_idx = i * indices_per_segment + j * vertices_per_sample * 6 + (vertices_per_sample - 1) * 6;
-                const uint32_t last_vertices_idx = i * samples_per_segment * vertices_per_sample + j * vertices_per_sample + (vertices_per_sample - 1);
-                indices[last_indices_idx] = last_vertices_idx;
-                indices[last_indices_idx + 1] = last_vertices_idx + 1 - vertices_per_sample;
-                indices[last_indices_idx + 2] = last_vertices_idx + vertices_per_sample;
-                indices[last_indices_idx + 3] = last_vertices_idx + 1 - vertices_per_sample;
-                indices[last_indices_idx + 4] = last_vertices_idx + 1;
-                indices[last_indices_idx + 5] = last_vertices_idx + vertices_per_sample;
-            }
+            // compact vertices do not contain positions, so tunnel.comp additionally writes them into a separate buffer for the acceleration structure
+            vertex_buffer = storage.add_named_buffer(std::string("tunnel_vertices"), std::vector<CompactTunnelVertex>(slot_vertex_count), vertex_usage, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
+            blas_vertex_buffer = storage.add_named_buffer(std::string("tunnel_blas_positions"), std::vector<glm::vec3>(slot_vertex_count), vk::BufferUsageFlagBits::eStorageBuffer | blas_input_usage, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.compute);
+            blas_vertex_stride = sizeof(glm::vec3);
         }
-        vertex_buffer = storage.add_named_buffer(std::string("tunnel_vertices"), vertices, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
-        index_buffer = storage.add_named_buffer(std::string("tunnel_indices"), indices, vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
+        else
+        {
+            vertex_buffer = storage.add_named_buffer(std::string("tunnel_vertices"), std::vector<TunnelVertex>(slot_vertex_count), vertex_usage | blas_input_usage, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
+            blas_vertex_buffer = vertex_buffer;
+            blas_vertex_stride = sizeof(TunnelVertex);
+        }
+        spdlog::info("Tunnel vertices use {} KB ({} bytes per vertex) and {} KB for the acceleration structure build", storage.get_buffer(vertex_buffer).get_byte_size() / 1024, get_tunnel_vertex_byte_size(), blas_vertex_buffer == vertex_buffer ? 0 : storage.get_buffer(blas_vertex_buffer).get_byte_size() / 1024);
+        segment_uid_buffer = storage.add_named_buffer(std::string("tunnel_segment_uids"), std::vector<uint32_t>(get_segment_slot_count()), vk::BufferUsageFlagBits::eStorageBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
+        index_pattern_buffer = storage.add_named_buffer(std::string("tunnel_index_pattern"), indices, vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.compute);
         std::vector<TunnelSkyboxVertex> skybox_vertices = {
             TunnelSkyboxVertex{glm::vec3(segment_scale, segment_scale, 0.0), glm::vec2(1.0, 1.0)},
             TunnelSkyboxVertex{glm::vec3(-segment_scale, segment_scale, 0.0), glm::vec2(0.0, 1.0)},
@@ -70,6 +114,12 @@ namespace ve
             TunnelSkyboxVertex{glm::vec3(segment_scale, -segment_scale, 0.0), glm::vec2(1.0, 0.0)},
         };
         skybox_vertex_buffer = storage.add_named_buffer("tunnel_skybox_vertices", skybox_vertices, vk::BufferUsageFlagBits::eVertexBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics);
+        for (uint32_t i = 0; i < frames_in_flight; ++i)
+        {
+            draw_command_buffers.push_back(storage.add_buffer(std::vector<vk::DrawIndirectCommand>(segment_count), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics));
+            // host visible to read back the statistics and to reset the draw count without a transfer
+            cull_stats_buffers.push_back(storage.add_buffer(std::vector<TunnelCullStats>(1), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer, false, vmc.queue_family_indices.graphics));
+        }
     }
 
     void Tunnel::construct(const RenderPass& render_pass)
@@ -79,8 +129,6 @@ namespace ve
 
     void Tunnel::construct_pipelines(const RenderPass& render_pass)
     {
-        create_noise_textures();
-
         skybox_dsh.add_binding(1, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eFragment);
         render_dsh.add_binding(0, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex);
         render_dsh.add_binding(1, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment);
@@ -89,10 +137,15 @@ namespace ve
         render_dsh.add_binding(4, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eFragment);
         render_dsh.add_binding(5, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         render_dsh.add_binding(6, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eFragment);
-        render_dsh.add_binding(10, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
-        render_dsh.add_binding(11, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
+        render_dsh.add_binding(7, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eVertex);
+        render_dsh.add_binding(8, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eVertex);
+        render_dsh.add_binding(11, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment);
         render_dsh.add_binding(12, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
         render_dsh.add_binding(13, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eFragment);
+        cull_dsh.add_binding(0, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        cull_dsh.add_binding(1, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        cull_dsh.add_binding(2, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        cull_dsh.add_binding(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
 
         // add one uniform buffer and descriptor set for each frame as the uniform buffer is changed in every frame
         for (uint32_t i = 0; i < frames_in_flight; ++i)
@@ -109,17 +162,30 @@ namespace ve
             render_dsh.add_descriptor(4, storage.get_buffer_by_name("spaceship_lights_" + std::to_string(i)));
             render_dsh.add_descriptor(5, storage.get_buffer_by_name("firefly_vertices_" + std::to_string(i)));
             render_dsh.add_descriptor(6, storage.get_image(noise_textures));
-            render_dsh.add_descriptor(10, storage.get_buffer_by_name("tunnel_indices"));
+            render_dsh.add_descriptor(7, storage.get_buffer_by_name("tunnel_bezier_points"));
+            render_dsh.add_descriptor(8, storage.get_buffer(segment_uid_buffer));
             render_dsh.add_descriptor(11, storage.get_buffer_by_name("tunnel_vertices"));
             render_dsh.add_descriptor(12, storage.get_buffer_by_name("indices"));
             render_dsh.add_descriptor(13, storage.get_buffer_by_name("vertices"));
+
+            cull_dsh.new_set();
+            cull_dsh.add_descriptor(0, storage.get_buffer_by_name("tunnel_bezier_points"));
+            cull_dsh.add_descriptor(1, storage.get_buffer(segment_uid_buffer));
+            cull_dsh.add_descriptor(2, storage.get_buffer(draw_command_buffers[i]));
+            cull_dsh.add_descriptor(3, storage.get_buffer(cull_stats_buffers[i]));
         }
         skybox_dsh.construct();
         render_dsh.construct();
+        cull_dsh.construct();
 
-        vk::SpecializationMapEntry uniform_buffer_size_entry(0, 0, sizeof(uint32_t));
-        uint32_t uniform_buffer_size = 1;
-        vk::SpecializationInfo render_spec_info(1, &uniform_buffer_size_entry, sizeof(uint32_t), &uniform_buffer_size);
+        std::array<vk::SpecializationMapEntry, 5> vertex_entries;
+        vertex_entries[0] = vk::SpecializationMapEntry(0, 0, sizeof(uint32_t));
+        vertex_entries[1] = vk::SpecializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t));
+        vertex_entries[2] = vk::SpecializationMapEntry(2, sizeof(uint32_t) * 2, sizeof(uint32_t));
+        vertex_entries[3] = vk::SpecializationMapEntry(3, sizeof(uint32_t) * 3, sizeof(uint32_t));
+        vertex_entries[4] = vk::SpecializationMapEntry(4, sizeof(uint32_t) * 4, sizeof(uint32_t));
+        std::array<uint32_t, 5> vertex_entries_data{1, samples_per_segment, vertices_per_sample, segment_count, compact_tunnel_vertices};
+        vk::SpecializationInfo render_spec_info(vertex_entries.size(), vertex_entries.data(), sizeof(uint32_t) * vertex_entries_data.size(), vertex_entries_data.data());
         std::vector<ShaderInfo> shader_infos(2);
         shader_infos[0] = ShaderInfo{"tunnel.vert", vk::ShaderStageFlagBits::eVertex, render_spec_info};
 
@@ -131,12 +197,26 @@ namespace ve
         vk::SpecializationInfo fragment_spec_info(fragment_entries.size(), fragment_entries.data(), sizeof(uint32_t) * fragment_entries_data.size(), fragment_entries_data.data());
         shader_infos[1] = ShaderInfo{"tunnel.frag", vk::ShaderStageFlagBits::eFragment, fragment_spec_info};
 
-        pipeline.construct(render_pass, render_dsh.get_layouts()[0], shader_infos, vk::PolygonMode::eFill, TunnelVertex::get_binding_descriptions(), TunnelVertex::get_attribute_descriptions());
-        mesh_view_pipeline.construct(render_pass, render_dsh.get_layouts()[0], shader_infos, vk::PolygonMode::eLine, TunnelVertex::get_binding_descriptions(), TunnelVertex::get_attribute_descriptions());
+        // the vertex shader pulls the vertices from the storage buffer, so there is no vertex input
+        pipeline.construct(render_pass, render_dsh.get_layouts()[0], shader_infos, vk::PolygonMode::eFill, std::vector<vk::VertexInputBindingDescription>(), std::vector<vk::VertexInputAttributeDescription>());
+        mesh_view_pipeline.construct(render_pass, render_dsh.get_layouts()[0], shader_infos, vk::PolygonMode::eLine, std::vector<vk::VertexInputBindingDescription>(), std::vector<vk::VertexInputAttributeDescription>());
 
         shader_infos[0] = ShaderInfo{"tunnel_skybox.vert", vk::ShaderStageFlagBits::eVertex};
         shader_infos[1] = ShaderInfo{"tunnel_skybox.frag", vk::ShaderStageFlagBits::eFragment};
         skybox_render_pipeline.construct(render_pass, skybox_dsh.get_layouts()[0], shader_infos, vk::PolygonMode::eFill, TunnelSkyboxVertex::get_binding_descriptions(), TunnelSkyboxVertex::get_attribute_descriptions(), vk::PrimitiveTopology::eTriangleList, {vk::PushConstantRange(vk::ShaderStageFlagBits::eVertex, 0, sizeof(DebugPushConstants))});
+
+        std::array<vk::SpecializationMapEntry, 7> cull_entries;
+        cull_entries[0] = vk::SpecializationMapEntry(0, 0, sizeof(uint32_t));
+        cull_entries[1] = vk::SpecializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t));
+        cull_entries[2] = vk::SpecializationMapEntry(2, sizeof(uint32_t) * 2, sizeof(uint32_t));
+        cull_entries[3] = vk::SpecializationMapEntry(3, sizeof(uint32_t) * 3, sizeof(uint32_t));
+        cull_entries[4] = vk::SpecializationMapEntry(4, sizeof(uint32_t) * 4, sizeof(uint32_t));
+        cull_entries[5] = vk::SpecializationMapEntry(5, sizeof(uint32_t) * 5, sizeof(uint32_t));
+        cull_entries[6] = vk::SpecializationMapEntry(6, sizeof(uint32_t) * 6, sizeof(uint32_t));
+        static_assert(tunnel_lod_distances.size() == 3, "tunnel_cull.comp expects 3 level distances");
+        std::array<uint32_t, 7> cull_entries_data{segment_count, samples_per_segment, vertices_per_sample, player_segment_position, tunnel_lod_distances[0], tunnel_lod_distances[1], tunnel_lod_distances[2]};
+        vk::SpecializationInfo cull_spec_info(cull_entries.size(), cull_entries.data(), sizeof(uint32_t) * cull_entries_data.size(), cull_entries_data.data());
+        cull_pipeline.construct(cull_dsh.get_layouts()[0], ShaderInfo{"tunnel_cull.comp", vk::ShaderStageFlagBits::eCompute, cull_spec_info}, sizeof(TunnelCullPushConstants));
     }
 
     void Tunnel::reload_shaders(const RenderPass& render_pass)
@@ -157,19 +237,46 @@ namespace ve
                     glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
     }
 
+    // Gribb/Hartmann plane extraction; the near plane of the -1..1 depth range is used as it contains the near plane of the 0..1 range
+    std::array<glm::vec4, 6> get_frustum_planes(const glm::mat4& vp)
+    {
+        const glm::vec4 row_0(vp[0][0], vp[1][0], vp[2][0], vp[3][0]);
+        const glm::vec4 row_1(vp[0][1], vp[1][1], vp[2][1], vp[3][1]);
+        const glm::vec4 row_2(vp[0][2], vp[1][2], vp[2][2], vp[3][2]);
+        const glm::vec4 row_3(vp[0][3], vp[1][3], vp[2][3], vp[3][3]);
+        return {row_3 + row_0, row_3 - row_0, row_3 + row_1, row_3 - row_1, row_3 + row_2, row_3 - row_2};
+    }
+
+    void Tunnel::cull(vk::CommandBuffer& cb, GameState& gs)
+    {
+        // the buffers of this frame are not used anymore as its fence was already waited for
+        Buffer& stats_buffer = storage.get_buffer(cull_stats_buffers[gs.current_frame]);
+        const TunnelCullStats stats = stats_buffer.obtain_first_element<TunnelCullStats>();
+        gs.tunnel_triangle_count = stats.drawn_triangle_count;
+        gs.tunnel_culled_triangle_count = stats.culled_triangle_count;
+        stats_buffer.update_data(TunnelCullStats{0, 0, 0});
+
+        TunnelCullPushConstants pc{.frustum_planes = get_frustum_planes(gs.cam.getVP()), .first_segment_slot = gs.first_segment_slot, .adaptive_tessellation = gs.adaptive_tessellation, .frustum_culling = gs.tunnel_frustum_culling};
+        cb.bindPipeline(vk::PipelineBindPoint::eCompute, cull_pipeline.get());
+        cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, cull_pipeline.get_layout(), 0, cull_dsh.get_sets()[gs.current_frame], {});
+        cb.pushConstants(cull_pipeline.get_layout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(TunnelCullPushConstants), &pc);
+        cb.dispatch((segment_count + 31) / 32, 1, 1);
+        vk::MemoryBarrier memory_barrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eIndirectCommandRead);
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eDrawIndirect, vk::DependencyFlagBits::eDeviceGroup, {memory_barrier}, {}, {});
+    }
+
     void Tunnel::draw(vk::CommandBuffer& cb, GameState& gs, const glm::vec3& p1, const glm::vec3& p2)
     {
-        cb.bindVertexBuffers(0, storage.get_buffer(vertex_buffer).get(), {0});
-        cb.bindIndexBuffer(storage.get_buffer(index_buffer).get(), 0, vk::IndexType::eUint32);
         mrd.prev_MVP = mrd.MVP;
         mrd.MVP = gs.cam.getVP();
         storage.get_buffer(model_render_data_buffers[gs.current_frame]).update_data(std::vector<ModelRenderData>{mrd});
         const vk::PipelineLayout& pipeline_layout = gs.mesh_view ? mesh_view_pipeline.get_layout() : pipeline.get_layout();
         cb.bindPipeline(vk::PipelineBindPoint::eGraphics, gs.mesh_view ? mesh_view_pipeline.get() : pipeline.get());
         cb.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline_layout, 0, render_dsh.get_sets()[gs.current_frame], {});
-        PushConstants pc{.mesh_render_data_idx = 0, .first_segment_indices_idx = gs.first_segment_indices_idx, .time = gs.time, .tex_view = gs.tex_view};
+        PushConstants pc{.mesh_render_data_idx = 0, .first_segment_slot = gs.first_segment_slot, .time = gs.time, .tex_view = gs.tex_view};
         cb.pushConstants(pipeline_layout, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment, 0, sizeof(PushConstants), &pc);
-        cb.drawIndexed(index_count, 1, gs.first_segment_indices_idx, 0, 0);
+        // one draw per visible segment with the tessellation level for its distance to the player, written by cull
+        cb.drawIndirectCount(storage.get_buffer(draw_command_buffers[gs.current_frame]).get(), 0, storage.get_buffer(cull_stats_buffers[gs.current_frame]).get(), offsetof(TunnelCullStats, draw_count), segment_count, sizeof(vk::DrawIndirectCommand));
 
         cb.bindVertexBuffers(0, storage.get_buffer(skybox_vertex_buffer).get(), {0});
         cb.bindPipeline(vk::PipelineBindPoint::eGraphics, skybox_render_pipeline.get());
@@ -183,26 +290,60 @@ namespace ve
 
     void Tunnel::create_noise_textures()
     {
-        constexpr uint32_t noise_texture_dim = 2048;
+        // generating the noise textures is expensive, so they are only computed if the cache is missing or outdated
+        const uint64_t cache_key = noise_texture_cache_key(noise_texture_dim);
+        NoiseTextureLayers texture_data;
+        if (!load_noise_texture_cache(cache_key, noise_texture_dim, texture_data))
+        {
+            HostTimer timer;
+            texture_data = compute_noise_textures();
+            spdlog::info("Computing noise textures took {} ms", timer.elapsed<std::milli>());
+            // spot check the gpu result against the cpu reference in a few rows
+            constexpr uint32_t validation_row_step = 64;
+            const NoiseTextureError error = compare_noise_textures(texture_data, generate_noise_textures(noise_texture_dim, validation_row_step), noise_texture_dim, validation_row_step);
+            spdlog::info("Noise textures differ from CPU reference by max {} and mean {}", error.max, error.mean);
+            if (error.max > noise_texture_max_error || error.mean > noise_texture_mean_error)
+            {
+                // a wrong gpu result must not be cached as it would be loaded on every start without being checked again
+                spdlog::error("Noise textures computed on the GPU exceed the tolerance (max {}, mean {}), using the CPU reference without caching it", noise_texture_max_error, noise_texture_mean_error);
+                texture_data = generate_noise_textures(noise_texture_dim);
+            }
+            else
+            {
+                save_noise_texture_cache(cache_key, noise_texture_dim, texture_data);
+            }
+        }
+        noise_textures = storage.add_named_image(std::string("noise_textures"), texture_data, noise_texture_dim, noise_texture_dim, true, 0, std::vector<uint32_t>{vmc.queue_family_indices.graphics, vmc.queue_family_indices.transfer}, vk::ImageUsageFlagBits::eSampled);
+    }
+
+    NoiseTextureLayers Tunnel::compute_noise_textures()
+    {
+        const uint32_t texel_count = noise_texture_dim * noise_texture_dim;
+        const uint32_t texel_buffer = storage.add_buffer(texel_count * noise_texture_layer_count * sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferSrc, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.compute);
         DescriptorSetHandler pre_process_dsh(vmc);
-        pre_process_dsh.add_binding(0, vk::DescriptorType::eStorageImage, vk::ShaderStageFlagBits::eCompute);
-        std::vector<std::vector<unsigned char>> texture_data;
-        for (uint32_t i = 0; i < 2; ++i) texture_data.push_back(std::vector<unsigned char>(noise_texture_dim * noise_texture_dim * 4, 0));
-        noise_textures = storage.add_named_image(std::string("noise_textures"), texture_data, noise_texture_dim, noise_texture_dim, false, 0, std::vector<uint32_t>{vmc.queue_family_indices.graphics, vmc.queue_family_indices.transfer, vmc.queue_family_indices.compute}, vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eStorage);
-        storage.get_image(noise_textures).transition_image_layout(vcc, vk::ImageLayout::eGeneral, vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eAllCommands, vk::AccessFlagBits::eNone, vk::AccessFlagBits::eNone);
+        pre_process_dsh.add_binding(0, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         pre_process_dsh.new_set();
-        pre_process_dsh.add_descriptor(0, storage.get_image(noise_textures));
+        pre_process_dsh.add_descriptor(0, storage.get_buffer(texel_buffer));
         pre_process_dsh.construct();
 
+        vk::SpecializationMapEntry dim_entry(0, 0, sizeof(uint32_t));
+        uint32_t dim = noise_texture_dim;
+        vk::SpecializationInfo spec_info(1, &dim_entry, sizeof(uint32_t), &dim);
         Pipeline pre_process_pipeline(vmc);
-        pre_process_pipeline.construct(pre_process_dsh.get_layouts()[0], ShaderInfo{"create_noise_textures.comp", vk::ShaderStageFlagBits::eCompute}, 0);
+        pre_process_pipeline.construct(pre_process_dsh.get_layouts()[0], ShaderInfo{"create_noise_textures.comp", vk::ShaderStageFlagBits::eCompute, spec_info}, 0);
         vk::CommandBuffer& cb = vcc.begin(vcc.compute_cb[0]);
         cb.bindPipeline(vk::PipelineBindPoint::eCompute, pre_process_pipeline.get());
         cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, pre_process_pipeline.get_layout(), 0, pre_process_dsh.get_sets()[0], {});
         cb.dispatch(noise_texture_dim / 32, noise_texture_dim / 32, 1);
         vcc.submit_compute(cb, true);
-        storage.get_image(noise_textures).transition_image_layout(vcc, vk::ImageLayout::eShaderReadOnlyOptimal, vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eShaderRead);
+
+        std::vector<uint32_t> texels = storage.get_buffer(texel_buffer).obtain_data<uint32_t>(texel_count * noise_texture_layer_count);
+        NoiseTextureLayers texture_data(noise_texture_layer_count, std::vector<unsigned char>(texel_count * 4));
+        for (uint32_t i = 0; i < noise_texture_layer_count; ++i) std::memcpy(texture_data[i].data(), texels.data() + i * texel_count, texel_count * 4);
+
+        storage.destroy_buffer(texel_buffer);
         pre_process_dsh.self_destruct();
         pre_process_pipeline.self_destruct();
+        return texture_data;
     }
 } // namespace ve
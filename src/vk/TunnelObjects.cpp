@@ -1,19 +1,33 @@
 #include "vk/TunnelObjects.hpp"
 
+#include <limits>
+#include <glm/common.hpp>
+#include <glm/exponential.hpp>
+
 namespace ve
 {
-    TunnelObjects::TunnelObjects(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : vmc(vmc), vcc(vcc), storage(storage), fireflies(vmc, vcc, storage), tunnel(vmc, vcc, storage), compute_dsh(vmc), compute_pipeline(vmc), compute_normals_pipeline(vmc), tunnel_bezier_points(segment_count * 2 + 1), rnd(0), dis(0.0f, 1.0f)
+    TunnelObjects::TunnelObjects(const VulkanMainContext& vmc, VulkanCommandContext& vcc, Storage& storage) : vmc(vmc), vcc(vcc), storage(storage), fireflies(vmc, vcc, storage), tunnel(vmc, vcc, storage), compute_dsh(vmc), compute_pipeline(vmc), tunnel_bezier_points(segment_count * 2 + 1), path(segment_scale), generator(samples_per_segment, vertices_per_sample)
     {
-        cpc.indices_start_idx = 0;
+        prefetch_slot_release_frames.fill(0);
     }
 
     void TunnelObjects::self_destruct(bool full)
     {
         compute_pipeline.self_destruct();
-        compute_normals_pipeline.self_destruct();
         if (full)
         {
             storage.destroy_buffer(tunnel_bezier_points_buffer);
+            storage.destroy_buffer(prefetch_vertex_buffer);
+            vmc.logical_device.get().destroyFence(prefetch_fence);
+            prefetch_first_slot = 0;
+            prefetch_count = 0;
+            prefetch_ready_count = 0;
+            prefetch_slot_release_frames.fill(0);
+            blas_indices.clear();
+            instance_indices.clear();
+            slot_blas_lods.clear();
+            slot_blas_refit_counts.clear();
+            slot_blas_build_areas.clear();
             fireflies.self_destruct();
             tunnel.self_destruct();
             compute_dsh.self_destruct();
@@ -22,57 +36,83 @@ namespace ve
 
     void TunnelObjects::create_buffers(PathTracer& path_tracer)
     {
-        tunnel_bezier_points_buffer = storage.add_named_buffer(std::string("tunnel_bezier_points"), (tunnel_bezier_points.size() + 2) * 16, vk::BufferUsageFlagBits::eStorageBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.compute);
+        tunnel_bezier_points_buffer = storage.add_named_buffer(std::string("tunnel_bezier_points"), (tunnel_bezier_points.size() + 2) * 16, vk::BufferUsageFlagBits::eStorageBuffer, true, vmc.queue_family_indices.transfer, vmc.queue_family_indices.graphics, vmc.queue_family_indices.compute);
         tunnel.create_buffers();
         fireflies.create_buffers();
+        prefetch_vertex_buffer = storage.add_named_buffer(std::string("tunnel_prefetch_vertices"), prefetch_segment_count * vertices_per_segment * get_tunnel_vertex_byte_size(), vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferSrc, true, vmc.queue_family_indices.compute);
+        prefetch_fence = vmc.logical_device.get().createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled));
 
-        compute_dsh.add_binding(0, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(1, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(2, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
         compute_dsh.add_binding(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(4, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
+        compute_dsh.add_binding(5, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute);
 
         for (uint32_t i = 0; i < frames_in_flight; ++i)
         {
             compute_dsh.new_set();
-            compute_dsh.add_descriptor(0, storage.get_buffer(tunnel.index_buffer));
             compute_dsh.add_descriptor(1, storage.get_buffer(tunnel.vertex_buffer));
             compute_dsh.add_descriptor(2, storage.get_buffer(fireflies.vertex_buffers[i]));
             compute_dsh.add_descriptor(3, storage.get_buffer(tunnel_bezier_points_buffer));
+            compute_dsh.add_descriptor(4, storage.get_buffer(tunnel.blas_vertex_buffer));
+            compute_dsh.add_descriptor(5, storage.get_buffer(tunnel.segment_uid_buffer));
         }
+        // set frames_in_flight is used by the prefetch that only writes vertices into the prefetch buffer
+        compute_dsh.new_set();
+        compute_dsh.add_descriptor(1, storage.get_buffer(prefetch_vertex_buffer));
+        compute_dsh.add_descriptor(2, storage.get_buffer(fireflies.vertex_buffers[0]));
+        compute_dsh.add_descriptor(3, storage.get_buffer(tunnel_bezier_points_buffer));
+        compute_dsh.add_descriptor(4, storage.get_buffer(tunnel.blas_vertex_buffer));
+        compute_dsh.add_descriptor(5, storage.get_buffer(tunnel.segment_uid_buffer));
         compute_dsh.construct();
         construct_pipelines();
 
         vk::CommandBuffer& cb = vcc.begin(vcc.compute_cb[0]);
-        cpc.segment_uid = 0;
-        cpc.p0 = glm::vec3(0.0f, 0.0f, -50.0f);
-        cpc.p1 = glm::vec3(0.0f, 0.0f, -50.0f - segment_scale / 2.0f);
-        cpc.p2 = glm::vec3(0.0f, 0.0f, -50.0f - segment_scale);
+        const TunnelSegmentPoints first_segment = path.first_segment();
+        cpc.segment_uid = first_segment.segment_uid;
+        cpc.p0 = first_segment.p0;
+        cpc.p1 = first_segment.p1;
+        cpc.p2 = first_segment.p2;
         tunnel_bezier_points[0] = cpc.p0;
         tunnel_bezier_points[1] = cpc.p1;
         tunnel_bezier_points[2] = cpc.p2;
         storage.get_buffer(tunnel_bezier_points_buffer).update_data_bytes(tunnel_bezier_points.data(), 16);
         // set current_frame to 1 that fireflies are initially in buffer 1 as this is used as the in_buffer by the first frame
-        compute_new_segment(cb, 1);
+        compute_new_segment(cb, 1, cpc.segment_uid % get_segment_slot_count(), segment_flag_generate_geometry | segment_flag_insert);
 
         for (uint32_t i = 1; i < segment_count; ++i)
         {
             cpc.segment_uid++;
-            cpc.indices_start_idx = i * indices_per_segment;
             const glm::vec3 normal = glm::normalize(cpc.p2 - cpc.p1);
             cpc.p1 = cpc.p2 + cpc.p2 - cpc.p1;
             cpc.p0 = cpc.p2;
-            cpc.p2 = pop_tunnel_bezier_point_queue();
+            cpc.p2 = path.pop_bezier_point_queue(cpc.p0, cpc.p1);
             tunnel_bezier_points[i * 2 + 1] = cpc.p1;
             tunnel_bezier_points[i * 2 + 2] = cpc.p2;
-            compute_new_segment(cb, 1);
+            compute_new_segment(cb, 1, cpc.segment_uid % get_segment_slot_count(), segment_flag_generate_geometry | segment_flag_insert);
         }
         vcc.submit_compute(cb, true);
+        prefetch_segments(0);
+        wait_for_prefetch();
         vk::CommandBuffer& path_tracer_cb = vcc.begin(vcc.compute_cb[0]);
-        //for (uint32_t i = 0; i < segment_count; ++i)
+        // initial builds with full density as the size of an acceleration structure is determined by its first build
+        std::vector<uint32_t> index_offsets, index_counts, first_vertices;
+        get_segment_index_ranges(first_segment.segment_uid % get_segment_slot_count(), false, index_offsets, index_counts, first_vertices);
+        blas_indices.push_back(path_tracer.add_blas(path_tracer_cb, tunnel.blas_vertex_buffer, tunnel.index_pattern_buffer, index_offsets, index_counts, tunnel.blas_vertex_stride, first_vertices, vk::IndexType::eUint16));
+        instance_indices.push_back(path_tracer.add_instance(blas_indices.back(), glm::mat4(1.0f), tunnel_instance_custom_index));
+        // the slot that is not rendered yet only contains undefined vertices, its instance stays hidden until it gets a segment
+        for (uint32_t slot = 0; slot < get_segment_slot_count(); ++slot)
         {
-            blas_indices.push_back(path_tracer.add_blas(path_tracer_cb, tunnel.vertex_buffer, tunnel.index_buffer, std::vector<uint32_t>{0}, std::vector<uint32_t>{index_count}, sizeof(TunnelVertex)));
-            instance_indices.push_back(path_tracer.add_instance(blas_indices.back(), glm::mat4(1.0f), 666));
+            blas_indices.push_back(path_tracer.add_blas(path_tracer_cb, tunnel.blas_vertex_buffer, tunnel.index_pattern_buffer, {get_lod_index_offset(0)}, {get_lod_indices_per_segment(0)}, tunnel.blas_vertex_stride, {slot * vertices_per_segment}, vk::IndexType::eUint16, true));
+            instance_indices.push_back(path_tracer.add_instance(blas_indices.back(), glm::mat4(1.0f), tunnel_slot_instance_custom_index + slot));
+            slot_blas_lods.push_back(0);
+            // the initial segments were not measured, so the first new segment of each slot is a full build
+            slot_blas_refit_counts.push_back(0);
+            slot_blas_build_areas.push_back(0.0f);
+            const uint32_t rendered_idx = (slot + get_segment_slot_count() - first_segment.segment_uid % get_segment_slot_count()) % get_segment_slot_count();
+            path_tracer.set_instance_mask(instance_indices.back(), (blas_ring && rendered_idx < segment_count) ? 0xFF : 0);
         }
+        path_tracer.set_instance_mask(instance_indices[0], blas_ring ? 0 : 0xFF);
         vcc.submit_compute(path_tracer_cb, true);
     }
 
@@ -84,16 +124,18 @@ namespace ve
 
     void TunnelObjects::construct_pipelines()
     {
-        std::array<vk::SpecializationMapEntry, 4> compute_entries;
+        std::array<vk::SpecializationMapEntry, 7> compute_entries;
         compute_entries[0] = vk::SpecializationMapEntry(0, 0, sizeof(uint32_t));
         compute_entries[1] = vk::SpecializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t));
         compute_entries[2] = vk::SpecializationMapEntry(2, sizeof(uint32_t) * 2, sizeof(uint32_t));
         compute_entries[3] = vk::SpecializationMapEntry(3, sizeof(uint32_t) * 3, sizeof(uint32_t));
-        std::array<uint32_t, 4> compute_entries_data{segment_count, samples_per_segment, vertices_per_sample, fireflies_per_segment};
+        compute_entries[4] = vk::SpecializationMapEntry(4, sizeof(uint32_t) * 4, sizeof(uint32_t));
+        compute_entries[5] = vk::SpecializationMapEntry(5, sizeof(uint32_t) * 5, sizeof(uint32_t));
+        compute_entries[6] = vk::SpecializationMapEntry(6, sizeof(uint32_t) * 6, sizeof(uint32_t));
+        std::array<uint32_t, 7> compute_entries_data{segment_count, samples_per_segment, vertices_per_sample, fireflies_per_segment, compact_tunnel_vertices, tunnel_tile_vertices, tunnel_tile_rings};
         vk::SpecializationInfo compute_spec_info(compute_entries.size(), compute_entries.data(), compute_entries_data.size() * sizeof(uint32_t), compute_entries_data.data());
 
         compute_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"tunnel.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(NewSegmentPushConstants));
-        compute_normals_pipeline.construct(compute_dsh.get_layouts()[0], ShaderInfo{"tunnel_normals.comp", vk::ShaderStageFlagBits::eCompute, compute_spec_info}, sizeof(NewSegmentPushConstants));
     }
 
     void TunnelObjects::reload_shaders(const RenderPass& render_pass)
@@ -105,57 +147,155 @@ namespace ve
         construct_pipelines();
     }
 
+    void TunnelObjects::cull(vk::CommandBuffer& cb, GameState& gs)
+    {
+        tunnel.cull(cb, gs);
+    }
+
     void TunnelObjects::draw(vk::CommandBuffer& cb, GameState& gs)
     {
         fireflies.draw(cb, gs);
         tunnel.draw(cb, gs, cpc.p1, cpc.p2);
     }
 
-    void TunnelObjects::compute_new_segment(vk::CommandBuffer& cb, uint32_t current_frame)
+    void TunnelObjects::compute_new_segment(vk::CommandBuffer& cb, uint32_t descriptor_set_idx, uint32_t slot, uint32_t flags)
     {
-        cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, compute_pipeline.get_layout(), 0, compute_dsh.get_sets()[current_frame], {});
+        // slot is either a segment slot of the tunnel vertex buffer or a slot of the prefetch buffer
+        cpc.vertex_start_idx = slot * vertices_per_segment;
+        cpc.flags = flags;
+        cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, compute_pipeline.get_layout(), 0, compute_dsh.get_sets()[descriptor_set_idx], {});
         cb.pushConstants(compute_pipeline.get_layout(), vk::ShaderStageFlagBits::eCompute, 0, sizeof(NewSegmentPushConstants), &cpc);
         cb.bindPipeline(vk::PipelineBindPoint::eCompute, compute_pipeline.get());
-        cb.dispatch(std::max((fireflies_per_segment + 31) / 32, (vertices_per_sample * samples_per_segment + 31) / 32), 1, 1);
+        // positions and normals are generated in the same pass, every workgroup computes the normals of its tile from the positions in shared memory
+        const uint32_t group_count_x = (vertices_per_sample + tunnel_tile_vertices - 1) / tunnel_tile_vertices;
+        const uint32_t group_count_y = (samples_per_segment + tunnel_tile_rings - 1) / tunnel_tile_rings;
+        const uint32_t threads_per_group_row = group_count_x * tunnel_tile_vertices * tunnel_tile_rings;
+        cb.dispatch(group_count_x, std::max(group_count_y, (fireflies_per_segment + threads_per_group_row - 1) / threads_per_group_row), 1);
+    }
 
+    void TunnelObjects::insert_prefetched_segment(vk::CommandBuffer& cb, uint32_t current_frame, uint32_t prefetch_slot)
+    {
+        // the vertices were already generated on the async compute queue, so only copy them into the segment slot
+        const uint32_t slot = cpc.segment_uid % get_segment_slot_count();
+        const vk::DeviceSize segment_byte_size = vertices_per_segment * get_tunnel_vertex_byte_size();
+        vk::BufferCopy copy_region(prefetch_slot * segment_byte_size, slot * segment_byte_size, segment_byte_size);
+        Buffer& prefetch_buffer = storage.get_buffer(prefetch_vertex_buffer);
         Buffer& buffer = storage.get_buffer(tunnel.vertex_buffer);
-        vk::BufferMemoryBarrier buffer_memory_barrier(vk::AccessFlagBits::eMemoryWrite, vk::AccessFlagBits::eMemoryRead, vmc.queue_family_indices.compute, vmc.queue_family_indices.compute, buffer.get(), 0, buffer.get_byte_size());
-        cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlagBits::eDeviceGroup, {}, {buffer_memory_barrier}, {});
+        vk::BufferMemoryBarrier prefetch_buffer_memory_barrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eTransferRead, vmc.queue_family_indices.compute, vmc.queue_family_indices.compute, prefetch_buffer.get(), copy_region.srcOffset, copy_region.size);
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eTransfer, vk::DependencyFlagBits::eDeviceGroup, {}, {prefetch_buffer_memory_barrier}, {});
+        cb.copyBuffer(prefetch_buffer.get(), buffer.get(), copy_region);
+        vk::BufferMemoryBarrier buffer_memory_barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead, vmc.queue_family_indices.compute, vmc.queue_family_indices.compute, buffer.get(), copy_region.dstOffset, copy_region.size);
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlagBits::eDeviceGroup, {}, {buffer_memory_barrier}, {});
+        compute_new_segment(cb, current_frame, slot, segment_flag_insert);
+    }
 
-        cb.bindPipeline(vk::PipelineBindPoint::eCompute, compute_normals_pipeline.get());
-        cb.dispatch(((vertices_per_sample * samples_per_segment + 31) / 32), 1, 1);
+    void TunnelObjects::prefetch_segments(uint32_t total_frames)
+    {
+        if (vmc.logical_device.get().getFenceStatus(prefetch_fence) != vk::Result::eSuccess) return;
+        // everything that was submitted before is finished now
+        prefetch_ready_count = prefetch_count;
+        const NewSegmentPushConstants cpc_backup = cpc;
+        vk::CommandBuffer* cb = nullptr;
+        while (prefetch_count < prefetch_segment_count)
+        {
+            const uint32_t slot = (prefetch_first_slot + prefetch_count) % prefetch_segment_count;
+            if (total_frames < prefetch_slot_release_frames[slot]) break;
+            if (!cb)
+            {
+                vmc.logical_device.get().resetFences(prefetch_fence);
+                cb = &vcc.begin(vcc.async_compute_cb[0]);
+            }
+            // continue the curve of the newest segment, which is either the newest prefetched one or the newest one in the tunnel
+            const NewSegmentPushConstants& last = prefetch_count > 0 ? prefetched_segments[(slot + prefetch_segment_count - 1) % prefetch_segment_count] : cpc_backup;
+            NewSegmentPushConstants& segment = prefetched_segments[slot];
+            segment.segment_uid = last.segment_uid + 1;
+            segment.p1 = last.p2 + last.p2 - last.p1;
+            segment.p0 = last.p2;
+            segment.p2 = path.pop_bezier_point_queue(segment.p0, segment.p1);
+            cpc = segment;
+            compute_new_segment(*cb, frames_in_flight, slot, segment_flag_generate_geometry);
+            prefetch_count++;
+        }
+        cpc = cpc_backup;
+        if (cb) vcc.submit_async_compute(*cb, prefetch_fence);
     }
 
-    glm::vec3 TunnelObjects::random_cosine(const glm::vec3& normal, const float cosine_weight)
+    void TunnelObjects::wait_for_prefetch()
     {
-        float theta = std::acos(std::pow(1.0f - std::abs(dis(rnd)), 1.0f / (1.0f + cosine_weight)));
-        float phi = 2.0f * M_PIf * dis(rnd);
-        glm::vec3 up = abs(normal.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
-        glm::vec3 tangent = glm::normalize(glm::cross(up, normal));
-        glm::vec3 bitangent = glm::cross(normal, tangent);
+        VE_CHECK(vmc.logical_device.get().waitForFences(prefetch_fence, VK_TRUE, uint64_t(-1)), "Failed to wait for tunnel prefetch!");
+        prefetch_ready_count = prefetch_count;
+    }
 
-        glm::vec3 sample = glm::vec3(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
-        return glm::normalize(tangent * sample.x + bitangent * sample.y + normal * sample.z);
+    void TunnelObjects::get_segment_index_ranges(uint32_t first_segment_slot, bool adaptive_tessellation, std::vector<uint32_t>& index_offsets, std::vector<uint32_t>& index_counts, std::vector<uint32_t>& first_vertices)
+    {
+        // one geometry per segment to be able to use a different tessellation level for each of them
+        // all geometries of a level share the same 16 bit index pattern, the first vertex moves it to the vertices of the segment's slot
+        for (uint32_t i = 0; i < segment_count; ++i)
+        {
+            const uint32_t lod = adaptive_tessellation ? get_segment_lod(i) : 0;
+            index_counts.push_back(get_lod_indices_per_segment(lod));
+            index_offsets.push_back(get_lod_index_offset(lod));
+            first_vertices.push_back(((first_segment_slot + i) % get_segment_slot_count()) * vertices_per_segment);
+        }
+    }
+
+    void TunnelObjects::update_slot_blas(GameState& gs, PathTracer& path_tracer, bool rebuild_all, uint32_t new_segment_slot)
+    {
+        // only the slot of a new segment and slots whose segment crossed a tessellation distance are built, the others keep their acceleration structures
+        if (rebuild_all) std::fill(slot_blas_lods.begin(), slot_blas_lods.end(), uint32_t(-1));
+        for (uint32_t i = 0; i < segment_count; ++i)
+        {
+            const uint32_t slot = (gs.first_segment_slot + i) % get_segment_slot_count();
+            const uint32_t lod = gs.adaptive_tessellation ? get_segment_lod(i) : 0;
+            if (slot_blas_lods[slot] != lod || slot == new_segment_slot)
+            {
+                // all segments of a level have the same topology and their vertices are ordered the same way along the center line,
+                // so a new segment of the level the slot was built with can be refit until its bounds grew too much or it was refit too often
+                const float bounds_area = get_segment_bounds_area(cpc.segment_uid - segment_count + 1 + i);
+                const bool refit = gs.tunnel_blas_refit && slot_blas_lods[slot] == lod && slot_blas_refit_counts[slot] < max_tunnel_blas_refits && bounds_area < slot_blas_build_areas[slot] * max_tunnel_blas_refit_area_ratio;
+                path_tracer.update_blas(tunnel.blas_vertex_buffer, tunnel.index_pattern_buffer, {get_lod_index_offset(lod)}, {get_lod_indices_per_segment(lod)}, blas_indices[1 + slot], gs.current_frame, tunnel.blas_vertex_stride, {slot * vertices_per_segment}, vk::IndexType::eUint16, refit);
+                if (refit)
+                {
+                    slot_blas_refit_counts[slot]++;
+                }
+                else
+                {
+                    slot_blas_refit_counts[slot] = 0;
+                    slot_blas_build_areas[slot] = bounds_area;
+                }
+                slot_blas_lods[slot] = lod;
+            }
+            path_tracer.set_instance_mask(instance_indices[1 + slot], 0xFF);
+        }
+        // the single slot that is not rendered held the segment that was dropped by the last advance
+        path_tracer.set_instance_mask(instance_indices[1 + (gs.first_segment_slot + segment_count) % get_segment_slot_count()], 0);
     }
 
-    glm::vec3 TunnelObjects::pop_tunnel_bezier_point_queue()
+    float TunnelObjects::get_segment_bounds_area(uint32_t segment_uid)
     {
-        // no more Bézier points left, create either a long curve or a small segment
-        if (tunnel_bezier_points_queue.empty())
+        // sum of the surface areas of boxes around a few pieces of the segment, which grows like the SAH cost of a refit acceleration structure
+        // the pieces are bounded by the rings at their ends, the wall is at most 20 away from the center line (see get_tunnel_wall_radius)
+        constexpr uint32_t pieces = 8;
+        constexpr float max_wall_radius = 20.0f;
+        const TunnelSegmentPoints segment{get_tunnel_bezier_point(segment_uid, 0, true), get_tunnel_bezier_point(segment_uid, 1, true), get_tunnel_bezier_point(segment_uid, 2, true), segment_uid};
+        float area = 0.0f;
+        for (uint32_t i = 0; i < pieces; ++i)
         {
-            // high probability for small segment leads to areas with small curvy segments and single long curves
-            const uint32_t random_weight = dis(rnd) < 0.98f ? 1 : 16;
-            glm::vec3 p2 = cpc.p0 + segment_scale * random_weight * random_cosine(glm::normalize(cpc.p1 - cpc.p0), -2.0f * random_weight + 42.0);
-            glm::vec3 p1 = cpc.p0 + (cpc.p1 - cpc.p0) * float(random_weight);
-            for (uint32_t i = 0; i < random_weight; ++i)
+            glm::vec3 min_corner(std::numeric_limits<float>::max());
+            glm::vec3 max_corner(std::numeric_limits<float>::lowest());
+            for (uint32_t j = 0; j < 2; ++j)
             {
-                const float t = float(i + 1) / float(random_weight);
-                tunnel_bezier_points_queue.push(std::pow(1 - t, 2.0f) * cpc.p0 + (2 - 2 * t) * t * p1 + std::pow(t, 2.0f) * p2);
+                const TunnelRingFrame frame = get_tunnel_ring_frame(segment, float(i + j) / float(pieces));
+                const glm::vec3 normal = glm::normalize(frame.plane_normal);
+                // half extent of the box around a circle with the given normal
+                const glm::vec3 extent = max_wall_radius * glm::sqrt(glm::max(1.0f - normal * normal, glm::vec3(0.0f)));
+                min_corner = glm::min(min_corner, frame.center - extent);
+                max_corner = glm::max(max_corner, frame.center + extent);
             }
+            const glm::vec3 size = max_corner - min_corner;
+            area += 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
         }
-        glm::vec3 p = tunnel_bezier_points_queue.front();
-        tunnel_bezier_points_queue.pop();
-        return p;
+        return area;
     }
 
     glm::vec3& TunnelObjects::get_tunnel_bezier_point(uint32_t segment_id, uint32_t bezier_point_idx, bool use_global_id)
@@ -165,59 +305,141 @@ namespace ve
         return tunnel_bezier_points[(segment_id * 2 + bezier_point_idx) % tunnel_bezier_points.size()];
     }
 
+    std::vector<TunnelSegmentPoints> TunnelObjects::get_rendered_segments()
+    {
+        std::vector<TunnelSegmentPoints> segments;
+        for (uint32_t i = 0; i < segment_count; ++i)
+        {
+            segments.push_back(TunnelSegmentPoints{get_tunnel_bezier_point(i, 0, false), get_tunnel_bezier_point(i, 1, false), get_tunnel_bezier_point(i, 2, false), cpc.segment_uid - segment_count + 1 + i});
+        }
+        return segments;
+    }
+
     void TunnelObjects::advance(GameState& gs, DeviceTimer& timer, PathTracer& path_tracer)
     {
         vk::CommandBuffer& cb = vcc.begin(vcc.compute_cb[gs.current_frame]);
-        FireflyMovePushConstants fmpc{.time = gs.time, .time_diff = gs.time_diff, .segment_uid = cpc.segment_uid, .first_segment_indices_idx = gs.first_segment_indices_idx};
+        path_tracer.release_retired(gs.current_frame);
+        FireflyMovePushConstants fmpc{.time = gs.time, .time_diff = gs.time_diff, .segment_uid = cpc.segment_uid, .first_segment_slot = gs.first_segment_slot};
         fireflies.move_step(cb, gs, timer, fmpc);
+        // the acceleration structure also needs to be rebuilt if the tessellation mode was switched
+        bool blas_dirty = gs.adaptive_tessellation != blas_adaptive_tessellation;
+        // the acceleration structures of the mode that was not used are stale as the segments moved on in the meantime
+        const bool blas_mode_switched = gs.tunnel_blas_ring != blas_ring;
+        uint32_t new_segment_slot = uint32_t(-1);
         if (is_pos_past_segment(gs.player_pos, player_segment_position + 1, false))
         {
             // player passed a segment, add distance of passed segment
             glm::vec3& bp0 = get_tunnel_bezier_point(player_segment_position, 0, false);
             glm::vec3& bp1 = get_tunnel_bezier_point(player_segment_position, 1, false);
             glm::vec3& bp2 = get_tunnel_bezier_point(player_segment_position, 2, false);
-            // increment the idx at which the compute shader starts to compute new vertices for the corresponding indices by the number of indices in one segment
-            // increment the idx at which the rendering starts by the same amount
+            // the new segment replaces the oldest one in the ring of segment slots and the rendering starts one slot later
             cpc.segment_uid++;
-            cpc.indices_start_idx += indices_per_segment;
-            gs.first_segment_indices_idx += indices_per_segment;
+            gs.first_segment_slot = (gs.first_segment_slot + 1) % get_segment_slot_count();
+            const uint32_t slot = cpc.segment_uid % get_segment_slot_count();
 
-            // add new segment points
-            const glm::vec3 normal = glm::normalize(cpc.p2 - cpc.p1);
-            cpc.p1 = cpc.p2 + cpc.p2 - cpc.p1;
-            cpc.p0 = cpc.p2;
-            cpc.p2 = pop_tunnel_bezier_point_queue();
-            tunnel_bezier_points[(cpc.segment_uid * 2 + 1) % tunnel_bezier_points.size()] = cpc.p1;
-            tunnel_bezier_points[(cpc.segment_uid * 2 + 2) % tunnel_bezier_points.size()] = cpc.p2;
-            // reset indices; compute shader inserts data at the last segment of the region that will be rendered now
-            // indices need to be resetted if compute shader would write outside of the buffer or if the render region goes beyond the buffer
-            // these 2 conditions are always met at the same time (as compute shader writes last rendered segment)
-            if (cpc.indices_start_idx >= index_count * 2)
+            // segments that were already prefetched have to be used first as they consumed the next points of the path
+            const bool use_prefetched = prefetch_count > 0;
+            if (use_prefetched)
             {
-                cpc.indices_start_idx = index_count - indices_per_segment;
-                gs.first_segment_indices_idx = 0;
+                // player was faster than the prefetch, this only stalls if the async queue is heavily loaded
+                if (prefetch_ready_count == 0) wait_for_prefetch();
+                const NewSegmentPushConstants& segment = prefetched_segments[prefetch_first_slot];
+                cpc.p0 = segment.p0;
+                cpc.p1 = segment.p1;
+                cpc.p2 = segment.p2;
             }
+            else
+            {
+                // add new segment points
+                cpc.p1 = cpc.p2 + cpc.p2 - cpc.p1;
+                cpc.p0 = cpc.p2;
+                cpc.p2 = path.pop_bezier_point_queue(cpc.p0, cpc.p1);
+            }
+            tunnel_bezier_points[(cpc.segment_uid * 2 + 1) % tunnel_bezier_points.size()] = cpc.p1;
+            tunnel_bezier_points[(cpc.segment_uid * 2 + 2) % tunnel_bezier_points.size()] = cpc.p2;
 
-            timer.reset(cb, {DeviceTimer::COMPUTE_TUNNEL_ADVANCE});
+            timer.reset(cb, {DeviceTimer::COMPUTE_TUNNEL_ADVANCE, DeviceTimer::COMPUTE_TUNNEL_SEGMENT});
             timer.start(cb, DeviceTimer::COMPUTE_TUNNEL_ADVANCE, vk::PipelineStageFlagBits::eAllCommands);
             Buffer& buffer = storage.get_buffer_by_name("firefly_vertices_" + std::to_string(gs.current_frame));
             vk::BufferMemoryBarrier firefly_buffer_memory_barrier(vk::AccessFlagBits::eMemoryWrite, vk::AccessFlagBits::eMemoryWrite, vmc.queue_family_indices.compute, vmc.queue_family_indices.compute, buffer.get(), 0, buffer.get_byte_size());
             cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlagBits::eDeviceGroup, {}, {firefly_buffer_memory_barrier}, {});
-            compute_new_segment(cb, gs.current_frame);
-            // write copy of data to the first half of the buffer if idx is in the past half of the data
-            if (cpc.indices_start_idx > index_count)
+            // time of a single segment; with prefetching this only covers the copy and the insertion as the geometry was generated on the async compute queue
+            timer.start(cb, DeviceTimer::COMPUTE_TUNNEL_SEGMENT, vk::PipelineStageFlagBits::eAllCommands);
+            if (use_prefetched) insert_prefetched_segment(cb, gs.current_frame, prefetch_first_slot);
+            else compute_new_segment(cb, gs.current_frame, slot, segment_flag_generate_geometry | segment_flag_insert);
+            timer.stop(cb, DeviceTimer::COMPUTE_TUNNEL_SEGMENT, vk::PipelineStageFlagBits::eAllCommands);
+            timer.stop(cb, DeviceTimer::COMPUTE_TUNNEL_ADVANCE, vk::PipelineStageFlagBits::eAllCommands);
+            if (use_prefetched)
             {
-                cpc.indices_start_idx -= (index_count + indices_per_segment);
-                compute_new_segment(cb, gs.current_frame);
-                cpc.indices_start_idx += (index_count + indices_per_segment);
+                prefetch_slot_release_frames[prefetch_first_slot] = gs.total_frames + frames_in_flight;
+                prefetch_first_slot = (prefetch_first_slot + 1) % prefetch_segment_count;
+                prefetch_count--;
+                prefetch_ready_count--;
             }
-            timer.stop(cb, DeviceTimer::COMPUTE_TUNNEL_ADVANCE, vk::PipelineStageFlagBits::eAllCommands);
-            vk::BufferMemoryBarrier tunnel_buffer_memory_barrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eMemoryRead, vmc.queue_family_indices.compute, vmc.queue_family_indices.compute, storage.get_buffer(tunnel.vertex_buffer).get(), 0, storage.get_buffer(tunnel.vertex_buffer).get_byte_size());
+            vk::BufferMemoryBarrier tunnel_buffer_memory_barrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eMemoryRead, vmc.queue_family_indices.compute, vmc.queue_family_indices.compute, storage.get_buffer(tunnel.blas_vertex_buffer).get(), 0, storage.get_buffer(tunnel.blas_vertex_buffer).get_byte_size());
             cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::DependencyFlagBits::eDeviceGroup, {}, {tunnel_buffer_memory_barrier}, {});
-            path_tracer.update_blas(tunnel.vertex_buffer, tunnel.index_buffer, std::vector<uint32_t>{gs.first_segment_indices_idx}, std::vector<uint32_t>{index_count}, blas_indices[0], gs.current_frame, sizeof(TunnelVertex));
+            blas_dirty = true;
+            new_segment_slot = slot;
+        }
+        if (gs.irradiance_cache_mode != irradiance_cache_mode_off || gs.irradiance_cache_error_view)
+        {
+            // the cache covers the rendered segments after the advance
+            fmpc.segment_uid = cpc.segment_uid;
+            fmpc.first_segment_slot = gs.first_segment_slot;
+            fireflies.update_irradiance_cache(cb, gs, timer, fmpc);
+        }
+        if (blas_mode_switched)
+        {
+            blas_ring = gs.tunnel_blas_ring;
+            path_tracer.set_instance_mask(instance_indices[0], blas_ring ? 0 : 0xFF);
+            if (!blas_ring) for (uint32_t slot = 0; slot < get_segment_slot_count(); ++slot) path_tracer.set_instance_mask(instance_indices[1 + slot], 0);
+        }
+        if (blas_ring)
+        {
+            // with one acceleration structure per slot an advance only builds the new segment and the tlas swaps the visible slot
+            if (blas_dirty || blas_mode_switched) update_slot_blas(gs, path_tracer, blas_mode_switched, new_segment_slot);
+            blas_adaptive_tessellation = gs.adaptive_tessellation;
+        }
+        else if (blas_dirty || blas_mode_switched)
+        {
+            blas_adaptive_tessellation = gs.adaptive_tessellation;
+            std::vector<uint32_t> index_offsets, index_counts, first_vertices;
+            get_segment_index_ranges(gs.first_segment_slot, gs.adaptive_tessellation, index_offsets, index_counts, first_vertices);
+            path_tracer.update_blas(tunnel.blas_vertex_buffer, tunnel.index_pattern_buffer, index_offsets, index_counts, blas_indices[0], gs.current_frame, tunnel.blas_vertex_stride, first_vertices, vk::IndexType::eUint16);
+        }
+        // builds that were marked by the other frame in flight are also timed here; full builds and refits are timed separately to compare them
+        if (path_tracer.has_dirty_blas(gs.current_frame, false))
+        {
+            timer.reset(cb, {DeviceTimer::COMPUTE_BLAS_BUILD});
+            timer.start(cb, DeviceTimer::COMPUTE_BLAS_BUILD, vk::PipelineStageFlagBits::eAllCommands);
+            path_tracer.build_dirty_blas(cb, gs.current_frame, false);
+            timer.stop(cb, DeviceTimer::COMPUTE_BLAS_BUILD, vk::PipelineStageFlagBits::eAllCommands);
+        }
+        if (path_tracer.has_dirty_blas(gs.current_frame, true))
+        {
+            timer.reset(cb, {DeviceTimer::COMPUTE_BLAS_REFIT});
+            timer.start(cb, DeviceTimer::COMPUTE_BLAS_REFIT, vk::PipelineStageFlagBits::eAllCommands);
+            path_tracer.build_dirty_blas(cb, gs.current_frame, true);
+            timer.stop(cb, DeviceTimer::COMPUTE_BLAS_REFIT, vk::PipelineStageFlagBits::eAllCommands);
+        }
+        // the static scene models are compacted here as this command buffer builds the top level acceleration structure that references them
+        path_tracer.compact_blas(cb, gs.current_frame);
+        gs.blas_compaction_saved_bytes = path_tracer.get_compaction_saved_bytes();
+        gs.scratch_arena_bytes = path_tracer.get_scratch_bytes();
+        gs.dedicated_scratch_bytes = path_tracer.get_dedicated_scratch_bytes();
+        // builds and refits of the top level acceleration structure share the timer, frames that reuse it are not timed
+        const TLASUpdate tlas_update = path_tracer.get_tlas_update(gs.current_frame);
+        if (tlas_update != TLASUpdate::None)
+        {
+            timer.reset(cb, {DeviceTimer::COMPUTE_TLAS_BUILD});
+            timer.start(cb, DeviceTimer::COMPUTE_TLAS_BUILD, vk::PipelineStageFlagBits::eAllCommands);
         }
         path_tracer.create_tlas(cb, gs.current_frame);
+        if (tlas_update != TLASUpdate::None) timer.stop(cb, DeviceTimer::COMPUTE_TLAS_BUILD, vk::PipelineStageFlagBits::eAllCommands);
+        gs.tlas_update = uint32_t(tlas_update);
         cb.end();
+        // refill the prefetch ring in the background; submitted segments are used by later advances
+        if (gs.tunnel_prefetch) prefetch_segments(gs.total_frames);
     }
 
     bool TunnelObjects::is_pos_past_segment(glm::vec3 pos, uint32_t idx, bool use_global_id)
@@ -234,4 +456,74 @@ namespace ve
     {
         return glm::normalize(get_tunnel_bezier_point(player_segment_position, 1, false) - get_tunnel_bezier_point(player_segment_position, 0, false));
     }
+
+    glm::vec3 TunnelObjects::get_tunnel_path_position(float progress)
+    {
+        const uint32_t segment_id = player_segment_position + uint32_t(progress);
+        const float t = progress - std::floor(progress);
+        return (1.0f - t) * (1.0f - t) * get_tunnel_bezier_point(segment_id, 0, false) + (2.0f - 2.0f * t) * t * get_tunnel_bezier_point(segment_id, 1, false) + t * t * get_tunnel_bezier_point(segment_id, 2, false);
+    }
+
+    glm::vec3 TunnelObjects::get_tunnel_path_direction(float progress)
+    {
+        const uint32_t segment_id = player_segment_position + uint32_t(progress);
+        const float t = progress - std::floor(progress);
+        return glm::normalize((2.0f - 2.0f * t) * (get_tunnel_bezier_point(segment_id, 1, false) - get_tunnel_bezier_point(segment_id, 0, false)) + 2.0f * t * (get_tunnel_bezier_point(segment_id, 2, false) - get_tunnel_bezier_point(segment_id, 1, false)));
+    }
+
+    TunnelQueryResult TunnelObjects::query_tunnel(const glm::vec3& pos)
+    {
+        return ve::query_tunnel(get_rendered_segments(), pos);
+    }
+
+    void TunnelObjects::validate_segments_on_cpu(const GameState& gs)
+    {
+        constexpr float position_tolerance = 1e-2f;
+        constexpr float normal_tolerance = 1e-2f;
+        vmc.logical_device.get().waitIdle();
+        const std::vector<TunnelSegmentPoints> segments = get_rendered_segments();
+        HostTimer timer;
+        std::vector<TunnelVertex> cpu_vertices;
+        generator.generate_segments(segments, cpu_vertices);
+        const float cpu_time = timer.elapsed<std::milli>();
+
+        std::vector<TunnelVertex> gpu_vertices;
+        if (compact_tunnel_vertices)
+        {
+            // expand the compact vertices on the cpu, the result has to match the cpu reference after the same compaction
+            const std::vector<CompactTunnelVertex> compact_vertices = storage.get_buffer(tunnel.vertex_buffer).obtain_data<CompactTunnelVertex>(get_segment_slot_count() * vertices_per_segment);
+            const std::vector<glm::vec3> blas_positions = storage.get_buffer(tunnel.blas_vertex_buffer).obtain_data<glm::vec3>(get_segment_slot_count() * vertices_per_segment);
+            std::vector<CompactTunnelVertex> compact_cpu_vertices(vertices_per_segment);
+            gpu_vertices.resize(get_segment_slot_count() * vertices_per_segment);
+            float max_blas_position_error = 0.0f;
+            for (uint32_t i = 0; i < segment_count; ++i)
+            {
+                const uint32_t slot = (gs.first_segment_slot + i) % get_segment_slot_count();
+                generator.expand_segment(segments[i], compact_vertices.data() + slot * vertices_per_segment, gpu_vertices.data() + slot * vertices_per_segment);
+                generator.compact_segment(segments[i], cpu_vertices.data() + i * vertices_per_segment, compact_cpu_vertices.data());
+                generator.expand_segment(segments[i], compact_cpu_vertices.data(), cpu_vertices.data() + i * vertices_per_segment);
+                for (uint32_t j = 0; j < vertices_per_segment; ++j) max_blas_position_error = std::max(max_blas_position_error, glm::distance(blas_positions[slot * vertices_per_segment + j], gpu_vertices[slot * vertices_per_segment + j].pos));
+            }
+            spdlog::info("Acceleration structure positions differ from the expanded compact tunnel vertices by max {}", max_blas_position_error);
+        }
+        else
+        {
+            gpu_vertices = storage.get_buffer(tunnel.vertex_buffer).obtain_data<TunnelVertex>(get_segment_slot_count() * vertices_per_segment);
+        }
+
+        // the rendered segments start at first_segment_slot and continue around the ring of segment slots
+        TunnelSegmentError error;
+        for (uint32_t i = 0; i < segment_count; ++i)
+        {
+            const uint32_t slot = (gs.first_segment_slot + i) % get_segment_slot_count();
+            const TunnelSegmentError segment_error = compare_tunnel_vertices(gpu_vertices.data() + slot * vertices_per_segment, cpu_vertices.data() + i * vertices_per_segment, vertices_per_segment, position_tolerance, normal_tolerance);
+            error.max_position = std::max(error.max_position, segment_error.max_position);
+            error.max_normal = std::max(error.max_normal, segment_error.max_normal);
+            error.max_ao = std::max(error.max_ao, segment_error.max_ao);
+            error.vertices_out_of_tolerance += segment_error.vertices_out_of_tolerance;
+        }
+        spdlog::info("Generated {} tunnel segments on the CPU in {} ms", segment_count, cpu_time);
+        spdlog::info("Tunnel vertices differ from CPU reference by max {} (position), max {} (normal) and max {} (ambient occlusion)", error.max_position, error.max_normal, error.max_ao);
+        if (error.vertices_out_of_tolerance > 0) spdlog::warn("{} of {} tunnel vertices are out of tolerance", error.vertices_out_of_tolerance, vertices_per_segment * segment_count);
+    }
 }
@@ -30,6 +30,12 @@ namespace ve
             transfer_cb.insert(transfer_cb.end(), tmp.begin(), tmp.end());
         }
 
+        void VulkanCommandContext::add_async_compute_buffers(uint32_t count)
+        {
+            auto tmp = command_pools[1].create_command_buffers(count);
+            async_compute_cb.insert(async_compute_cb.end(), tmp.begin(), tmp.end());
+        }
+
         vk::CommandBuffer& VulkanCommandContext::begin(vk::CommandBuffer& cb)
         {
             vk::CommandBufferBeginInfo cbbi{};
@@ -54,6 +60,17 @@ namespace ve
             submit(cb, vmc.get_transfer_queue(), wait_idle);
         }
 
+        void VulkanCommandContext::submit_async_compute(const vk::CommandBuffer& cb, const vk::Fence& fence) const
+        {
+            cb.end();
+            vk::SubmitInfo submit_info{};
+            submit_info.sType = vk::StructureType::eSubmitInfo;
+            submit_info.commandBufferCount = 1;
+            submit_info.pCommandBuffers = &cb;
+            // cb is still pending, it is implicitly reset by the next begin after the fence was signaled
+            vmc.get_async_compute_queue().submit(submit_info, fence);
+        }
+
         void VulkanCommandContext::self_destruct()
         {
             for (auto& command_pool : command_pools) command_pool.self_destruct();
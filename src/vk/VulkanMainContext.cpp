@@ -90,11 +90,27 @@ namespace ve
         return queues.at(QueueIndex::Compute);
     }
 
+    const vk::Queue& VulkanMainContext::get_async_compute_queue() const
+    {
+        return queues.at(QueueIndex::AsyncCompute);
+    }
+
     const vk::Queue& VulkanMainContext::get_present_queue() const
     {
         return queues.at(QueueIndex::Present);
     }
 
+    uint64_t VulkanMainContext::get_allocated_bytes() const
+    {
+        const VkPhysicalDeviceMemoryProperties* memory_properties;
+        vmaGetMemoryProperties(va, &memory_properties);
+        std::vector<VmaBudget> budgets(memory_properties->memoryHeapCount);
+        vmaGetHeapBudgets(va, budgets.data());
+        uint64_t bytes = 0;
+        for (const auto& budget : budgets) bytes += budget.statistics.blockBytes;
+        return bytes;
+    }
+
     void VulkanMainContext::create_vma_allocator()
     {
         VmaAllocatorCreateInfo vaci{};